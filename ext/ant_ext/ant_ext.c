@@ -9,9 +9,30 @@
 
 #include "ant_ext.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ruby/io.h>
+
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+# include <ruby/fiber/scheduler.h>
+#endif
+
 VALUE rant_mAnt;
 
+bool rant_device_initialized = false;
+
 static ID response_callback_ivar;
+static atomic_uchar response_timestamps = 0;
+
+// Set once there's a Ruby response callback, so responses aren't queued for
+// Ruby (and waited on) when there's nothing to call
+static atomic_bool response_callback_set = false;
+
+// The last library configuration set with Ant.lib_config=
+static atomic_uchar lib_config = 0;
+
+static bool rant_config_pipeline_on_response( unsigned char, unsigned char, unsigned char );
 
 
 /* --------------------------------------------------------------
@@ -70,10 +91,355 @@ rant_log( const char *level, const char *fmt, va_dcl )
 }
 
 
+/*
+ * Returns +true+ if the global logger will show debug messages, for skipping
+ * the construction of expensive ones.
+ */
+bool
+rant_log_debug_p()
+{
+	VALUE logger = rb_funcall( rant_mAnt, rb_intern("logger"), 0 );
+	return RTEST( rb_funcall(logger, rb_intern("debug?"), 0) );
+}
+
+
 /* --------------------------------------------------------------
  * Utility functions
  * -------------------------------------------------------------- */
 
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+
+/*
+ * A blocking call that's being run in its own thread on behalf of a fiber.
+ */
+typedef struct rant_blocking_job_t rant_blocking_job_t;
+struct rant_blocking_job_t {
+	void *(*fn)( void * );
+	void *data;
+	void *result;
+	pthread_t thread;
+	int fds[ 2 ];
+	VALUE io;
+};
+
+
+/*
+ * Thread routine for a blocking job: run the call, then make the job's pipe
+ * readable to wake the fiber waiting on it.
+ */
+static void *
+rant_run_blocking_job( void *job_ptr )
+{
+	rant_blocking_job_t *job = (rant_blocking_job_t *)job_ptr;
+	const char done = 1;
+
+	job->result = job->fn( job->data );
+	while ( write(job->fds[1], &done, 1) < 0 && errno == EINTR ) ;
+
+	return NULL;
+}
+
+
+/*
+ * Wait for the job's pipe to become readable, yielding to the fiber scheduler.
+ */
+static VALUE
+rant_wait_for_blocking_job( VALUE job_ptr )
+{
+	rant_blocking_job_t *job = (rant_blocking_job_t *)job_ptr;
+
+	job->io = rb_io_fdopen( job->fds[0], O_RDONLY, NULL );
+	rb_io_wait( job->io, RB_INT2NUM(RUBY_IO_READABLE), Qnil );
+
+	return Qnil;
+}
+
+
+/*
+ * Join the job's thread without the GVL.
+ */
+static void *
+rant_join_blocking_job( void *job_ptr )
+{
+	rant_blocking_job_t *job = (rant_blocking_job_t *)job_ptr;
+
+	pthread_join( job->thread, NULL );
+
+	return NULL;
+}
+
+
+/*
+ * Clean up after a blocking job. The call can't be interrupted, so if the
+ * fiber is unwinding (e.g., because of a timeout) this still has to wait for
+ * it to finish before its data goes out of scope.
+ */
+static VALUE
+rant_finish_blocking_job( VALUE job_ptr )
+{
+	rant_blocking_job_t *job = (rant_blocking_job_t *)job_ptr;
+
+	rb_thread_call_without_gvl( rant_join_blocking_job, job, NULL, NULL );
+
+	if ( NIL_P(job->io) ) {
+		close( job->fds[0] );
+	} else {
+		rb_io_close( job->io );
+	}
+	close( job->fds[1] );
+
+	return Qnil;
+}
+
+#endif
+
+
+/*
+ * Return the RANT_TIMESTAMP_* flags for the +timestamps+ and +realtime+
+ * keyword arguments of a callback registration method, either of which may be
+ * Qundef.
+ */
+unsigned char
+rant_timestamp_flags( VALUE timestamps, VALUE realtime )
+{
+	unsigned char flags = 0;
+
+	if ( timestamps != Qundef && RTEST(timestamps) ) flags |= RANT_TIMESTAMP_MONOTONIC;
+	if ( realtime != Qundef && RTEST(realtime) ) flags |= RANT_TIMESTAMP_REALTIME;
+
+	return flags;
+}
+
+
+/*
+ * Record the current time in the given +callback+ using the clocks in
+ * +flags+. Called from the ANT library's thread as soon as a message arrives.
+ */
+void
+rant_capture_timestamps( rant_callback_t *callback, unsigned char flags )
+{
+	callback->timestamps = flags;
+
+	if ( flags & RANT_TIMESTAMP_MONOTONIC )
+		clock_gettime( CLOCK_MONOTONIC, &callback->monotonic_time );
+	if ( flags & RANT_TIMESTAMP_REALTIME )
+		clock_gettime( CLOCK_REALTIME, &callback->realtime );
+}
+
+
+/*
+ * Append the timestamps recorded in +call+ to the +args+ Array: the
+ * monotonic time as a Float number of seconds (comparable with
+ * <tt>Process.clock_gettime(Process::CLOCK_MONOTONIC)</tt>), then the real time
+ * as a Time.
+ */
+void
+rant_push_timestamps( VALUE args, rant_callback_t *call )
+{
+	if ( call->timestamps & RANT_TIMESTAMP_MONOTONIC ) {
+		rb_ary_push( args, DBL2NUM(
+			(double)call->monotonic_time.tv_sec + (double)call->monotonic_time.tv_nsec / 1e9) );
+	}
+	if ( call->timestamps & RANT_TIMESTAMP_REALTIME ) {
+		rb_ary_push( args, rb_time_nano_new(call->realtime.tv_sec, call->realtime.tv_nsec) );
+	}
+}
+
+
+/*
+ * Call +fn+ with +data+ and return its result, without blocking the rest of
+ * Ruby while it runs. If the current thread has a fiber scheduler, the call
+ * is run in a separate thread and only the calling fiber waits for it;
+ * otherwise the GVL is released for the duration of the call.
+ *
+ * Since +fn+ runs without the GVL, it mustn't touch any Ruby objects.
+ */
+void *
+rant_blocking_call( void *(*fn)(void *), void *data )
+{
+#ifdef HAVE_RB_FIBER_SCHEDULER_CURRENT
+	if ( !NIL_P(rb_fiber_scheduler_current()) ) {
+		rant_blocking_job_t job = {
+			.fn = fn,
+			.data = data,
+			.result = NULL,
+			.io = Qnil,
+		};
+		int err;
+
+		if ( pipe(job.fds) < 0 ) rb_sys_fail( "pipe" );
+		rb_update_max_fd( job.fds[0] );
+		rb_update_max_fd( job.fds[1] );
+		rb_fd_fix_cloexec( job.fds[0] );
+		rb_fd_fix_cloexec( job.fds[1] );
+
+		if ( (err = pthread_create(&job.thread, NULL, rant_run_blocking_job, &job)) != 0 ) {
+			close( job.fds[0] );
+			close( job.fds[1] );
+			rb_syserr_fail( err, "pthread_create" );
+		}
+
+		rb_ensure( rant_wait_for_blocking_job, (VALUE)&job, rant_finish_blocking_job, (VALUE)&job );
+
+		return job.result;
+	}
+#endif
+
+	return rb_thread_call_without_gvl( fn, data, NULL, NULL );
+}
+
+
+/*
+ * The arguments to (and result of) the blocking library commands, so they can
+ * be run via rant_blocking_call().
+ */
+typedef struct rant_command_t rant_command_t;
+struct rant_command_t {
+	unsigned char device_num;
+	unsigned int baud_rate;
+
+	unsigned char channel_num;
+	unsigned char channel_type;
+	unsigned char network_number;
+	unsigned char extended_options;
+	unsigned int response_time;
+
+	unsigned char *key;
+	unsigned char setting;
+
+	bool enable;
+	unsigned char max_packet_length;
+	unsigned long required_fields;
+	unsigned long optional_fields;
+	unsigned short stall_count;
+	unsigned char retry_count;
+
+	bool result;
+};
+
+
+static void *
+rant_init_command( void *ptr )
+{
+	rant_command_t *cmd = (rant_command_t *)ptr;
+
+	cmd->result = ANT_Init( cmd->device_num, cmd->baud_rate );
+
+	return NULL;
+}
+
+
+static void *
+rant_close_command( void *ptr )
+{
+	ANT_Close();
+	return NULL;
+}
+
+
+static void *
+rant_reset_command( void *ptr )
+{
+	ANT_ResetSystem();
+	return NULL;
+}
+
+
+static void *
+rant_set_network_key_command( void *ptr )
+{
+	rant_command_t *cmd = (rant_command_t *)ptr;
+
+	cmd->result = ANT_SetNetworkKey( cmd->network_number, cmd->key );
+
+	return NULL;
+}
+
+
+static void *
+rant_set_transmit_power_command( void *ptr )
+{
+	rant_command_t *cmd = (rant_command_t *)ptr;
+
+	cmd->result = ANT_SetTransmitPower( cmd->setting );
+
+	return NULL;
+}
+
+
+static void *
+rant_assign_channel_command( void *ptr )
+{
+	rant_command_t *cmd = (rant_command_t *)ptr;
+
+	cmd->result = ANT_AssignChannelExt_RTO( cmd->channel_num, cmd->channel_type,
+		cmd->network_number, cmd->extended_options, cmd->response_time );
+
+	return NULL;
+}
+
+
+static void *
+rant_rx_ext_mesgs_enable_command( void *ptr )
+{
+	rant_command_t *cmd = (rant_command_t *)ptr;
+
+	cmd->result = ANT_RxExtMesgsEnable( cmd->enable ? TRUE : FALSE );
+
+	return NULL;
+}
+
+
+static void *
+rant_set_lib_config_command( void *ptr )
+{
+	rant_command_t *cmd = (rant_command_t *)ptr;
+
+	cmd->result = ANT_SetLibConfig( cmd->setting );
+
+	return NULL;
+}
+
+
+static void *
+rant_configure_advanced_burst_command( void *ptr )
+{
+	rant_command_t *cmd = (rant_command_t *)ptr;
+
+	cmd->result = ANT_ConfigureAdvancedBurst_ext( cmd->enable, cmd->max_packet_length,
+		cmd->required_fields, cmd->optional_fields, cmd->stall_count, cmd->retry_count );
+
+	return NULL;
+}
+
+
+static void *
+rant_request_message_command( void *ptr )
+{
+	rant_command_t *cmd = (rant_command_t *)ptr;
+
+	cmd->result = ANT_RequestMessage( cmd->channel_num, cmd->setting );
+
+	return NULL;
+}
+
+
+/*
+ * Request the message with the given +message_id+ from the device without
+ * holding the GVL. Returns +true+ if the request was sent.
+ */
+static bool
+rant_request_message( unsigned char message_id )
+{
+	rant_command_t cmd = { 0 };
+
+	cmd.channel_num = 0;
+	cmd.setting = message_id;
+	rant_blocking_call( rant_request_message_command, &cmd );
+
+	return cmd.result;
+}
+
 
 
 /* --------------------------------------------------------------
@@ -201,6 +567,7 @@ rant_s_init( int argc, VALUE *argv, VALUE _module )
 	VALUE device_num = Qnil, baud_rate = Qnil;
 	unsigned char ucUSBDeviceNum;
 	unsigned int ulBaudrate;
+	rant_command_t cmd = { 0 };
 
 	rb_scan_args( argc, argv, "02", &device_num, &baud_rate );
 
@@ -217,9 +584,14 @@ rant_s_init( int argc, VALUE *argv, VALUE _module )
 	}
 
 	rant_log_obj( rant_mAnt, "info", "Initializing ANT device %d at %d baud", ucUSBDeviceNum, ulBaudrate );
-	if ( !ANT_Init(ucUSBDeviceNum, ulBaudrate) ) {
+	cmd.device_num = ucUSBDeviceNum;
+	cmd.baud_rate = ulBaudrate;
+	rant_blocking_call( rant_init_command, &cmd );
+
+	if ( !cmd.result ) {
 		rb_raise( rb_eRuntimeError, "Initializing the ANT library (no ANT device present?)." );
 	}
+	rant_device_initialized = true;
 
 	return Qtrue;
 }
@@ -256,7 +628,10 @@ rant_s_initialized_p( VALUE _module )
 static VALUE
 rant_s_close( VALUE _module )
 {
-	ANT_Close();
+	// Closing waits for the library's receive thread, which might itself be
+	// waiting on a Ruby callback
+	rant_blocking_call( rant_close_command, NULL );
+	rant_device_initialized = false;
 
 	rant_channel_clear_registry();
 
@@ -280,7 +655,7 @@ rant_s_reset( VALUE _module )
 		.tv_sec = 0,
 		.tv_usec = 500,
 	};
-	ANT_ResetSystem();
+	rant_blocking_call( rant_reset_command, NULL );
 
 	rant_channel_clear_registry();
 
@@ -304,13 +679,20 @@ static VALUE
 rant_s_set_network_key( VALUE _module, VALUE network_number, VALUE key )
 {
 	const unsigned short ucNetNumber = NUM2USHORT( network_number );
-	const char *pucKey = StringValuePtr( key );
+	unsigned char aucKey[ 8 ];
+	rant_command_t cmd = { 0 };
 
+	StringValue( key );
 	if ( RSTRING_LEN(key) != 8 ) {
 		rb_raise( rb_eArgError, "expected an 8-byte key" );
 	}
+	MEMCPY( aucKey, RSTRING_PTR(key), unsigned char, 8 );
+
+	cmd.network_number = (unsigned char)ucNetNumber;
+	cmd.key = aucKey;
+	rant_blocking_call( rant_set_network_key_command, &cmd );
 
-	if ( !ANT_SetNetworkKey(ucNetNumber, (unsigned char *)pucKey) ) {
+	if ( !cmd.result ) {
 		rant_log( "error", "could not set the network key." );
 	}
 
@@ -332,15 +714,16 @@ static VALUE
 rant_s_transmit_power_eq( VALUE _module, VALUE power )
 {
 	const unsigned char ucTransmitPower = NUM2CHR( power );
-	BOOL rval;
+	rant_command_t cmd = { 0 };
 
 	if ( ucTransmitPower < 0 || ucTransmitPower > 4 ) {
 		rb_raise( rb_eArgError, "expected a value between 0 and 4, got %d", ucTransmitPower );
 	}
 
-	rval = ANT_SetTransmitPower( ucTransmitPower );
+	cmd.setting = ucTransmitPower;
+	rant_blocking_call( rant_set_transmit_power_command, &cmd );
 
-	return rval ? Qtrue : Qfalse;
+	return cmd.result ? Qtrue : Qfalse;
 }
 
 
@@ -373,9 +756,14 @@ rant_s_assign_channel( int argc, VALUE *argv, VALUE _module )
 		extended_options,
 		timeout;
 	VALUE args[4];
+	rant_command_t cmd = { 0 };
 
 	rb_scan_args( argc, argv, "23", &channel, &channel_type, &network_number, &extended_options, &timeout );
 
+	if ( NUM2INT(channel) < 0 || NUM2INT(channel) > CHANNEL_NUMBER_MASK ) {
+		rb_raise( rb_eArgError, "channel number must be between 0 and %d", CHANNEL_NUMBER_MASK );
+	}
+
 	ucChannel = NUM2CHR( channel );
 	ucChannelType = NUM2CHR( channel_type );
 
@@ -389,7 +777,14 @@ rant_s_assign_channel( int argc, VALUE *argv, VALUE _module )
 		ulResponseTime = NUM2CHR( timeout );
 	}
 
-	if ( !ANT_AssignChannelExt_RTO(ucChannel, ucChannelType, ucNetworkNumber, ucExtend, ulResponseTime) ) {
+	cmd.channel_num = ucChannel;
+	cmd.channel_type = ucChannelType;
+	cmd.network_number = ucNetworkNumber;
+	cmd.extended_options = ucExtend;
+	cmd.response_time = ulResponseTime;
+	rant_blocking_call( rant_assign_channel_command, &cmd );
+
+	if ( !cmd.result ) {
 		rb_raise( rb_eRuntimeError, "Couldn't assign channel %d", ucChannel );
 	}
 
@@ -419,14 +814,59 @@ rant_s_use_extended_messages_eq( VALUE _module, VALUE true_false )
 	// This is documented as an unsigned char and then explicitly cast
 	// to a signed char. So this just uses their typedef.
 	const BOOL ucEnable = RTEST( true_false ) ? TRUE : FALSE;
+	rant_command_t cmd = { 0 };
 
 	rant_log( "info", "%s extended messages.", ucEnable ? "Enabling" : "Disabling" );
-	ANT_RxExtMesgsEnable( ucEnable );
+	cmd.enable = ucEnable;
+	rant_blocking_call( rant_rx_ext_mesgs_enable_command, &cmd );
 
 	return Qtrue;
 }
 
 
+/*
+ * call-seq:
+ *    Ant.lib_config = flags
+ *
+ * Set the library configuration +flags+, a bitwise OR of the
+ * ANT_LIB_CONFIG_* constants. The ANT_LIB_CONFIG_MESG_OUT_INC_* flags make
+ * the device include the channel ID, RSSI, and/or its receive timestamp with
+ * each received message as flagged extended data, which Ant::Event decodes.
+ *
+ */
+static VALUE
+rant_s_lib_config_eq( VALUE _module, VALUE flags )
+{
+	const UCHAR ucLibConfig = NUM2CHR( flags );
+	rant_command_t cmd = { 0 };
+
+	rant_log( "info", "Setting lib config to 0x%02x.", ucLibConfig );
+	cmd.setting = ucLibConfig;
+	rant_blocking_call( rant_set_lib_config_command, &cmd );
+
+	if ( !cmd.result ) {
+		rb_raise( rb_eRuntimeError, "Couldn't set the lib config to 0x%02x", ucLibConfig );
+	}
+	atomic_store( &lib_config, ucLibConfig );
+
+	return flags;
+}
+
+
+/*
+ * call-seq:
+ *    Ant.lib_config   -> integer
+ *
+ * Return the library configuration flags last set with Ant.lib_config=.
+ *
+ */
+static VALUE
+rant_s_lib_config( VALUE _module )
+{
+	return INT2FIX( atomic_load(&lib_config) );
+}
+
+
 /*
  * call-seq:
  *    Ant.configure_advanced_burst( enabled, max_packet_length, required_fields, optional_fields,
@@ -451,7 +891,7 @@ rant_s_configure_advanced_burst( int argc, VALUE *argv, VALUE _module )
 	unsigned long ulRequiredFields,
 		ulOptionalFields;
 	unsigned short usStallCount = 0;
-	bool rval;
+	rant_command_t cmd = { 0 };
 
 	rb_scan_args( argc, argv, "42", &enabled, &max_packet_length, &required_fields,
 		&optional_fields, &stall_count, &retry_count );
@@ -470,10 +910,15 @@ rant_s_configure_advanced_burst( int argc, VALUE *argv, VALUE _module )
 
 	rant_log( "warn", "Configuring advanced burst: enable = %d, maxpacketlength = %d",
 		bEnable, ucMaxPacketLength );
-	rval = ANT_ConfigureAdvancedBurst_ext( bEnable, ucMaxPacketLength, ulRequiredFields,
-		ulOptionalFields, usStallCount, ucRetryCount );
-
-	return rval ? Qtrue : Qfalse;
+	cmd.enable = bEnable;
+	cmd.max_packet_length = ucMaxPacketLength;
+	cmd.required_fields = ulRequiredFields;
+	cmd.optional_fields = ulOptionalFields;
+	cmd.stall_count = usStallCount;
+	cmd.retry_count = ucRetryCount;
+	rant_blocking_call( rant_configure_advanced_burst_command, &cmd );
+
+	return cmd.result ? Qtrue : Qfalse;
 }
 
 
@@ -481,11 +926,6 @@ rant_s_configure_advanced_burst( int argc, VALUE *argv, VALUE _module )
 // static UCHAR pucResponseBuffer[ MESG_RESPONSE_EVENT_SIZE ];
 static UCHAR pucResponseBuffer[ MESG_MAX_SIZE_VALUE ];
 
-struct on_response_call {
-	UCHAR ucChannel;
-	UCHAR ucResponseMessageId;
-};
-
 
 /*
  * Handle the response callback -- Ruby side.
@@ -493,18 +933,20 @@ struct on_response_call {
 static VALUE
 rant_call_response_callback( VALUE callPtr )
 {
-	struct on_response_call *call = (struct on_response_call *)callPtr;
+	rant_callback_t *call = (rant_callback_t *)callPtr;
 	VALUE rb_callback = rb_ivar_get( rant_mAnt, response_callback_ivar );
 	VALUE rval = Qnil;
 
 	if ( RTEST(rb_callback) ) {
-		VALUE args[3];
-
-		args[0] = INT2FIX( call->ucChannel );
-		args[1] = INT2FIX( call->ucResponseMessageId );
-		args[2] = rb_enc_str_new( (char *)pucResponseBuffer, MESG_MAX_SIZE_VALUE, rb_ascii8bit_encoding() );
-
-		rval = rb_funcallv_public( rb_callback, rb_intern("call"), 3, args );
+		VALUE args = rb_ary_new_from_args( 3,
+			INT2FIX(call->channel),
+			INT2FIX(call->id),
+			rb_enc_str_new((char *)call->data, call->length, rb_ascii8bit_encoding()) );
+
+		rant_push_timestamps( args, call );
+		rval = rb_funcallv_public( rb_callback, rb_intern("call"),
+			RARRAY_LENINT(args), RARRAY_CONST_PTR(args) );
+		RB_GC_GUARD( args );
 	}
 
 	return rval;
@@ -512,53 +954,462 @@ rant_call_response_callback( VALUE callPtr )
 
 
 /*
- * Response callback -- call the registered Ruby callback, if one is set.
+ * Response callback -- queue a snapshot of the response for the registered Ruby
+ * callback, if there is one. Responses the configuration pipeline is waiting for
+ * are its own, and aren't passed on, since the receive thread would otherwise be
+ * waiting on Ruby while the pipeline is waiting on it.
  */
 static BOOL
 rant_on_response_callback( UCHAR ucChannel, UCHAR ucResponseMesgID )
 {
 	rant_callback_t callback;
-	struct on_response_call call;
 
-	call.ucChannel = ucChannel;
-	call.ucResponseMessageId = ucResponseMesgID;
+	// Let the channel know if it's the device turning down one of its sends
+	if ( ucResponseMesgID == MESG_RESPONSE_EVENT_ID ) {
+		rant_channel_on_response_event( ucChannel, pucResponseBuffer[1], pucResponseBuffer[2] );
+		if ( rant_config_pipeline_on_response(ucChannel, pucResponseBuffer[1], pucResponseBuffer[2]) )
+			return TRUE;
+	}
+
+	if ( !atomic_load(&response_callback_set) ) return TRUE;
+
+	rant_capture_timestamps( &callback, atomic_load(&response_timestamps) );
 
-	callback.data = &call;
 	callback.fn = rant_call_response_callback;
+	callback.batch_fn = NULL;
+	callback.channel = ucChannel;
+	callback.id = ucResponseMesgID;
+	callback.priority = true;
+	callback.payload = NULL;
+	callback.length = (unsigned char)rant_message_size( ucResponseMesgID );
+	MEMCPY( callback.data, pucResponseBuffer, unsigned char, callback.length );
 
 	return rant_callback( &callback );
 }
 
 
+/*
+ * Make sure responses are handled, even if there isn't a Ruby callback for
+ * them yet.
+ */
+void
+rant_watch_responses()
+{
+	ANT_AssignResponseFunction( rant_on_response_callback, pucResponseBuffer );
+}
+
+
 /*
  * call-seq:
- *    Ant.on_response {|channel, response_msg_id| ... }
+ *    Ant.on_response( timestamps: false, realtime: false ) {|channel, response_msg_id, data| ... }
  *
  * Sets the response callback. The callback is called whenever a response
  * message is received from ANT. See #set_response_handlers for a set of default
  * handlers.
  *
+ * If +timestamps+ is true, the callback is also passed the time the response
+ * arrived from the ANT library according to the monotonic clock, as a Float
+ * number of seconds comparable with
+ * <tt>Process.clock_gettime(Process::CLOCK_MONOTONIC)</tt>. If +realtime+ is
+ * true, it's passed the wall-clock time it arrived as a Time after that.
+ *
  */
 static VALUE
 rant_s_on_response( int argc, VALUE *argv, VALUE module )
 {
-	VALUE callback = Qnil;
+	VALUE opts = Qnil, callback = Qnil;
+	VALUE values[ 2 ] = { Qundef, Qundef };
+	ID keys[ 2 ];
 
-	rb_scan_args( argc, argv, "0&", &callback );
+	rb_scan_args( argc, argv, "0:&", &opts, &callback );
 
 	if ( !RTEST(callback) ) {
 		rb_raise( rb_eLocalJumpError, "block required, but not given" );
 	}
 
+	if ( !NIL_P(opts) ) {
+		keys[0] = rb_intern( "timestamps" );
+		keys[1] = rb_intern( "realtime" );
+		rb_get_kwargs( opts, keys, 0, 2, values );
+	}
+
 	rant_log( "debug", "Callback is: %s", RSTRING_PTR(rb_inspect(callback)) );
 	rb_ivar_set( module, response_callback_ivar, callback );
+	atomic_store( &response_timestamps, rant_timestamp_flags(values[0], values[1]) );
+	atomic_store( &response_callback_set, true );
 
-	ANT_AssignResponseFunction( rant_on_response_callback, pucResponseBuffer );
+	rant_watch_responses();
 
 	return Qtrue;
 }
 
 
+/*
+ * Pipelined channel configuration
+ */
+
+// The steps of configuring a channel, in the order they're sent
+enum {
+	CONFIG_STEP_ASSIGN,
+	CONFIG_STEP_ID,
+	CONFIG_STEP_PERIOD,
+	CONFIG_STEP_SEARCH_TIMEOUT,
+	CONFIG_STEP_RF_FREQ,
+	CONFIG_STEP_OPEN,
+	CONFIG_STEP_COUNT
+};
+
+// The message each step sends, which is what the device's response to it is
+// about
+static const unsigned char config_step_messages[ CONFIG_STEP_COUNT ] = {
+	MESG_ASSIGN_CHANNEL_ID,
+	MESG_CHANNEL_ID_ID,
+	MESG_CHANNEL_MESG_PERIOD_ID,
+	MESG_CHANNEL_SEARCH_TIMEOUT_ID,
+	MESG_CHANNEL_RADIO_FREQ_ID,
+	MESG_OPEN_CHANNEL_ID,
+};
+
+// The names each step is reported by, which are the names of the equivalent
+// methods
+static const char *config_step_names[ CONFIG_STEP_COUNT ] = {
+	"assign_channel",
+	"set_channel_id",
+	"set_channel_period",
+	"set_channel_search_timeout",
+	"set_channel_rf_freq",
+	"open",
+};
+
+// A response that hasn't arrived yet, or a command that couldn't be sent
+#define CONFIG_NO_RESPONSE  -1
+
+
+/*
+ * The configuration of one channel passed to Ant.configure_channels, and how
+ * far it got.
+ */
+typedef struct rant_channel_config_t rant_channel_config_t;
+struct rant_channel_config_t {
+	unsigned char channel_num;
+	unsigned char channel_type;
+	unsigned char network_number;
+	unsigned char extended_options;
+	unsigned short device_number;
+	unsigned char device_type;
+	unsigned char transmission_type;
+	unsigned short period;
+	unsigned char search_timeout;
+	unsigned char rf_frequency;
+
+	// Bitmask of the steps to run
+	unsigned int steps;
+
+	// The step that failed (CONFIG_STEP_COUNT if none did), and the device's
+	// response code for it
+	int failed_step;
+	int code;
+};
+
+
+/*
+ * The state of a running configuration pipeline: the message each channel is
+ * waiting for a response to (0 if none), the response codes, and how many are
+ * still outstanding. Responses are matched to it from the ANT library's receive
+ * thread, under the mutex.
+ */
+static struct {
+	pthread_mutex_t run_mutex;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	unsigned char expected[ CHANNEL_NUMBER_MASK + 1 ];
+	int codes[ CHANNEL_NUMBER_MASK + 1 ];
+	unsigned int outstanding;
+} config_pipeline = {
+	.run_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
+
+
+/*
+ * The arguments to a pipeline run, so it can be run via rant_blocking_call().
+ */
+typedef struct rant_config_pipeline_run_t rant_config_pipeline_run_t;
+struct rant_config_pipeline_run_t {
+	rant_channel_config_t *configs;
+	long count;
+	unsigned int timeout;
+};
+
+
+/*
+ * Record the device's response +code+ to the message +message_id+ for the
+ * channel +channel_num+ if the configuration pipeline is waiting for it --
+ * called from the ANT library's receive thread. Returns +true+ if it was.
+ */
+static bool
+rant_config_pipeline_on_response( unsigned char channel_num, unsigned char message_id,
+	unsigned char code )
+{
+	const unsigned char i = channel_num & CHANNEL_NUMBER_MASK;
+	bool expected;
+
+	pthread_mutex_lock( &config_pipeline.mutex );
+	expected = config_pipeline.expected[i] && config_pipeline.expected[i] == message_id;
+	if ( expected ) {
+		config_pipeline.expected[ i ] = 0;
+		config_pipeline.codes[ i ] = code;
+		if ( --config_pipeline.outstanding == 0 )
+			pthread_cond_broadcast( &config_pipeline.cond );
+	}
+	pthread_mutex_unlock( &config_pipeline.mutex );
+
+	return expected;
+}
+
+
+/*
+ * Send the command for the given +step+ of the channel +config+ without waiting
+ * for the device's response to it.
+ */
+static bool
+rant_config_pipeline_send( rant_channel_config_t *config, int step )
+{
+	switch ( step ) {
+		case CONFIG_STEP_ASSIGN:
+			return ANT_AssignChannelExt( config->channel_num, config->channel_type,
+				config->network_number, config->extended_options );
+		case CONFIG_STEP_ID:
+			return ANT_SetChannelId( config->channel_num, config->device_number,
+				config->device_type, config->transmission_type );
+		case CONFIG_STEP_PERIOD:
+			return ANT_SetChannelPeriod( config->channel_num, config->period );
+		case CONFIG_STEP_SEARCH_TIMEOUT:
+			return ANT_SetChannelSearchTimeout( config->channel_num, config->search_timeout );
+		case CONFIG_STEP_RF_FREQ:
+			return ANT_SetChannelRFFreq( config->channel_num, config->rf_frequency );
+		case CONFIG_STEP_OPEN:
+			return ANT_OpenChannel( config->channel_num );
+		default:
+			return false;
+	}
+}
+
+
+/*
+ * Run each configuration step for all of the channels at once: send the
+ * step's command to every channel that hasn't failed yet, then wait up to the
+ * run's timeout (in milliseconds) for all of the responses before moving on to
+ * the next one. A channel that's turned down (or doesn't get a response) skips
+ * the rest of its steps.
+ */
+static void *
+rant_config_pipeline_command( void *ptr )
+{
+	rant_config_pipeline_run_t *run = (rant_config_pipeline_run_t *)ptr;
+	struct timespec deadline;
+	long i;
+	int step;
+
+	pthread_mutex_lock( &config_pipeline.run_mutex );
+
+	for ( step = 0; step < CONFIG_STEP_COUNT; step++ ) {
+		pthread_mutex_lock( &config_pipeline.mutex );
+		config_pipeline.outstanding = 0;
+		for ( i = 0; i < run->count; i++ ) {
+			rant_channel_config_t *config = &run->configs[ i ];
+			const unsigned char num = config->channel_num & CHANNEL_NUMBER_MASK;
+
+			config_pipeline.expected[ num ] = 0;
+			if ( config->failed_step != CONFIG_STEP_COUNT || !(config->steps & (1U << step)) )
+				continue;
+
+			config_pipeline.expected[ num ] = config_step_messages[ step ];
+			config_pipeline.codes[ num ] = CONFIG_NO_RESPONSE;
+			config_pipeline.outstanding++;
+		}
+		pthread_mutex_unlock( &config_pipeline.mutex );
+
+		// Send the commands without holding the lock, as the responses to the
+		// first ones can arrive before the last ones are sent
+		for ( i = 0; i < run->count; i++ ) {
+			rant_channel_config_t *config = &run->configs[ i ];
+			const unsigned char num = config->channel_num & CHANNEL_NUMBER_MASK;
+
+			if ( config->failed_step != CONFIG_STEP_COUNT || !(config->steps & (1U << step)) )
+				continue;
+
+			if ( !rant_config_pipeline_send(config, step) ) {
+				pthread_mutex_lock( &config_pipeline.mutex );
+				if ( config_pipeline.expected[num] ) {
+					config_pipeline.expected[ num ] = 0;
+					config_pipeline.outstanding--;
+				}
+				pthread_mutex_unlock( &config_pipeline.mutex );
+			}
+		}
+
+		clock_gettime( CLOCK_REALTIME, &deadline );
+		deadline.tv_sec += run->timeout / 1000;
+		deadline.tv_nsec += (long)( run->timeout % 1000 ) * 1000000L;
+		if ( deadline.tv_nsec >= 1000000000L ) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+
+		pthread_mutex_lock( &config_pipeline.mutex );
+		while ( config_pipeline.outstanding ) {
+			if ( pthread_cond_timedwait(&config_pipeline.cond, &config_pipeline.mutex, &deadline) == ETIMEDOUT )
+				break;
+		}
+
+		for ( i = 0; i < run->count; i++ ) {
+			rant_channel_config_t *config = &run->configs[ i ];
+			const unsigned char num = config->channel_num & CHANNEL_NUMBER_MASK;
+
+			if ( config->failed_step != CONFIG_STEP_COUNT || !(config->steps & (1U << step)) )
+				continue;
+
+			config_pipeline.expected[ num ] = 0;
+			if ( config_pipeline.codes[num] != RESPONSE_NO_ERROR ) {
+				config->failed_step = step;
+				config->code = config_pipeline.codes[ num ];
+			}
+		}
+		config_pipeline.outstanding = 0;
+		pthread_mutex_unlock( &config_pipeline.mutex );
+	}
+
+	pthread_mutex_unlock( &config_pipeline.run_mutex );
+
+	return NULL;
+}
+
+
+/*
+ * Return the value of the given +key+ from the channel +spec+, or +fallback+ if
+ * it doesn't have one. If it does and +step+ isn't negative, the step that
+ * sets it is added to the +config+'s steps.
+ */
+static unsigned int
+rant_config_spec_value( VALUE spec, const char *key, unsigned int fallback,
+	rant_channel_config_t *config, int step )
+{
+	VALUE value = rb_hash_lookup2( spec, ID2SYM(rb_intern(key)), Qnil );
+
+	if ( NIL_P(value) ) return fallback;
+	if ( step >= 0 ) config->steps |= 1U << step;
+
+	return NUM2UINT( value );
+}
+
+
+/*
+ * call-seq:
+ *    Ant.pipeline_channel_config( specs, timeout )   -> array
+ *
+ * Assign, configure, and open the channels described by the given +specs+
+ * with the device's responses to each step pipelined across all of them,
+ * waiting up to +timeout+ milliseconds for each step's responses. Each spec is
+ * a Hash that's already been validated by Ant.configure_channels. Returns an
+ * Array of <tt>[ channel, failed_step, response_code ]</tt> for each spec, in
+ * the same order, where +channel+ is +nil+ if the channel couldn't be assigned,
+ * +failed_step+ is +nil+ if every step succeeded, and +response_code+ is +nil+
+ * if the failed step's command couldn't be sent or the device didn't respond.
+ *
+ */
+static VALUE
+rant_s_pipeline_channel_config( VALUE _module, VALUE specs, VALUE timeout )
+{
+	rant_channel_config_t configs[ CHANNEL_NUMBER_MASK + 1 ];
+	rant_config_pipeline_run_t run = { .configs = configs };
+	VALUE rval;
+	long i;
+
+	Check_Type( specs, T_ARRAY );
+	if ( RARRAY_LEN(specs) > CHANNEL_NUMBER_MASK + 1 ) {
+		rb_raise( rb_eArgError, "can't configure more than %d channels at once",
+			CHANNEL_NUMBER_MASK + 1 );
+	}
+
+	run.count = RARRAY_LEN( specs );
+	run.timeout = NUM2UINT( timeout );
+
+	for ( i = 0; i < run.count; i++ ) {
+		VALUE spec = rb_check_hash_type( RARRAY_AREF(specs, i) );
+		rant_channel_config_t *config = &configs[ i ];
+
+		if ( NIL_P(spec) ) rb_raise( rb_eTypeError, "channel spec %ld isn't a Hash", i );
+
+		MEMZERO( config, rant_channel_config_t, 1 );
+		config->steps = 1U << CONFIG_STEP_ASSIGN;
+		config->failed_step = CONFIG_STEP_COUNT;
+		config->code = CONFIG_NO_RESPONSE;
+
+		config->channel_num = rant_config_spec_value( spec, "channel", 0, config, -1 );
+		config->channel_type = rant_config_spec_value( spec, "channel_type", 0, config, -1 );
+		config->network_number = rant_config_spec_value( spec, "network_number", 0, config, -1 );
+		config->extended_options = rant_config_spec_value( spec, "extended_options", 0, config, -1 );
+		config->device_number = rant_config_spec_value( spec, "device_number", 0, config, CONFIG_STEP_ID );
+		config->device_type = rant_config_spec_value( spec, "device_type", 0, config, CONFIG_STEP_ID );
+		config->transmission_type = rant_config_spec_value( spec, "transmission_type", 0, config,
+			CONFIG_STEP_ID );
+		config->period = rant_config_spec_value( spec, "period", 0, config, CONFIG_STEP_PERIOD );
+		config->search_timeout = rant_config_spec_value( spec, "search_timeout", 0, config,
+			CONFIG_STEP_SEARCH_TIMEOUT );
+		config->rf_frequency = rant_config_spec_value( spec, "rf_frequency", 0, config,
+			CONFIG_STEP_RF_FREQ );
+
+		if ( RTEST(rb_hash_lookup2(spec, ID2SYM(rb_intern("open")), Qfalse)) )
+			config->steps |= 1U << CONFIG_STEP_OPEN;
+	}
+
+	rant_watch_responses();
+	rant_blocking_call( rant_config_pipeline_command, &run );
+
+	rval = rb_ary_new_capa( run.count );
+	for ( i = 0; i < run.count; i++ ) {
+		rant_channel_config_t *config = &configs[ i ];
+		VALUE channel = Qnil, failed_step = Qnil, code = Qnil;
+
+		if ( config->failed_step != CONFIG_STEP_ASSIGN ) {
+			VALUE args[4] = {
+				INT2FIX( config->channel_num ),
+				INT2FIX( config->channel_type ),
+				INT2FIX( config->network_number ),
+				INT2FIX( config->extended_options ),
+			};
+			channel = rb_class_new_instance( 4, args, rant_cAntChannel );
+
+			if ( (config->steps & (1U << CONFIG_STEP_ID)) && config->failed_step > CONFIG_STEP_ID ) {
+				rb_iv_set( channel, "@device_type", INT2FIX(config->device_type) );
+				rb_iv_set( channel, "@device_number", INT2FIX(config->device_number) );
+				rb_iv_set( channel, "@transmission_type", INT2FIX(config->transmission_type) );
+			}
+			if ( (config->steps & (1U << CONFIG_STEP_RF_FREQ)) && config->failed_step > CONFIG_STEP_RF_FREQ )
+				rb_iv_set( channel, "@rf_frequency", INT2FIX(config->rf_frequency) );
+		}
+
+		if ( config->failed_step != CONFIG_STEP_COUNT ) {
+			failed_step = ID2SYM( rb_intern(config_step_names[config->failed_step]) );
+			if ( config->code != CONFIG_NO_RESPONSE ) {
+				code = INT2FIX( config->code );
+				rant_log( "warn", "Configuring channel %d failed at %s (response 0x%02x).",
+					config->channel_num, config_step_names[config->failed_step], config->code );
+			} else {
+				rant_log( "warn", "Configuring channel %d failed at %s (no response).",
+					config->channel_num, config_step_names[config->failed_step] );
+			}
+		}
+
+		rb_ary_push( rval, rb_ary_new_from_args(3, channel, failed_step, code) );
+	}
+
+	return rval;
+}
+
+
 /*
  * call-seq:
  *    Ant.request_capabilities
@@ -571,7 +1422,7 @@ rant_s_on_response( int argc, VALUE *argv, VALUE module )
 static VALUE
 rant_s_request_capabilities( VALUE _module )
 {
-	bool rval = ANT_RequestMessage( 0, MESG_CAPABILITIES_ID );
+	bool rval = rant_request_message( MESG_CAPABILITIES_ID );
 	return rval ? Qtrue : Qfalse;
 }
 
@@ -588,7 +1439,7 @@ rant_s_request_capabilities( VALUE _module )
 static VALUE
 rant_s_request_serial_num( VALUE _module )
 {
-	bool rval = ANT_RequestMessage( 0, MESG_GET_SERIAL_NUM_ID );
+	bool rval = rant_request_message( MESG_GET_SERIAL_NUM_ID );
 	return rval ? Qtrue : Qfalse;
 }
 
@@ -605,7 +1456,7 @@ rant_s_request_serial_num( VALUE _module )
 static VALUE
 rant_s_request_version( VALUE _module )
 {
-	bool rval = ANT_RequestMessage( 0, MESG_VERSION_ID );
+	bool rval = rant_request_message( MESG_VERSION_ID );
 	return rval ? Qtrue : Qfalse;
 }
 
@@ -622,7 +1473,7 @@ rant_s_request_version( VALUE _module )
 static VALUE
 rant_s_request_advanced_burst_capabilities( VALUE _module )
 {
-	bool rval = ANT_RequestMessage( 0, MESG_CONFIG_ADV_BURST_ID );
+	bool rval = rant_request_message( MESG_CONFIG_ADV_BURST_ID );
 	return rval ? Qtrue : Qfalse;
 }
 
@@ -682,10 +1533,14 @@ Init_ant_ext()
 
 	rb_define_singleton_method( rant_mAnt, "use_extended_messages=",
 		rant_s_use_extended_messages_eq, 1 );
+	rb_define_singleton_method( rant_mAnt, "lib_config=", rant_s_lib_config_eq, 1 );
+	rb_define_singleton_method( rant_mAnt, "lib_config", rant_s_lib_config, 0 );
 	rb_define_singleton_method( rant_mAnt, "configure_advanced_burst",
 		rant_s_configure_advanced_burst, -1 );
 
 	rb_define_singleton_method( rant_mAnt, "on_response", rant_s_on_response, -1 );
+	rb_define_private_method( rb_singleton_class(rant_mAnt), "pipeline_channel_config",
+		rant_s_pipeline_channel_config, 2 );
 	// EXPORT void ANT_UnassignAllResponseFunctions(); //Unassigns all response functions
 
 	rb_define_singleton_method( rant_mAnt, "request_capabilities", rant_s_request_capabilities, 0 );
@@ -961,6 +1816,10 @@ Init_ant_ext()
 
 	init_ant_channel();
 	init_ant_message();
+	init_ant_native();
+	init_ant_event();
+	init_ant_future();
+	init_ant_callbacks();
 
 	rant_start_callback_thread();
 }
@@ -4,8 +4,10 @@
 #include "extconf.h"
 
 #include <stdbool.h>
+#include <stdatomic.h>
 #include <pthread.h>
 #include <assert.h>
+#include <time.h>
 
 #include <ruby.h>
 #include <ruby/intern.h>
@@ -14,6 +16,7 @@
 #include <ruby/version.h>
 
 #include "libant.h"
+#include "ant_native.h"
 
 #ifndef TRUE
 # define TRUE    1
@@ -27,25 +30,219 @@
  * Datatypes
  * -------------------------------------------------------------- */
 
+typedef struct rant_callback_sync_t rant_callback_sync_t;
+struct rant_callback_sync_t {
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+
+	bool handled;
+	bool rval;
+};
+
 typedef struct rant_callback_t rant_callback_t;
 struct rant_callback_t {
-	void *data;
 	VALUE (*fn)( VALUE );
-	bool rval;
+	VALUE (*batch_fn)( VALUE );
+
+	unsigned char channel;
+	unsigned char id;
+	unsigned char data[ MESG_MAX_SIZE ];
+	unsigned char length;
+	bool priority;
+
+	// Data too big for +data+, malloc()ed by the producer and freed once the
+	// callback has been handled or dropped
+	unsigned char *payload;
+	size_t payload_length;
+
+	unsigned char timestamps;
+	struct timespec monotonic_time;
+	struct timespec realtime;
+
+	rant_callback_sync_t *sync;
+};
+
+typedef struct rant_callback_batch_t rant_callback_batch_t;
+struct rant_callback_batch_t {
+	rant_callback_t *callbacks;
+	size_t count;
+};
+
+
+typedef struct rant_native_sink_t rant_native_sink_t;
+struct rant_native_sink_t {
+	rant_native_handler_t handler;
+	void *arg;
+
+	VALUE io;
+	int fd;
+
+	atomic_ullong events;
+	atomic_ullong bytes;
+	atomic_ullong errors;
+
+	// Frees whatever the +arg+ points to, if the sink owns it
+	void (*release)( rant_native_sink_t * );
+};
+
+
+typedef struct rant_native_ring_record_t rant_native_ring_record_t;
+struct rant_native_ring_record_t {
+	unsigned char channel;
+	unsigned char event_id;
+	unsigned char length;
+	unsigned char data[ MESG_MAX_SIZE ];
+};
+
+// An Ant::NativeSink::Ring's ring of events, which is in memory shared with any
+// processes forked after it was created. It has a single producer and a single
+// consumer, which don't need any locks.
+typedef struct rant_native_ring_t rant_native_ring_t;
+struct rant_native_ring_t {
+	// The next record to read and to write; they only ever increase, and the
+	// index of the record is the counter modulo the capacity
+	atomic_uint head;
+	atomic_uint tail;
+
+	// Set while the consumer is waiting for the producer to write a byte to the
+	// wake pipe
+	atomic_bool waiting;
+	atomic_ullong dropped;
+
+	unsigned int capacity;
+	size_t mapped_size;
+	int wake_read_fd;
+	int wake_write_fd;
+
+	rant_native_ring_record_t records[];
+};
+
+
+typedef struct rant_event_t rant_event_t;
+struct rant_event_t {
+	unsigned char channel;
+	unsigned char event_id;
+	unsigned char length;
+	unsigned char data[ MESG_MAX_SIZE ];
+
+	bool decoded;
+	unsigned char fields;
+	unsigned char flags;
+	unsigned short device_number;
+	unsigned char device_type;
+	unsigned char transmission_type;
+	signed char rssi;
+	unsigned short timestamp;
+
+	VALUE data_str;
+	VALUE payload;
+};
 
+
+typedef struct rant_future_t rant_future_t;
+struct rant_future_t {
 	pthread_mutex_t mutex;
-	pthread_cond_t  cond;
+	pthread_cond_t cond;
+	atomic_uint refcount;
 
-	bool handled;
-	rant_callback_t *next;
+	// The event that finishes the send: EVENT_TX for broadcasts, and
+	// EVENT_TRANSFER_TX_COMPLETED (or _FAILED) for everything else
+	unsigned char kind;
+
+	// The event the send finished with, or 0 while it's pending
+	unsigned char result;
+
+	// How many times the data has been sent
+	atomic_uint attempts;
+
+	// The next future pending on the same channel
+	rant_future_t *next;
+};
+
+
+typedef struct rant_tx_item_t rant_tx_item_t;
+struct rant_tx_item_t {
+	unsigned char data[ ANT_STANDARD_DATA_PAYLOAD_SIZE ];
+	unsigned int retries;
+	rant_future_t *future;
+	rant_tx_item_t *next;
 };
 
 
+// Maximum number of native sinks per channel
+#define MAX_NATIVE_SINKS  8
+
 typedef struct rant_channel_t rant_channel_t;
 struct rant_channel_t {
 	unsigned char channel_num;
 	unsigned char buffer[ MESG_MAX_SIZE ];
 	VALUE callback;
+	VALUE batch_callback;
+	size_t batch_size;
+	unsigned char timestamps;
+	VALUE event_buffers;
+	bool event_objects;
+
+	VALUE burst_callback;
+	unsigned char *burst_buffer;
+	size_t burst_length;
+	size_t burst_capacity;
+	unsigned char burst_sequence;
+	bool burst_in_progress;
+	atomic_ullong failed_bursts;
+
+	// The burst transfer being streamed out by #stream_burst, which is paced by
+	// the transfer events the receive thread sees
+	pthread_mutex_t tx_mutex;
+	pthread_cond_t tx_cond;
+	unsigned char tx_sequence;
+	unsigned long tx_packets;
+	unsigned long tx_credits;
+	bool tx_started;
+	bool tx_paced;
+	unsigned char tx_result;
+
+	// Futures for async sends that haven't finished yet, oldest first; also
+	// protected by the tx_mutex
+	rant_future_t *pending_futures;
+	rant_future_t *last_pending_future;
+
+	// The transmit queue of acknowledged data, oldest (and the one being sent)
+	// first; also protected by the tx_mutex
+	rant_tx_item_t *tx_queue;
+	rant_tx_item_t *tx_queue_tail;
+	unsigned int tx_queue_length;
+	unsigned int tx_queue_depth;
+	unsigned int tx_queue_retries;
+	bool tx_queue_sending;
+	bool tx_queue_blocked;
+	atomic_ullong tx_queue_retried;
+
+	// Payloads preloaded for a master channel's broadcasts, one of which is sent
+	// on each EVENT_TX without going through Ruby; also protected by the tx_mutex
+	unsigned char *broadcast_ring;
+	unsigned int broadcast_ring_size;
+	unsigned int broadcast_ring_head;
+	unsigned int broadcast_ring_length;
+	unsigned int broadcast_ring_low_water;
+	VALUE broadcast_refill_callback;
+	atomic_bool broadcast_refill_pending;
+	atomic_ullong broadcast_ring_sent;
+	atomic_ullong broadcast_ring_underruns;
+
+	rant_native_sink_t *native_sinks[ MAX_NATIVE_SINKS ];
+	atomic_uint native_sink_count;
+
+	// When the receive thread last saw an event on the channel, in monotonic
+	// nanoseconds, whether it's seen the device close it since it was opened,
+	// and whether it's been unassigned from the device
+	atomic_ullong last_event_time;
+	atomic_bool closed_by_device;
+	bool unassigned;
+
+	// How many of the receive thread's callbacks are using the channel; guarded
+	// by the mutex for the channels that take events
+	unsigned int event_holds;
 };
 
 
@@ -55,6 +252,43 @@ struct rant_channel_t {
 
 #define DEFAULT_BAUDRATE  57600
 
+// Default depth of a channel's transmit queue, and how many times each item is
+// retried
+#define DEFAULT_TX_QUEUE_DEPTH    32
+#define DEFAULT_TX_QUEUE_RETRIES  3
+
+// Default number of events an Ant::NativeSink::Ring holds
+#define DEFAULT_NATIVE_RING_CAPACITY  1024
+
+// Default number of payloads a channel's broadcast ring holds, and how few
+// there can be left in it before the refill callback is called
+#define DEFAULT_BROADCAST_RING_SIZE       16
+#define DEFAULT_BROADCAST_RING_LOW_WATER  4
+
+// Which receive timestamps to pass to a callback
+#define RANT_TIMESTAMP_MONOTONIC  0x01
+#define RANT_TIMESTAMP_REALTIME   0x02
+
+// Default number of slots in each callback lane; must be a power of two
+#define DEFAULT_CALLBACK_QUEUE_CAPACITY  256
+
+// One callback lane per channel number, plus a priority lane for responses
+#define CALLBACK_CHANNEL_LANES  (CHANNEL_NUMBER_MASK + 1)
+#define CALLBACK_PRIORITY_LANE  CALLBACK_CHANNEL_LANES
+#define CALLBACK_LANE_COUNT     (CALLBACK_CHANNEL_LANES + 1)
+
+// Default and maximum number of callbacks taken from a channel's lane per turn
+#define DEFAULT_CALLBACK_LANE_WEIGHT  32
+#define MAX_CALLBACK_LANE_WEIGHT      MAX_CALLBACK_BATCH_SIZE
+
+// Default and maximum number of callback worker threads
+#define DEFAULT_CALLBACK_WORKERS  4
+#define MAX_CALLBACK_WORKERS      32
+
+// Default and maximum number of callbacks a worker runs per wakeup
+#define DEFAULT_CALLBACK_BATCH_SIZE  64
+#define MAX_CALLBACK_BATCH_SIZE      4096
+
 #ifdef HAVE_STDARG_PROTOTYPES
 #include <stdarg.h>
 #define va_init_list(a,b) va_start(a,b)
@@ -66,6 +300,7 @@ void rant_log( const char *, const char *, ... );
 void rant_log_obj( VALUE, const char *, const char *, va_dcl );
 void rant_log( const char *, const char *, va_dcl );
 #endif
+bool rant_log_debug_p( void );
 
 
 /* -------------------------------------------------------
@@ -76,6 +311,12 @@ extern VALUE rant_mAnt;
 
 extern VALUE rant_cAntChannel;
 extern VALUE rant_cAntMessage;
+extern VALUE rant_cAntNativeSink;
+extern VALUE rant_cAntEvent;
+extern VALUE rant_cAntFuture;
+
+extern bool rant_device_initialized;
+extern atomic_bool rant_async_callbacks;
 
 
 /* --------------------------------------------------------------
@@ -92,10 +333,38 @@ extern void Init_ant_ext _(( void ));
 
 extern void init_ant_channel _(( void ));
 extern void init_ant_message _(( void ));
+extern void init_ant_native _(( void ));
+extern void init_ant_event _(( void ));
+extern void init_ant_future _(( void ));
 
+extern void init_ant_callbacks _(( void ));
 extern void rant_start_callback_thread _(( void ));
 extern bool rant_callback _(( rant_callback_t * ));
+extern unsigned int rant_callback_lane_weight _(( unsigned char ));
+extern void rant_callback_set_lane_weight _(( unsigned char, unsigned int ));
+extern unsigned long long rant_callback_lane_drops _(( unsigned char ));
 
 extern void rant_channel_clear_registry  _(( void ));
+extern void rant_channel_on_response_event _(( unsigned char, unsigned char, unsigned char ));
+extern void rant_watch_responses _(( void ));
+
+extern rant_native_sink_t *rant_get_native_sink _(( VALUE ));
+extern VALUE rant_event_new _(( rant_callback_t * ));
+
+extern rant_future_t *rant_future_create _(( unsigned char ));
+extern void rant_future_retain _(( rant_future_t * ));
+extern void rant_future_release _(( rant_future_t * ));
+extern void rant_future_resolve _(( rant_future_t *, unsigned char ));
+extern VALUE rant_future_wrap _(( rant_future_t * ));
+extern unsigned char rant_future_wait_for _(( rant_future_t *, double ));
+
+extern size_t rant_message_size _(( unsigned char ));
+extern size_t rant_event_size _(( unsigned char, const unsigned char * ));
+
+extern void *rant_blocking_call _(( void *(*)(void *), void * ));
+
+extern unsigned char rant_timestamp_flags _(( VALUE, VALUE ));
+extern void rant_capture_timestamps _(( rant_callback_t *, unsigned char ));
+extern void rant_push_timestamps _(( VALUE, rant_callback_t * ));
 
 #endif /* end of include guard: ANT_EXT_H_4CFF48F9 */
@@ -0,0 +1,33 @@
+#ifndef ANT_NATIVE_H_1F6A2C3E
+#define ANT_NATIVE_H_1F6A2C3E
+
+/*
+ *  ant_native.h - Public interface for native ANT event handlers
+ *
+ *  A native handler is a C function that's called for every event on a channel
+ *  directly from the ANT library's receive thread, before the event is queued
+ *  for Ruby. It runs without the GVL, so it must not call into Ruby or touch
+ *  any Ruby objects, and it should return quickly, as the next message isn't
+ *  read until it does.
+ *
+ *  To use one from another extension (or via Fiddle), wrap its address and the
+ *  +arg+ it should be called with in an Ant::NativeSink:
+ *
+ *    sink = Ant::NativeSink.new( handler_address, arg_address )
+ *    channel.add_native_sink( sink )
+ *
+ *  Authors:
+ *    * Michael Granger <ged@FaerieMUD.org>
+ *
+ */
+
+#include <stddef.h>
+
+/*
+ * The signature of a native handler. The +data+ is the message for the
+ * +event_id+ on +channel+, and is only valid until the handler returns.
+ */
+typedef void (*rant_native_handler_t)( unsigned char channel, unsigned char event_id,
+	const unsigned char *data, size_t length, void *arg );
+
+#endif /* end of include guard: ANT_NATIVE_H_1F6A2C3E */
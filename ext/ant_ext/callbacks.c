@@ -15,121 +15,610 @@
 
 #include "ant_ext.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ruby/io.h>
+
+#ifdef HAVE_SYS_EVENTFD_H
+# include <sys/eventfd.h>
+#endif
+
+
+/*
+ * Each callback queue is a bounded multi-producer ring (after Dmitry Vyukov's
+ * bounded MPMC queue). Producers -- the libant receive thread(s) -- claim a slot
+ * with a CAS on the enqueue position and publish it by bumping the slot's
+ * sequence number, so pushing never takes a lock and callbacks are dispatched
+ * in the order they arrived.
+ *
+ * Callbacks are copied into their slot along with a snapshot of the message
+ * that triggered them, so the message buffer libant reads into can be reused
+ * as soon as the callback is queued.
+ */
+typedef struct callback_slot_t callback_slot_t;
+struct callback_slot_t {
+	atomic_size_t sequence;
+	rant_callback_t callback;
+};
+
+typedef struct callback_ring_t callback_ring_t;
+struct callback_ring_t {
+	size_t capacity;
+	size_t mask;
+	callback_slot_t *slots;
+
+	atomic_size_t enqueue_pos;
+	atomic_size_t dequeue_pos;
+};
+
+
+/*
+ * A dispatch lane: the ring of callbacks for one channel number (or for module
+ * responses, in the case of the priority lane). Only one worker at a time can
+ * hold a lane, so each channel's callbacks are still run in order, but a
+ * channel with a slow handler only ties up the worker that's holding it. The
+ * +weight+ is how many of the lane's callbacks a worker takes each time it's
+ * the lane's turn.
+ *
+ * When the ring is full and the overflow policy is :keep_latest_per_channel,
+ * the newest callback is parked in +latest+ (replacing any callback already
+ * parked there) until the ring has been drained; +dropped+ counts every
+ * callback the lane has thrown away.
+ *
+ * Under the :block policy, a producer that finds the ring full waits on
+ * +room_cond+ until a worker takes something out of it; +room_waiters+ is how
+ * many are waiting, so workers only touch the mutex when someone is.
+ */
+typedef struct callback_lane_t callback_lane_t;
+struct callback_lane_t {
+	callback_ring_t *ring;
+	atomic_bool busy;
+	atomic_uint weight;
+
+	pthread_mutex_t latest_mutex;
+	rant_callback_t latest;
+	atomic_bool latest_pending;
+
+	pthread_mutex_t room_mutex;
+	pthread_cond_t room_cond;
+	atomic_uint room_waiters;
+
+	atomic_ullong dropped;
+};
+
 
 /*
- * Three globals to allow for Ruby/C-thread communication:
- * - mutex & condition to synchronize access to callback_queue
- * - callback_queue to store actual callback data in
- * Be careful with the functions that manipulate the callback
- * queue; they must do so in the protection of a mutex.
+ * What to do with a callback when its lane is full.
  */
-pthread_mutex_t rant_callback_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t rant_callback_cond   = PTHREAD_COND_INITIALIZER;
-rant_callback_t *rant_callback_queue     = NULL;
+typedef enum {
+	CALLBACK_OVERFLOW_BLOCK,
+	CALLBACK_OVERFLOW_DROP_OLDEST,
+	CALLBACK_OVERFLOW_DROP_NEWEST,
+	CALLBACK_OVERFLOW_KEEP_LATEST_PER_CHANNEL,
+} callback_overflow_policy_t;
+
 
-typedef struct callback_waiting_t callback_waiting_t;
-struct callback_waiting_t {
-	rant_callback_t *callback;
+/*
+ * A long-lived dispatcher thread that takes up to +batch_size+ callbacks at a
+ * time from the lanes it serves and runs them. The mutex and condition are
+ * only used to park the worker while there's nothing to do; a producer only
+ * touches them to wake the worker up if it's actually asleep.
+ */
+typedef struct callback_worker_t callback_worker_t;
+struct callback_worker_t {
+	unsigned int id;
+	bool pinned;
+	unsigned int next_lane;
+	uint64_t held_lanes;
+	rant_callback_t *callbacks;
+	size_t batch_size;
+	size_t count;
 	bool abort;
+	VALUE thread;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t  cond;
+	atomic_bool sleeping;
 };
 
 
 /*
- * Use this function to add a callback node onto the global
- * callback queue.
- * Do note that we are adding items to the front of the linked
- * list, and as such events will always be handled by most recent
- * first. To remedy this, add to the end of the queue instead.
+ * The callback lanes and the workers that drain them. When channels are
+ * pinned, channel +n+'s lane is only ever served by worker
+ * <tt>n % worker_count</tt>; otherwise any worker can take any lane that isn't
+ * already held. Every worker serves the priority lane, and checks it first.
+ */
+static callback_lane_t callback_lanes[ CALLBACK_LANE_COUNT ];
+
+static callback_worker_t *callback_workers = NULL;
+static unsigned int callback_worker_count = 0;
+
+/*
+ * The pseudo-worker Ant.read_events uses to run callbacks in the calling
+ * thread, and the descriptors behind Ant.event_io. With an eventfd, both
+ * descriptors are the same. The descriptor is only written to when it isn't
+ * already readable.
+ */
+static callback_worker_t callback_poller;
+static bool callback_poller_busy = false;
+
+static int event_io_read_fd = -1;
+static int event_io_write_fd = -1;
+static atomic_bool event_io_signalled = false;
+
+static size_t callback_queue_capacity = DEFAULT_CALLBACK_QUEUE_CAPACITY;
+static size_t callback_batch_size = DEFAULT_CALLBACK_BATCH_SIZE;
+static unsigned int callback_worker_setting = DEFAULT_CALLBACK_WORKERS;
+static bool callback_channels_pinned = false;
+static atomic_int callback_overflow_policy = CALLBACK_OVERFLOW_BLOCK;
+
+atomic_bool rant_async_callbacks = false;
+
+static ID id_join;
+static ID id_block, id_drop_oldest, id_drop_newest, id_keep_latest_per_channel;
+
+static bool callback_lanes_empty_p( void );
+
+
+/*
+ * Allocate a new callback ring with room for +capacity+ callbacks, which must
+ * be a power of two.
+ */
+static callback_ring_t *
+callback_ring_new( size_t capacity )
+{
+	callback_ring_t *ring = ALLOC( callback_ring_t );
+	size_t i;
+
+	assert( capacity >= 2 && (capacity & (capacity - 1)) == 0 );
+
+	ring->capacity = capacity;
+	ring->mask = capacity - 1;
+	ring->slots = ALLOC_N( callback_slot_t, capacity );
+
+	for ( i = 0; i < capacity; i++ ) {
+		atomic_init( &ring->slots[i].sequence, i );
+	}
+
+	atomic_init( &ring->enqueue_pos, 0 );
+	atomic_init( &ring->dequeue_pos, 0 );
+
+	return ring;
+}
+
+
+/*
+ * Free the given callback +ring+.
  */
 static void
-callback_queue_push( rant_callback_t *callback )
+callback_ring_free( callback_ring_t *ring )
 {
-	callback->next = rant_callback_queue;
-	rant_callback_queue = callback;
+	if ( ring ) {
+		xfree( ring->slots );
+		xfree( ring );
+	}
 }
 
 
 /*
- * Use this function to pop off a callback node from the
- * global callback queue. Returns NULL if queue is empty.
+ * Returns +true+ if the given +ring+ doesn't contain any callbacks.
  */
-static rant_callback_t *
-callback_queue_pop(void)
+static bool
+callback_ring_empty_p( callback_ring_t *ring )
 {
-	rant_callback_t *callback = rant_callback_queue;
+	return atomic_load( &ring->enqueue_pos ) == atomic_load( &ring->dequeue_pos );
+}
 
-	if ( callback )
-	{
-		rant_callback_queue = callback->next;
+
+/*
+ * Use this function to add a callback node onto the end of the given
+ * callback +ring+. Safe to call from any number of threads at once without
+ * locking. Returns +false+ if the ring is full.
+ */
+static bool
+callback_ring_push( callback_ring_t *ring, rant_callback_t *callback )
+{
+	callback_slot_t *slot;
+	size_t pos = atomic_load_explicit( &ring->enqueue_pos, memory_order_relaxed );
+	size_t seq;
+	intptr_t diff;
+
+	for ( ;; ) {
+		slot = &ring->slots[ pos & ring->mask ];
+		seq = atomic_load_explicit( &slot->sequence, memory_order_acquire );
+		diff = (intptr_t)seq - (intptr_t)pos;
+
+		if ( diff == 0 ) {
+			if ( atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed) )
+				break;
+		} else if ( diff < 0 ) {
+			return false;
+		} else {
+			pos = atomic_load_explicit( &ring->enqueue_pos, memory_order_relaxed );
+		}
+	}
+
+	slot->callback = *callback;
+	atomic_store_explicit( &slot->sequence, pos + 1, memory_order_release );
+
+	return true;
+}
+
+
+/*
+ * Use this function to pop the oldest callback node off of the given
+ * callback +ring+ into +callback+. Returns +false+ if ring is empty.
+ */
+static bool
+callback_ring_pop( callback_ring_t *ring, rant_callback_t *callback )
+{
+	callback_slot_t *slot;
+	size_t pos = atomic_load_explicit( &ring->dequeue_pos, memory_order_relaxed );
+	size_t seq;
+	intptr_t diff;
+
+	for ( ;; ) {
+		slot = &ring->slots[ pos & ring->mask ];
+		seq = atomic_load_explicit( &slot->sequence, memory_order_acquire );
+		diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+		if ( diff == 0 ) {
+			if ( atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed) )
+				break;
+		} else if ( diff < 0 ) {
+			return false;
+		} else {
+			pos = atomic_load_explicit( &ring->dequeue_pos, memory_order_relaxed );
+		}
+	}
+
+	*callback = slot->callback;
+	atomic_store_explicit( &slot->sequence, pos + ring->mask + 1, memory_order_release );
+
+	return true;
+}
+
+
+/*
+ * Return the number of the lane the given +callback+ should be queued on.
+ */
+static inline unsigned int
+callback_lane_for( rant_callback_t *callback )
+{
+	if ( callback->priority ) return CALLBACK_PRIORITY_LANE;
+	return callback->channel & CHANNEL_NUMBER_MASK;
+}
+
+
+/*
+ * Returns +true+ if the given +worker+ is allowed to take callbacks from the
+ * lane numbered +lane_num+.
+ */
+static inline bool
+callback_worker_serves_p( callback_worker_t *worker, unsigned int lane_num )
+{
+	if ( lane_num == CALLBACK_PRIORITY_LANE || !worker->pinned ) return true;
+	return lane_num % callback_worker_count == worker->id;
+}
+
+
+/*
+ * Wake the given +worker+ if it's asleep. Returns +true+ if it was.
+ */
+static bool
+callback_worker_wake( callback_worker_t *worker )
+{
+	if ( !atomic_exchange(&worker->sleeping, false) ) return false;
+
+	pthread_mutex_lock( &worker->mutex );
+	pthread_cond_signal( &worker->cond );
+	pthread_mutex_unlock( &worker->mutex );
+
+	return true;
+}
+
+
+/*
+ * Wake a sleeping worker that can take callbacks from the lane numbered
+ * +lane_num+, if there is one.
+ */
+static void
+wake_callback_worker_for( unsigned int lane_num )
+{
+	unsigned int i;
+
+	atomic_thread_fence( memory_order_seq_cst );
+
+	if ( callback_worker_count == 0 ) return;
+
+	if ( callback_channels_pinned && lane_num != CALLBACK_PRIORITY_LANE ) {
+		callback_worker_wake( &callback_workers[lane_num % callback_worker_count] );
+		return;
+	}
+
+	for ( i = 0; i < callback_worker_count; i++ ) {
+		if ( callback_worker_wake(&callback_workers[i]) ) return;
+	}
+}
+
+
+/*
+ * Make Ant.event_io readable, if it's been created and isn't already.
+ */
+static void
+signal_event_io()
+{
+	const uint64_t one = 1;
+	ssize_t rval;
+
+	if ( event_io_write_fd < 0 || atomic_exchange(&event_io_signalled, true) ) return;
+
+	do {
+		rval = write( event_io_write_fd, &one, sizeof(one) );
+	} while ( rval < 0 && errno == EINTR );
+}
+
+
+/*
+ * Read everything out of the Ant.event_io descriptor so it's no longer readable.
+ * The signal is only cleared once it's drained, so a producer that sets it in
+ * the meantime can't have its write eaten while the flag stays set; anything
+ * it queued before then is signalled again.
+ */
+static void
+clear_event_io()
+{
+	uint64_t buf[ 8 ];
+	ssize_t rval;
+
+	if ( event_io_read_fd < 0 ) return;
+
+	do {
+		rval = read( event_io_read_fd, buf, sizeof(buf) );
+	} while ( rval > 0 || (rval < 0 && errno == EINTR) );
+	atomic_store( &event_io_signalled, false );
+
+	if ( !callback_lanes_empty_p() ) signal_event_io();
+}
+
+
+/*
+ * Tell the C side of each of the +count+ +callbacks+ that it has been handled,
+ * and free any payloads they own.
+ */
+static void
+complete_callbacks( rant_callback_t *callbacks, size_t count, bool rval )
+{
+	size_t i;
+
+	for ( i = 0; i < count; i++ ) {
+		rant_callback_sync_t *sync = callbacks[i].sync;
+
+		free( callbacks[i].payload );
+		callbacks[i].payload = NULL;
+
+		if ( !sync ) continue;
+
+		pthread_mutex_lock( &sync->mutex );
+
+		sync->handled = true;
+		sync->rval = rval;
+
+		pthread_cond_signal( &sync->cond );
+		pthread_mutex_unlock( &sync->mutex );
+	}
+}
+
+
+/*
+ * Throw away the given +callback+ from +lane+, telling its producer (if it's
+ * waiting) that it wasn't handled.
+ */
+static void
+drop_callback( callback_lane_t *lane, rant_callback_t *callback )
+{
+	complete_callbacks( callback, 1, false );
+	atomic_fetch_add( &lane->dropped, 1 );
+}
+
+
+/*
+ * Park the given +callback+ in the lane's +latest+ slot, dropping whatever was
+ * already there.
+ */
+static void
+keep_latest_callback( callback_lane_t *lane, rant_callback_t *callback )
+{
+	pthread_mutex_lock( &lane->latest_mutex );
+
+	if ( atomic_load(&lane->latest_pending) ) drop_callback( lane, &lane->latest );
+	lane->latest = *callback;
+	atomic_store( &lane->latest_pending, true );
+
+	pthread_mutex_unlock( &lane->latest_mutex );
+}
+
+
+/*
+ * Push the given +callback+ onto the lane numbered +lane_num+, waiting for a
+ * worker (or Ant.read_events) to make room if it's full.
+ */
+static void
+push_callback_waiting( unsigned int lane_num, rant_callback_t *callback )
+{
+	callback_lane_t *lane = &callback_lanes[ lane_num ];
+
+	if ( callback_ring_push(lane->ring, callback) ) return;
+
+	atomic_fetch_add( &lane->room_waiters, 1 );
+	pthread_mutex_lock( &lane->room_mutex );
+
+	atomic_thread_fence( memory_order_seq_cst );
+	while ( !callback_ring_push(lane->ring, callback) ) {
+		wake_callback_worker_for( lane_num );
+		signal_event_io();
+		pthread_cond_wait( &lane->room_cond, &lane->room_mutex );
+	}
+
+	pthread_mutex_unlock( &lane->room_mutex );
+	atomic_fetch_sub( &lane->room_waiters, 1 );
+}
+
+
+/*
+ * Wake any producers waiting for room in the given +lane+ after callbacks have
+ * been taken out of it.
+ */
+static void
+signal_callback_lane_room( callback_lane_t *lane )
+{
+	atomic_thread_fence( memory_order_seq_cst );
+	if ( !atomic_load(&lane->room_waiters) ) return;
+
+	pthread_mutex_lock( &lane->room_mutex );
+	pthread_cond_broadcast( &lane->room_cond );
+	pthread_mutex_unlock( &lane->room_mutex );
+}
+
+
+/*
+ * Add the given +callback+ to the lane numbered +lane_num+, applying the
+ * overflow policy if the lane is full. Responses are never dropped. Returns
+ * +false+ if the callback itself was dropped.
+ */
+static bool
+push_callback( unsigned int lane_num, rant_callback_t *callback )
+{
+	callback_lane_t *lane = &callback_lanes[ lane_num ];
+	rant_callback_t oldest;
+	int policy = atomic_load( &callback_overflow_policy );
+
+	if ( lane_num == CALLBACK_PRIORITY_LANE ) policy = CALLBACK_OVERFLOW_BLOCK;
+
+	switch ( policy ) {
+	case CALLBACK_OVERFLOW_DROP_OLDEST:
+		while ( !callback_ring_push(lane->ring, callback) ) {
+			if ( callback_ring_pop(lane->ring, &oldest) ) drop_callback( lane, &oldest );
+		}
+		return true;
+
+	case CALLBACK_OVERFLOW_DROP_NEWEST:
+		if ( callback_ring_push(lane->ring, callback) ) return true;
+		drop_callback( lane, callback );
+		return false;
+
+	case CALLBACK_OVERFLOW_KEEP_LATEST_PER_CHANNEL:
+		// Once something's parked, newer callbacks replace it instead of going
+		// into the ring so they stay in order.
+		if ( atomic_load(&lane->latest_pending) || !callback_ring_push(lane->ring, callback) )
+			keep_latest_callback( lane, callback );
+		return true;
+
+	default:
+		push_callback_waiting( lane_num, callback );
+		return true;
 	}
-	return callback;
 }
 
 
 /*
- * Queue a +callback+ for handling by Ruby. Blocks until it's handled.
+ * Queue a copy of +callback+ for handling by Ruby. If callbacks are being
+ * delivered asynchronously, this returns +true+ as soon as it's queued;
+ * otherwise it blocks until it's handled and returns the handler's result.
  */
 bool
 rant_callback( rant_callback_t *callback )
 {
-	pthread_mutex_init( &callback->mutex, NULL );
-	pthread_cond_init( &callback->cond, NULL );
+	const unsigned int lane_num = callback_lane_for( callback );
+	const bool async = atomic_load( &rant_async_callbacks );
+	rant_callback_sync_t sync;
+
+	if ( async ) {
+		callback->sync = NULL;
+	} else {
+		pthread_mutex_init( &sync.mutex, NULL );
+		pthread_cond_init( &sync.cond, NULL );
+		sync.handled = false;
+		sync.rval = false;
+
+		callback->sync = &sync;
+	}
 
-	callback->handled = false;
+	// Put callback data in the channel's lane
+	if ( !push_callback(lane_num, callback) ) {
+		if ( !async ) {
+			pthread_mutex_destroy( &sync.mutex );
+			pthread_cond_destroy( &sync.cond );
+		}
+		return false;
+	}
 
-	// Put callback data in global callback queue
-	pthread_mutex_lock( &rant_callback_mutex );
-	callback_queue_push( callback );
-	pthread_mutex_unlock( &rant_callback_mutex );
+	// Notify a waiting worker (and anyone watching Ant.event_io) that we have
+	// callback data
+	wake_callback_worker_for( lane_num );
+	signal_event_io();
 
-	// Notify waiting Ruby thread that we have callback data
-	pthread_cond_signal( &rant_callback_cond );
+	if ( async ) return true;
 
 	// Wait for callback to be handled
-	pthread_mutex_lock( &callback->mutex );
-	while ( callback->handled == false )
+	pthread_mutex_lock( &sync.mutex );
+	while ( sync.handled == false )
 	{
-		pthread_cond_wait( &callback->cond, &callback->mutex );
+		pthread_cond_wait( &sync.cond, &sync.mutex );
 	}
-	pthread_mutex_unlock( &callback->mutex );
+	pthread_mutex_unlock( &sync.mutex );
 
 	// Clean up
-	pthread_mutex_destroy( &callback->mutex );
-	pthread_cond_destroy( &callback->cond );
+	pthread_mutex_destroy( &sync.mutex );
+	pthread_cond_destroy( &sync.cond );
 
-	return callback->rval;
+	return sync.rval;
 }
 
 
 /*
- * Executed for each callback notification; what we receive
+ * Executed for each callback notification (or batch of them); what we receive
  * are the callback parameters. The job of this method is to:
  * 1. Convert callback parameters into Ruby values
  * 2. Call the appropriate callback with said parameters
  * 3. Convert the Ruby return value into a C value
  * 4. Hand over the C value to the C callback
+ *
+ * If the callbacks have a +batch_fn+, all +count+ of them are handed to it
+ * at once. Since this runs in a long-lived worker, an exception raised by the
+ * callback is logged rather than allowed to kill the thread.
  */
 static VALUE
-handle_callback( void *cb )
+handle_callbacks( rant_callback_t *callbacks, size_t count )
 {
-	rant_callback_t *callback = (rant_callback_t *)cb;
+	rant_callback_batch_t batch = {
+		.callbacks = callbacks,
+		.count = count,
+	};
 	int state = 0;
 	VALUE rval;
 
-	// callback->fn( callback->data );
-	rval = rb_protect( callback->fn, (VALUE)callback->data, &state );
-
-	// tell the callback that it has been handled, we are done
-	pthread_mutex_lock( &callback->mutex );
-
-	callback->handled = true;
-	callback->rval = RTEST( rval ) ? true : false;
+	if ( callbacks->batch_fn ) {
+		rval = rb_protect( callbacks->batch_fn, (VALUE)&batch, &state );
+	} else {
+		// callback->fn( callback );
+		rval = rb_protect( callbacks->fn, (VALUE)callbacks, &state );
+	}
 
-	pthread_cond_signal( &callback->cond );
-	pthread_mutex_unlock( &callback->mutex );
+	// tell the callbacks that they've been handled, we are done
+	complete_callbacks( callbacks, count, !state && RTEST(rval) );
 
 	if ( state ) {
-		rb_jump_tag( state );
+		VALUE err = rb_errinfo();
+		rb_set_errinfo( Qnil );
+
+		if ( !rb_obj_is_kind_of(err, rb_eException) ) rb_jump_tag( state );
+		rant_log( "error", "%s in callback: %s",
+			rb_obj_classname(err), RSTRING_PTR(rb_obj_as_string(err)) );
+		rval = Qnil;
 	}
 
 	return rval;
@@ -137,95 +626,919 @@ handle_callback( void *cb )
 
 
 /*
- * Wait for the next callback in the global callback queue.
+ * Let go of all of the lanes the given +worker+ is holding so other workers can
+ * take them.
  */
-static void *
-wait_for_callback_signal( void *w_ptr )
+static void
+release_callback_lanes( callback_worker_t *worker )
 {
-	callback_waiting_t *waiting = (callback_waiting_t*) w_ptr;
-
-	pthread_mutex_lock( &rant_callback_mutex );
+	unsigned int lane_num;
 
-	// abort signal is used when ruby wants us to stop waiting
-	while ( waiting->abort == false && (waiting->callback = callback_queue_pop()) == NULL )
-	{
-		pthread_cond_wait( &rant_callback_cond, &rant_callback_mutex );
+	for ( lane_num = 0; worker->held_lanes; lane_num++ ) {
+		if ( worker->held_lanes & (UINT64_C(1) << lane_num) ) {
+			atomic_store( &callback_lanes[lane_num].busy, false );
+			worker->held_lanes &= ~( UINT64_C(1) << lane_num );
+		}
 	}
-
-	pthread_mutex_unlock( &rant_callback_mutex );
-
-	return NULL;
 }
 
 
 /*
- * Unblocking function: tell the callback thread to abort if Ruby says it's
- * shutdown time.
+ * Run all of the callbacks the given +worker+ has taken from its lanes in a
+ * single pass, handing runs of consecutive callbacks for the same channel to
+ * their batch function if they have one, then release the lanes.
  */
 static void
-stop_waiting_for_callback_signal( void *w_ptr )
+handle_worker_callbacks( callback_worker_t *worker )
 {
-	callback_waiting_t *waiting = (callback_waiting_t*) w_ptr;
+	size_t i = 0, run;
 
-	pthread_mutex_lock( &rant_callback_mutex );
+	while ( i < worker->count ) {
+		rant_callback_t *first = &worker->callbacks[ i ];
 
-	waiting->abort = true;
+		run = 1;
+		if ( first->batch_fn ) {
+			while ( i + run < worker->count &&
+				worker->callbacks[ i + run ].batch_fn == first->batch_fn &&
+				worker->callbacks[ i + run ].channel == first->channel )
+				run++;
+		}
+
+		handle_callbacks( first, run );
+		i += run;
+	}
 
-	pthread_cond_signal( &rant_callback_cond );
-	pthread_mutex_unlock( &rant_callback_mutex );
+	worker->count = 0;
+	release_callback_lanes( worker );
 }
 
 
 /*
- * Callback handler thread routine; loops until told to abort. Each loop:
- *
- * - Release the GVL
- * - Wait on a signal on the global condition variable with an unblock function
- *   that tells it to abort.
- * - If there's a callback, create a child thread to run it.
- *
+ * Take up to +max+ callbacks from the lane numbered +lane_num+ into the
+ * +worker+'s batch, if the worker serves the lane and no other worker is
+ * holding it. Returns the number of callbacks taken.
  */
-static VALUE
-callback_thread( void *unused )
+static size_t
+take_from_callback_lane( callback_worker_t *worker, unsigned int lane_num, size_t max )
 {
-	callback_waiting_t waiting = {
-		.callback = NULL,
-		.abort    = false
-	};
+	callback_lane_t *lane = &callback_lanes[ lane_num ];
+	const uint64_t bit = UINT64_C(1) << lane_num;
+	size_t taken = 0;
+	bool expected = false;
 
-	while ( waiting.abort == false )
+	if ( !callback_worker_serves_p(worker, lane_num) ||
+		( callback_ring_empty_p(lane->ring) && !atomic_load(&lane->latest_pending) ) )
+		return 0;
+
+	if ( !(worker->held_lanes & bit) ) {
+		if ( !atomic_compare_exchange_strong(&lane->busy, &expected, true) ) return 0;
+		worker->held_lanes |= bit;
+	}
+
+	while ( taken < max && worker->count < worker->batch_size &&
+		callback_ring_pop(lane->ring, &worker->callbacks[worker->count]) )
 	{
-		// release the GIL while waiting for a callback notification
-		rb_thread_call_without_gvl( wait_for_callback_signal, &waiting,
-			stop_waiting_for_callback_signal, &waiting );
+		worker->count++;
+		taken++;
+	}
+	if ( taken ) signal_callback_lane_room( lane );
 
-		// if ruby wants us to abort, this will be NULL
-		if ( waiting.callback )
-		{
-			// rant_log( "debug", "Starting a callback thread." );
-			rb_thread_create( handle_callback, (void *)waiting.callback );
+	// The parked callback (if any) is newer than anything in the ring, so it
+	// goes last.
+	if ( taken < max && worker->count < worker->batch_size &&
+		atomic_load(&lane->latest_pending) && callback_ring_empty_p(lane->ring) )
+	{
+		pthread_mutex_lock( &lane->latest_mutex );
+		if ( atomic_load(&lane->latest_pending) ) {
+			worker->callbacks[ worker->count++ ] = lane->latest;
+			atomic_store( &lane->latest_pending, false );
+			taken++;
 		}
+		pthread_mutex_unlock( &lane->latest_mutex );
 	}
 
-	return Qnil;
+	return taken;
 }
 
 
+/*
+ * Fill the +worker+'s batch from the lanes it serves: responses on the priority
+ * lane first, then up to the weight's worth of callbacks from the next channel
+ * lane in turn that has any. Only taking one channel per batch leaves the rest
+ * of the lanes free for the other workers, so a channel with a slow handler
+ * only holds up itself.
+ */
+static void
+take_callbacks( callback_worker_t *worker )
+{
+	unsigned int i, lane_num;
+
+	take_from_callback_lane( worker, CALLBACK_PRIORITY_LANE, worker->batch_size );
+
+	for ( i = 0; i < CALLBACK_CHANNEL_LANES; i++ ) {
+		lane_num = ( worker->next_lane + i ) % CALLBACK_CHANNEL_LANES;
+		if ( take_from_callback_lane(worker, lane_num, atomic_load(&callback_lanes[lane_num].weight)) ) {
+			worker->next_lane = ( lane_num + 1 ) % CALLBACK_CHANNEL_LANES;
+			break;
+		}
+	}
+
+	if ( worker->count == 0 ) release_callback_lanes( worker );
+}
+
 
 /*
- * Start a Thread which will wait for ANT callbacks and dispatch them when they arrive.
+ * Wait until there are callbacks for the worker to run.
  */
-void
-rant_start_callback_thread()
+static void *
+wait_for_callback_signal( void *w_ptr )
 {
-	// ThreadGroup isn't a public symbol, so have to look it up
-	VALUE cThGroup = rb_define_class( "ThreadGroup", rb_cObject );
-	VALUE thread_group = rb_class_new_instance( 0, NULL, cThGroup );
-	VALUE callback_dispatcher = rb_thread_create( callback_thread, (void *)NULL );
+	callback_worker_t *worker = (callback_worker_t *)w_ptr;
+
+	worker->count = 0;
+
+	// Fast path: there's already something waiting
+	take_callbacks( worker );
+
+	pthread_mutex_lock( &worker->mutex );
+
+	// abort signal is used when ruby wants us to stop waiting
+	while ( worker->count == 0 && worker->abort == false )
+	{
+		// Announce that we're going to sleep, then check again so a push that
+		// raced with the announcement isn't missed.
+		atomic_store( &worker->sleeping, true );
+		atomic_thread_fence( memory_order_seq_cst );
+
+		take_callbacks( worker );
+		if ( worker->count == 0 && worker->abort == false )
+			pthread_cond_wait( &worker->cond, &worker->mutex );
+
+		atomic_store( &worker->sleeping, false );
+	}
+
+	pthread_mutex_unlock( &worker->mutex );
+
+	return NULL;
+}
+
+
+/*
+ * Unblocking function: tell the worker to abort if Ruby says it's
+ * shutdown time.
+ */
+static void
+stop_waiting_for_callback_signal( void *w_ptr )
+{
+	callback_worker_t *worker = (callback_worker_t *)w_ptr;
+
+	pthread_mutex_lock( &worker->mutex );
+
+	worker->abort = true;
+
+	pthread_cond_broadcast( &worker->cond );
+	pthread_mutex_unlock( &worker->mutex );
+}
+
+
+/*
+ * Callback worker thread routine; loops until told to abort. Each loop:
+ *
+ * - Release the GVL
+ * - Wait on a signal on the worker's condition variable with an unblock
+ *   function that tells it to abort.
+ * - Take up to a batch's worth of callbacks from its lanes and run them all
+ *   under a single acquisition of the GVL.
+ *
+ */
+static VALUE
+callback_thread( void *w_ptr )
+{
+	callback_worker_t *worker = (callback_worker_t *)w_ptr;
+
+	while ( worker->abort == false )
+	{
+		// release the GIL while waiting for a callback notification
+		rb_thread_call_without_gvl( wait_for_callback_signal, worker,
+			stop_waiting_for_callback_signal, worker );
+
+		// if ruby wants us to abort, there won't be any callbacks
+		if ( worker->count )
+		{
+			handle_worker_callbacks( worker );
+		}
+	}
+
+	return Qnil;
+}
+
+
+/*
+ * Start the pool of callback workers (and the lanes they drain) using the
+ * current settings.
+ */
+static void
+start_callback_workers()
+{
+	VALUE thread_group = rb_ivar_get( rant_mAnt, rb_intern("@callback_threads") );
+	VALUE threads = rb_ary_new_capa( callback_worker_setting );
+	unsigned int i;
+
+	for ( i = 0; i < CALLBACK_LANE_COUNT; i++ ) {
+		callback_lanes[i].ring = callback_ring_new( callback_queue_capacity );
+		atomic_store( &callback_lanes[i].busy, false );
+		atomic_store( &callback_lanes[i].latest_pending, false );
+	}
+
+	callback_worker_count = callback_worker_setting;
+	callback_workers = ALLOC_N( callback_worker_t, callback_worker_count );
+	for ( i = 0; i < callback_worker_count; i++ ) {
+		callback_worker_t *worker = &callback_workers[i];
+
+		worker->id = i;
+		worker->pinned = callback_channels_pinned;
+		worker->next_lane = i % CALLBACK_CHANNEL_LANES;
+		worker->held_lanes = 0;
+		worker->callbacks = ALLOC_N( rant_callback_t, callback_batch_size );
+		worker->batch_size = callback_batch_size;
+		worker->count = 0;
+		worker->abort = false;
+		pthread_mutex_init( &worker->mutex, NULL );
+		pthread_cond_init( &worker->cond, NULL );
+		atomic_init( &worker->sleeping, false );
+	}
+
+	REALLOC_N( callback_poller.callbacks, rant_callback_t, callback_batch_size );
+
+	// Don't start any of the threads until all of the workers are set up, as
+	// producers might look at any of them.
+	for ( i = 0; i < callback_worker_count; i++ ) {
+		callback_worker_t *worker = &callback_workers[i];
+
+		worker->thread = rb_thread_create( callback_thread, (void *)worker );
+
+		rb_funcall( worker->thread, rb_intern("name="), 1, rb_sprintf("ant-callback-%u", i) );
+		rb_funcallv( thread_group, rb_intern("add"), 1, &worker->thread );
+		rb_ary_push( threads, worker->thread );
+	}
+
+	rb_ary_freeze( threads );
+	rb_ivar_set( rant_mAnt, rb_intern("@callback_workers"), threads );
+	rb_ivar_set( rant_mAnt, rb_intern("@callback_dispatcher"), rb_ary_entry(threads, 0) );
+}
+
+
+/*
+ * Stop the callback workers, wait for them to exit, and free the lanes they were
+ * draining.
+ */
+static void
+stop_callback_workers()
+{
+	unsigned int i;
+
+	for ( i = 0; i < callback_worker_count; i++ ) {
+		stop_waiting_for_callback_signal( &callback_workers[i] );
+	}
+	for ( i = 0; i < callback_worker_count; i++ ) {
+		rb_funcall( callback_workers[i].thread, id_join, 0 );
+		pthread_mutex_destroy( &callback_workers[i].mutex );
+		pthread_cond_destroy( &callback_workers[i].cond );
+		xfree( callback_workers[i].callbacks );
+	}
+
+	for ( i = 0; i < CALLBACK_LANE_COUNT; i++ ) {
+		callback_ring_free( callback_lanes[i].ring );
+		callback_lanes[i].ring = NULL;
+	}
+
+	xfree( callback_workers );
+	callback_workers = NULL;
+	callback_worker_count = 0;
+}
+
+
+
+
+/*
+ * Returns +true+ if there are no callbacks waiting in any of the lanes.
+ */
+static bool
+callback_lanes_empty_p()
+{
+	unsigned int i;
+
+	for ( i = 0; i < CALLBACK_LANE_COUNT; i++ ) {
+		if ( !callback_ring_empty_p(callback_lanes[i].ring) ||
+			atomic_load(&callback_lanes[i].latest_pending) )
+			return false;
+	}
+
+	return true;
+}
+
+
+/*
+ * Raise if the callback settings can't be changed right now; they can only be
+ * changed while the ANT library isn't initialized and nothing is queued.
+ */
+static void
+check_callback_settings_changeable()
+{
+	if ( rant_device_initialized ) {
+		rb_raise( rb_eRuntimeError, "can't reconfigure callbacks while ANT is initialized" );
+	}
+
+	if ( !callback_lanes_empty_p() ) {
+		rb_raise( rb_eRuntimeError, "can't reconfigure callbacks while callbacks are pending" );
+	}
+}
+
+
+/*
+ * Restart the callback workers so changed settings take effect.
+ */
+static void
+restart_callback_workers()
+{
+	stop_callback_workers();
+	start_callback_workers();
+}
+
+
+/*
+ * Return the number of callbacks a worker takes from the lane for +channel+
+ * each time it's the lane's turn.
+ */
+unsigned int
+rant_callback_lane_weight( unsigned char channel )
+{
+	return atomic_load( &callback_lanes[channel & CHANNEL_NUMBER_MASK].weight );
+}
+
+
+/*
+ * Set the number of callbacks a worker takes from the lane for +channel+ each
+ * time it's the lane's turn. Can be changed at any time.
+ */
+void
+rant_callback_set_lane_weight( unsigned char channel, unsigned int weight )
+{
+	atomic_store( &callback_lanes[channel & CHANNEL_NUMBER_MASK].weight, weight );
+}
+
+
+/*
+ * Return the number of callbacks for +channel+ that have been dropped because
+ * its lane was full.
+ */
+unsigned long long
+rant_callback_lane_drops( unsigned char channel )
+{
+	return atomic_load( &callback_lanes[channel & CHANNEL_NUMBER_MASK].dropped );
+}
+
+
+/*
+ * call-seq:
+ *    Ant.callback_queue_capacity   -> integer
+ *
+ * Return the number of callbacks that can be waiting for dispatch at once on
+ * each channel's lane (and on the lane for responses).
+ *
+ */
+static VALUE
+rant_s_callback_queue_capacity( VALUE _module )
+{
+	return SIZET2NUM( callback_queue_capacity );
+}
+
+
+/*
+ * call-seq:
+ *    Ant.callback_queue_capacity = integer
+ *
+ * Set the number of callbacks that can be waiting for dispatch at once. The
+ * value is rounded up to the next power of two. This can only be changed while
+ * the ANT library isn't initialized.
+ *
+ */
+static VALUE
+rant_s_callback_queue_capacity_eq( VALUE _module, VALUE capacity )
+{
+	const size_t requested = NUM2SIZET( capacity );
+	size_t new_capacity = 2;
+
+	if ( requested > (SIZE_MAX >> 2) ) {
+		rb_raise( rb_eArgError, "callback queue capacity %zu is too large", requested );
+	}
+	while ( new_capacity < requested ) new_capacity <<= 1;
+
+	check_callback_settings_changeable();
+
+	callback_queue_capacity = new_capacity;
+	restart_callback_workers();
+
+	return capacity;
+}
+
+
+/*
+ * call-seq:
+ *    Ant.callback_workers   -> integer
+ *
+ * Return the number of threads that dispatch ANT callbacks to Ruby.
+ *
+ */
+static VALUE
+rant_s_callback_workers( VALUE _module )
+{
+	return UINT2NUM( callback_worker_count );
+}
+
+
+/*
+ * call-seq:
+ *    Ant.callback_workers = integer
+ *
+ * Set the number of long-lived threads that dispatch ANT callbacks to Ruby.
+ * This can only be changed while the ANT library isn't initialized.
+ *
+ * Note that a callback that waits on a response from ANT (e.g., via one of
+ * the +timeout+ arguments) occupies its worker until the response arrives, so
+ * make sure there are enough workers left over to dispatch it.
+ *
+ * Setting this to 0 stops all of the workers; callbacks will then only be run
+ * by calling Ant.read_events.
+ *
+ */
+static VALUE
+rant_s_callback_workers_eq( VALUE _module, VALUE count )
+{
+	const unsigned int workers = NUM2UINT( count );
+
+	if ( workers > MAX_CALLBACK_WORKERS ) {
+		rb_raise( rb_eArgError, "expected between 0 and %d callback workers, got %u",
+			MAX_CALLBACK_WORKERS, workers );
+	}
+
+	check_callback_settings_changeable();
+
+	callback_worker_setting = workers;
+	restart_callback_workers();
+
+	return count;
+}
+
+
+/*
+ * call-seq:
+ *    Ant.pin_callback_channels?   -> true or false
+ *
+ * Returns +true+ if each channel's callbacks are always dispatched by the
+ * same worker.
+ *
+ */
+static VALUE
+rant_s_pin_callback_channels_p( VALUE _module )
+{
+	return callback_channels_pinned ? Qtrue : Qfalse;
+}
+
+
+/*
+ * call-seq:
+ *    Ant.pin_callback_channels = true or false
+ *
+ * If set to +true+, each channel number is pinned to a single callback
+ * worker. If +false+ (the default), any idle worker can take callbacks for a
+ * channel that isn't already being handled by another worker. Either way, each
+ * channel's callbacks are handled one at a time in the order they arrived.
+ * This can only be changed while the ANT library isn't initialized.
+ *
+ */
+static VALUE
+rant_s_pin_callback_channels_eq( VALUE _module, VALUE true_false )
+{
+	check_callback_settings_changeable();
+
+	callback_channels_pinned = RTEST( true_false );
+	restart_callback_workers();
+
+	return true_false;
+}
+
+
+/*
+ * call-seq:
+ *    Ant.callback_batch_size   -> integer
+ *
+ * Return the maximum number of queued callbacks a worker will run each time it
+ * wakes up.
+ *
+ */
+static VALUE
+rant_s_callback_batch_size( VALUE _module )
+{
+	return SIZET2NUM( callback_batch_size );
+}
+
+
+/*
+ * call-seq:
+ *    Ant.callback_batch_size = integer
+ *
+ * Set the maximum number of queued callbacks a worker will run each time it
+ * wakes up; they're all run without releasing the GVL in between. This can
+ * only be changed while the ANT library isn't initialized.
+ *
+ */
+static VALUE
+rant_s_callback_batch_size_eq( VALUE _module, VALUE size )
+{
+	const size_t batch_size = NUM2SIZET( size );
+
+	if ( batch_size < 1 || batch_size > MAX_CALLBACK_BATCH_SIZE ) {
+		rb_raise( rb_eArgError, "expected a batch size between 1 and %d, got %zu",
+			MAX_CALLBACK_BATCH_SIZE, batch_size );
+	}
+
+	check_callback_settings_changeable();
+
+	callback_batch_size = batch_size;
+	restart_callback_workers();
+
+	return size;
+}
+
+
+/*
+ * call-seq:
+ *    Ant.callback_overflow_policy   -> symbol
+ *
+ * Return what happens to a callback when its channel's queue is full; see
+ * Ant.callback_overflow_policy=.
+ *
+ */
+static VALUE
+rant_s_callback_overflow_policy( VALUE _module )
+{
+	switch ( atomic_load(&callback_overflow_policy) ) {
+	case CALLBACK_OVERFLOW_DROP_OLDEST:
+		return ID2SYM( id_drop_oldest );
+	case CALLBACK_OVERFLOW_DROP_NEWEST:
+		return ID2SYM( id_drop_newest );
+	case CALLBACK_OVERFLOW_KEEP_LATEST_PER_CHANNEL:
+		return ID2SYM( id_keep_latest_per_channel );
+	default:
+		return ID2SYM( id_block );
+	}
+}
+
+
+/*
+ * call-seq:
+ *    Ant.callback_overflow_policy = symbol
+ *
+ * Set what happens to a callback when its channel's queue is full:
+ *
+ * [:block]
+ *   The ANT library's receive thread waits until there's room (the default).
+ *   If the handlers can't keep up, the ANT device's own queue will eventually
+ *   overflow (EVENT_QUE_OVERFLOW).
+ * [:drop_oldest]
+ *   The oldest queued callback for the channel is thrown away to make room.
+ * [:drop_newest]
+ *   The new callback is thrown away.
+ * [:keep_latest_per_channel]
+ *   Everything already queued for the channel is kept, and only the most
+ *   recent of the callbacks that arrive while it's full is kept, to be run
+ *   after the rest. This is kept per channel, not per device, so on a
+ *   wildcard or scanning channel that hears several devices, only the one
+ *   that was heard from last keeps its latest data.
+ *
+ * Callbacks for Ant.on_response are never dropped. Dropped callbacks are
+ * counted in Ant.dropped_callbacks and Ant::Channel#dropped_events, and if
+ * callbacks are synchronous the ANT library is told they weren't handled.
+ * This can be changed at any time.
+ *
+ */
+static VALUE
+rant_s_callback_overflow_policy_eq( VALUE _module, VALUE policy )
+{
+	const ID policy_id = rb_sym2id( policy );
+
+	if ( policy_id == id_block ) {
+		atomic_store( &callback_overflow_policy, CALLBACK_OVERFLOW_BLOCK );
+	} else if ( policy_id == id_drop_oldest ) {
+		atomic_store( &callback_overflow_policy, CALLBACK_OVERFLOW_DROP_OLDEST );
+	} else if ( policy_id == id_drop_newest ) {
+		atomic_store( &callback_overflow_policy, CALLBACK_OVERFLOW_DROP_NEWEST );
+	} else if ( policy_id == id_keep_latest_per_channel ) {
+		atomic_store( &callback_overflow_policy, CALLBACK_OVERFLOW_KEEP_LATEST_PER_CHANNEL );
+	} else {
+		rb_raise( rb_eArgError, "unknown callback overflow policy %"PRIsVALUE, rb_inspect(policy) );
+	}
+
+	return policy;
+}
+
+
+/*
+ * call-seq:
+ *    Ant.dropped_callbacks   -> integer
+ *
+ * Return the total number of callbacks that have been dropped because their
+ * channel's queue was full.
+ *
+ */
+static VALUE
+rant_s_dropped_callbacks( VALUE _module )
+{
+	unsigned long long total = 0;
+	unsigned int i;
+
+	for ( i = 0; i < CALLBACK_LANE_COUNT; i++ ) {
+		total += atomic_load( &callback_lanes[i].dropped );
+	}
+
+	return ULL2NUM( total );
+}
+
+
+/*
+ * call-seq:
+ *    Ant.event_io   -> io
+ *
+ * Return an IO that becomes readable when there are callbacks waiting to be
+ * run, for use with IO.select and the like. When it's readable, call
+ * Ant.read_events to run them. The IO is backed by an eventfd where
+ * available, and a pipe otherwise; it's owned by the extension, so don't
+ * close it or read from it directly.
+ *
+ */
+static VALUE
+rant_s_event_io( VALUE module )
+{
+	VALUE io = rb_ivar_get( module, rb_intern("@event_io") );
+	int fds[ 2 ];
+
+	if ( !NIL_P(io) ) return io;
+
+#ifdef HAVE_SYS_EVENTFD_H
+	fds[0] = fds[1] = eventfd( 0, EFD_NONBLOCK|EFD_CLOEXEC );
+	if ( fds[0] < 0 ) rb_sys_fail( "eventfd" );
+	rb_update_max_fd( fds[0] );
+#else
+	if ( pipe(fds) < 0 ) rb_sys_fail( "pipe" );
+	rb_update_max_fd( fds[0] );
+	rb_update_max_fd( fds[1] );
+	fcntl( fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK );
+	fcntl( fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK );
+	rb_fd_fix_cloexec( fds[0] );
+	rb_fd_fix_cloexec( fds[1] );
+#endif
+
+	io = rb_io_fdopen( fds[0], O_RDONLY, NULL );
+	rb_funcall( io, rb_intern("autoclose="), 1, Qfalse );
+	rb_ivar_set( module, rb_intern("@event_io"), io );
+
+	event_io_read_fd = fds[0];
+	event_io_write_fd = fds[1];
+
+	// Don't miss anything that was queued before the IO was created
+	if ( !callback_lanes_empty_p() ) signal_event_io();
+
+	return io;
+}
+
+
+/*
+ * Let another thread use the poller after Ant.read_events is done with it.
+ */
+static VALUE
+release_callback_poller( VALUE _unused )
+{
+	release_callback_lanes( &callback_poller );
+	callback_poller.count = 0;
+	callback_poller_busy = false;
+
+	return Qnil;
+}
+
+
+/*
+ * Run the queued callbacks for Ant.read_events.
+ */
+static VALUE
+run_polled_callbacks( VALUE max_ptr )
+{
+	const size_t max = *(size_t *)max_ptr;
+	size_t handled = 0;
+
+	clear_event_io();
+
+	while ( handled < max ) {
+		callback_poller.batch_size = max - handled;
+		if ( callback_poller.batch_size > callback_batch_size )
+			callback_poller.batch_size = callback_batch_size;
+
+		take_callbacks( &callback_poller );
+		if ( callback_poller.count == 0 ) break;
+
+		handled += callback_poller.count;
+		handle_worker_callbacks( &callback_poller );
+	}
+
+	// If there's still more waiting, leave the IO readable
+	if ( !callback_lanes_empty_p() ) signal_event_io();
+
+	return SIZET2NUM( handled );
+}
+
+
+/*
+ * call-seq:
+ *    Ant.read_events( max=Ant.callback_batch_size )   -> integer
+ *
+ * Run up to +max+ of the callbacks that are waiting to be dispatched in the
+ * calling thread, without waiting for more to arrive, and return the number
+ * that were run. Combined with Ant.event_io, this lets an existing event loop
+ * dispatch ANT events, with or without any callback workers.
+ *
+ */
+static VALUE
+rant_s_read_events( int argc, VALUE *argv, VALUE _module )
+{
+	VALUE max_arg = Qnil;
+	size_t max = callback_batch_size;
+
+	rb_scan_args( argc, argv, "01", &max_arg );
+
+	if ( !NIL_P(max_arg) ) max = NUM2SIZET( max_arg );
+	if ( max == 0 ) return INT2FIX( 0 );
+
+	if ( callback_poller_busy ) {
+		rb_raise( rb_eThreadError, "already reading events in another thread" );
+	}
+	callback_poller_busy = true;
+
+	return rb_ensure( run_polled_callbacks, (VALUE)&max, release_callback_poller, Qnil );
+}
+
+
+/*
+ * call-seq:
+ *    Ant.async_callbacks?   -> true or false
+ *
+ * Returns +true+ if ANT callbacks are delivered asynchronously.
+ *
+ */
+static VALUE
+rant_s_async_callbacks_p( VALUE _module )
+{
+	return atomic_load( &rant_async_callbacks ) ? Qtrue : Qfalse;
+}
+
+
+/*
+ * call-seq:
+ *    Ant.async_callbacks = true or false
+ *
+ * If set to +true+, the ANT library's receive thread queues a snapshot of each
+ * message and returns immediately instead of waiting for the Ruby handler to
+ * finish, so slow handlers don't hold up reading from the ANT device. The
+ * return value of the handler is ignored in this mode. Defaults to +false+.
+ *
+ */
+static VALUE
+rant_s_async_callbacks_eq( VALUE _module, VALUE true_false )
+{
+	atomic_store( &rant_async_callbacks, RTEST(true_false) ? true : false );
+	return true_false;
+}
+
+
+/*
+ * call-seq:
+ *    Ant.after_fork
+ *
+ * Start over with a new pool of callback workers (and a new Ant.event_io) in a
+ * child process. Only the thread that forked exists in the child, so the
+ * parent's workers are abandoned instead of being stopped, as their locks might
+ * have been held by threads that are gone. Call it in the child before
+ * initializing ANT there. The ANT library can't be shared between processes,
+ * so the parent must not have it initialized when it forks.
+ *
+ */
+static VALUE
+rant_s_after_fork( VALUE module )
+{
+	unsigned int i;
+
+	if ( rant_device_initialized ) {
+		rb_raise( rb_eRuntimeError, "can't start over after a fork while ANT is initialized" );
+	}
+
+	callback_workers = NULL;
+	callback_worker_count = 0;
+	callback_poller_busy = false;
+
+	for ( i = 0; i < CALLBACK_LANE_COUNT; i++ ) {
+		pthread_mutex_init( &callback_lanes[i].latest_mutex, NULL );
+		pthread_mutex_init( &callback_lanes[i].room_mutex, NULL );
+		pthread_cond_init( &callback_lanes[i].room_cond, NULL );
+		atomic_store( &callback_lanes[i].room_waiters, 0 );
+	}
+
+	// Signals from this process shouldn't wake up the parent's Ant.event_io
+	if ( event_io_write_fd >= 0 && event_io_write_fd != event_io_read_fd ) close( event_io_write_fd );
+	if ( event_io_read_fd >= 0 ) close( event_io_read_fd );
+	event_io_read_fd = event_io_write_fd = -1;
+	atomic_store( &event_io_signalled, false );
+	rb_ivar_set( module, rb_intern("@event_io"), Qnil );
+
+	start_callback_workers();
+
+	return Qtrue;
+}
+
+
+/*
+ * Set up the callback settings.
+ */
+void
+init_ant_callbacks()
+{
+	unsigned int i;
+
+	id_join = rb_intern( "join" );
+
+	callback_poller.id = 0;
+	callback_poller.pinned = false;
+	callback_poller.next_lane = 0;
+	callback_poller.held_lanes = 0;
+	callback_poller.callbacks = NULL;
+	callback_poller.batch_size = 0;
+	callback_poller.count = 0;
+	callback_poller.abort = false;
+	callback_poller.thread = Qnil;
+	id_block = rb_intern( "block" );
+	id_drop_oldest = rb_intern( "drop_oldest" );
+	id_drop_newest = rb_intern( "drop_newest" );
+	id_keep_latest_per_channel = rb_intern( "keep_latest_per_channel" );
+
+	for ( i = 0; i < CALLBACK_LANE_COUNT; i++ ) {
+		callback_lanes[i].ring = NULL;
+		atomic_init( &callback_lanes[i].busy, false );
+		atomic_init( &callback_lanes[i].weight, DEFAULT_CALLBACK_LANE_WEIGHT );
+		pthread_mutex_init( &callback_lanes[i].latest_mutex, NULL );
+		atomic_init( &callback_lanes[i].latest_pending, false );
+		pthread_mutex_init( &callback_lanes[i].room_mutex, NULL );
+		pthread_cond_init( &callback_lanes[i].room_cond, NULL );
+		atomic_init( &callback_lanes[i].room_waiters, 0 );
+		atomic_init( &callback_lanes[i].dropped, 0 );
+	}
+
+	rb_define_singleton_method( rant_mAnt, "callback_queue_capacity",
+		rant_s_callback_queue_capacity, 0 );
+	rb_define_singleton_method( rant_mAnt, "callback_queue_capacity=",
+		rant_s_callback_queue_capacity_eq, 1 );
+	rb_define_singleton_method( rant_mAnt, "callback_workers", rant_s_callback_workers, 0 );
+	rb_define_singleton_method( rant_mAnt, "callback_workers=", rant_s_callback_workers_eq, 1 );
+	rb_define_singleton_method( rant_mAnt, "pin_callback_channels?",
+		rant_s_pin_callback_channels_p, 0 );
+	rb_define_singleton_method( rant_mAnt, "pin_callback_channels=",
+		rant_s_pin_callback_channels_eq, 1 );
+	rb_define_singleton_method( rant_mAnt, "callback_batch_size", rant_s_callback_batch_size, 0 );
+	rb_define_singleton_method( rant_mAnt, "callback_batch_size=",
+		rant_s_callback_batch_size_eq, 1 );
+	rb_define_singleton_method( rant_mAnt, "callback_overflow_policy",
+		rant_s_callback_overflow_policy, 0 );
+	rb_define_singleton_method( rant_mAnt, "callback_overflow_policy=",
+		rant_s_callback_overflow_policy_eq, 1 );
+	rb_define_singleton_method( rant_mAnt, "dropped_callbacks", rant_s_dropped_callbacks, 0 );
+	rb_define_singleton_method( rant_mAnt, "event_io", rant_s_event_io, 0 );
+	rb_define_singleton_method( rant_mAnt, "read_events", rant_s_read_events, -1 );
+	rb_define_singleton_method( rant_mAnt, "async_callbacks?", rant_s_async_callbacks_p, 0 );
+	rb_define_singleton_method( rant_mAnt, "async_callbacks=", rant_s_async_callbacks_eq, 1 );
+	rb_define_singleton_method( rant_mAnt, "after_fork", rant_s_after_fork, 0 );
+}
+
+
+/*
+ * Start the Threads which will wait for ANT callbacks and dispatch them when they arrive.
+ */
+void
+rant_start_callback_thread()
+{
+	// ThreadGroup isn't a public symbol, so have to look it up
+	VALUE cThGroup = rb_define_class( "ThreadGroup", rb_cObject );
+	VALUE thread_group = rb_class_new_instance( 0, NULL, cThGroup );
+
+	rb_ivar_set( rant_mAnt, rb_intern("@callback_threads"), thread_group );
+	start_callback_workers();
 
-	rb_funcallv( thread_group, rb_intern("add"), 1, &callback_dispatcher );
-	rb_ivar_set( rant_mAnt, rb_intern("@callback_threads"), thread_group );
-	rb_ivar_set( rant_mAnt, rb_intern("@callback_dispatcher"), callback_dispatcher );
 	rb_attr( rb_singleton_class(rant_mAnt), rb_intern("callback_threads"), 1, 0, 0 );
 	rb_attr( rb_singleton_class(rant_mAnt), rb_intern("callback_dispatcher"), 1, 0, 0 );
 }
@@ -9,15 +9,60 @@
 
 #include "ant_ext.h"
 
+#include <errno.h>
+
 #define DEFAULT_ADV_PACKETS 3
 #define ADVANCED_BURST_TIMEOUT 5
 
+// How many seconds a streamed burst waits for the device to ask for more data
+// or to finish sending it
+#define BURST_STREAM_TIMEOUT 5
+
+// The clock the channels' transmit conditions time their waits with
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+# define TX_WAIT_CLOCK  CLOCK_MONOTONIC
+#else
+# define TX_WAIT_CLOCK  CLOCK_REALTIME
+#endif
+
+// The longest reused event buffer; strings this short are embedded in their
+// object on every supported Ruby, so copies of them never share its memory.
+#define MAX_REUSED_EVENT_BUFFER_SIZE 23
+
 VALUE rant_cAntChannel;
 
 VALUE rant_mAntDataUtilities;
 
+// Channels with an event callback assigned, indexed by channel number, for
+// looking up their receive buffers from the ANT library's thread. The receive
+// thread holds on to the channel in a slot while it's using it, and a channel
+// isn't freed until it's out of its slot and nothing's holding it, so the
+// slots and the holds are guarded by the event_channels_mutex.
+static rant_channel_t *event_channels[ CHANNEL_NUMBER_MASK + 1 ];
+static pthread_mutex_t event_channels_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t event_channels_cond = PTHREAD_COND_INITIALIZER;
+
+// The registered (assigned and not yet closed) channel objects, indexed by
+// channel number, so callbacks can find them without any ivar or Hash lookups.
+// Channel numbers are only 5 bits wide, so this covers every channel a device
+// can have whatever its max_channels capability is. Kept in sync with
+// Ant::Channel.registry, and only used with the GVL held.
+static VALUE channel_table[ CHANNEL_NUMBER_MASK + 1 ];
+
+// Channels that have been closed with #close, kept until their
+// EVENT_CHANNEL_CLOSED has been dispatched (or they're unassigned, or their
+// number's taken by another channel) so the events still on their way to them
+// don't end up with a channel that's been collected.
+static VALUE closing_channel_table[ CHANNEL_NUMBER_MASK + 1 ];
+
 static void rant_channel_free( void * );
 static void rant_channel_mark( void * );
+static bool rant_channel_unwatch_events( rant_channel_t * );
+static void rant_channel_resolve_futures( rant_channel_t *, unsigned char );
+static void rant_channel_clear_tx_queue( rant_channel_t *, unsigned char );
+static void rant_channel_send_queued( rant_channel_t * );
+static VALUE rant_channel_call_refill_callback( VALUE );
+static BOOL rant_channel_on_event_callback( unsigned char, unsigned char );
 
 
 static const rb_data_type_t rant_channel_datatype_t = {
@@ -40,10 +85,29 @@ rant_channel_free( void *ptr )
 {
 	if ( ptr ) {
 		rant_channel_t *channel = (rant_channel_t *)ptr;
-		ANT_AssignChannelEventFunction( channel->channel_num, NULL, NULL );
-		ANT_UnAssignChannel( channel->channel_num );
+
+		// Wait for the receive thread to finish with the channel before any of
+		// it goes away, and leave the channel number alone if it's been
+		// reassigned to another channel since
+		if ( rant_channel_unwatch_events(channel) && !channel->unassigned ) {
+			ANT_UnAssignChannel( channel->channel_num );
+		}
 
 		channel->callback = Qnil;
+		channel->batch_callback = Qnil;
+		channel->burst_callback = Qnil;
+		channel->broadcast_refill_callback = Qnil;
+		free( channel->burst_buffer );
+
+		// Nothing can finish the pending sends anymore
+		pthread_mutex_lock( &channel->tx_mutex );
+		rant_channel_resolve_futures( channel, EVENT_CHANNEL_CLOSED );
+		rant_channel_clear_tx_queue( channel, EVENT_CHANNEL_CLOSED );
+		pthread_mutex_unlock( &channel->tx_mutex );
+
+		pthread_mutex_destroy( &channel->tx_mutex );
+		pthread_cond_destroy( &channel->tx_cond );
+		free( channel->broadcast_ring );
 
 		xfree( ptr );
 		ptr = NULL;
@@ -59,6 +123,10 @@ rant_channel_mark( void *ptr )
 {
 	rant_channel_t *channel = (rant_channel_t *)ptr;
 	rb_gc_mark( channel->callback );
+	rb_gc_mark( channel->batch_callback );
+	rb_gc_mark( channel->event_buffers );
+	rb_gc_mark( channel->burst_callback );
+	rb_gc_mark( channel->broadcast_refill_callback );
 }
 
 
@@ -69,14 +137,130 @@ static VALUE
 rant_channel_alloc( VALUE klass )
 {
 	rant_channel_t *ptr;
+	pthread_condattr_t attr;
 
 	VALUE rval = TypedData_Make_Struct( klass, rant_channel_t, &rant_channel_datatype_t, ptr );
 	ptr->callback = Qnil;
+	ptr->batch_callback = Qnil;
+	ptr->batch_size = DEFAULT_CALLBACK_BATCH_SIZE;
+	ptr->timestamps = 0;
+	ptr->event_buffers = Qnil;
+	ptr->event_objects = false;
+	ptr->burst_callback = Qnil;
+	ptr->burst_buffer = NULL;
+	ptr->burst_in_progress = false;
+	atomic_init( &ptr->failed_bursts, 0 );
+	pthread_mutex_init( &ptr->tx_mutex, NULL );
+	pthread_condattr_init( &attr );
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+	pthread_condattr_setclock( &attr, TX_WAIT_CLOCK );
+#endif
+	pthread_cond_init( &ptr->tx_cond, &attr );
+	pthread_condattr_destroy( &attr );
+	ptr->pending_futures = NULL;
+	ptr->last_pending_future = NULL;
+	ptr->tx_queue = NULL;
+	ptr->tx_queue_tail = NULL;
+	ptr->tx_queue_length = 0;
+	ptr->tx_queue_depth = DEFAULT_TX_QUEUE_DEPTH;
+	ptr->tx_queue_retries = DEFAULT_TX_QUEUE_RETRIES;
+	ptr->tx_queue_sending = false;
+	ptr->tx_queue_blocked = false;
+	atomic_init( &ptr->tx_queue_retried, 0 );
+	ptr->broadcast_ring = NULL;
+	ptr->broadcast_ring_size = 0;
+	ptr->broadcast_ring_head = 0;
+	ptr->broadcast_ring_length = 0;
+	ptr->broadcast_ring_low_water = DEFAULT_BROADCAST_RING_LOW_WATER;
+	ptr->broadcast_refill_callback = Qnil;
+	atomic_init( &ptr->broadcast_refill_pending, false );
+	atomic_init( &ptr->broadcast_ring_sent, 0 );
+	atomic_init( &ptr->broadcast_ring_underruns, 0 );
+	atomic_init( &ptr->native_sink_count, 0 );
+	atomic_init( &ptr->last_event_time, 0 );
+	atomic_init( &ptr->closed_by_device, false );
+	ptr->unassigned = false;
+	ptr->event_holds = 0;
 
 	return rval;
 }
 
 
+/*
+ * Start passing the events on the channel +ptr+ to the event callback, taking
+ * over its channel number from whatever channel had it before.
+ */
+static void
+rant_channel_watch_events( rant_channel_t *ptr )
+{
+	pthread_mutex_lock( &event_channels_mutex );
+	event_channels[ ptr->channel_num & CHANNEL_NUMBER_MASK ] = ptr;
+	pthread_mutex_unlock( &event_channels_mutex );
+
+	ANT_AssignChannelEventFunction( ptr->channel_num, rant_channel_on_event_callback, ptr->buffer );
+}
+
+
+/*
+ * Stop passing events to the channel +ptr+ (if its channel number hasn't been
+ * taken over by another channel since), and wait for the receive thread to
+ * finish with any it's in the middle of. Returns +true+ if the channel still
+ * had its channel number.
+ */
+static bool
+rant_channel_unwatch_events( rant_channel_t *ptr )
+{
+	const unsigned char slot = ptr->channel_num & CHANNEL_NUMBER_MASK;
+	bool watching;
+
+	pthread_mutex_lock( &event_channels_mutex );
+	watching = ( event_channels[slot] == ptr );
+	if ( watching ) event_channels[ slot ] = NULL;
+	pthread_mutex_unlock( &event_channels_mutex );
+
+	if ( watching ) ANT_AssignChannelEventFunction( ptr->channel_num, NULL, NULL );
+
+	pthread_mutex_lock( &event_channels_mutex );
+	while ( ptr->event_holds ) {
+		pthread_cond_wait( &event_channels_cond, &event_channels_mutex );
+	}
+	pthread_mutex_unlock( &event_channels_mutex );
+
+	return watching;
+}
+
+
+/*
+ * Return the channel that's taking the events for +channel_num+ (or NULL if
+ * there isn't one), held so it can't be freed until it's let go of with
+ * rant_channel_let_go() -- called from the ANT library's receive thread.
+ */
+static rant_channel_t *
+rant_channel_hold( unsigned char channel_num )
+{
+	rant_channel_t *ptr;
+
+	pthread_mutex_lock( &event_channels_mutex );
+	ptr = event_channels[ channel_num & CHANNEL_NUMBER_MASK ];
+	if ( ptr ) ptr->event_holds++;
+	pthread_mutex_unlock( &event_channels_mutex );
+
+	return ptr;
+}
+
+
+/*
+ * Let go of the channel +ptr+ that was held with rant_channel_hold().
+ */
+static void
+rant_channel_let_go( rant_channel_t *ptr )
+{
+	pthread_mutex_lock( &event_channels_mutex );
+	if ( --ptr->event_holds == 0 ) pthread_cond_broadcast( &event_channels_cond );
+	pthread_mutex_unlock( &event_channels_mutex );
+}
+
+
 
 /*
  * Fetch the data pointer and check it for sanity.
@@ -99,16 +283,414 @@ rant_get_channel( VALUE self )
 
 
 /*
- * Clear the registry after channel have been reset.
+ * Register the +channel+ object as the one for +channel_num+, or unregister
+ * whatever channel is if +channel+ is +nil+.
+ */
+static void
+rant_channel_register( unsigned char channel_num, VALUE channel )
+{
+	VALUE registry = rb_iv_get( rant_cAntChannel, "@registry" );
+
+	channel_table[ channel_num & CHANNEL_NUMBER_MASK ] = channel;
+
+	if ( NIL_P(channel) ) {
+		rb_hash_delete( registry, INT2FIX(channel_num) );
+	} else {
+		closing_channel_table[ channel_num & CHANNEL_NUMBER_MASK ] = Qnil;
+		rb_hash_aset( registry, INT2FIX(channel_num), channel );
+	}
+}
+
+
+/*
+ * Stop keeping the closed +channel+ for +channel_num+ around for its events, if
+ * it still is.
+ */
+static void
+rant_channel_forget_closed( unsigned char channel_num, VALUE channel )
+{
+	if ( closing_channel_table[channel_num & CHANNEL_NUMBER_MASK] == channel )
+		closing_channel_table[ channel_num & CHANNEL_NUMBER_MASK ] = Qnil;
+}
+
+
+/*
+ * Clear the registry after channel have been reset, along with the channel
+ * pool that was handing out their numbers.
  */
 void
 rant_channel_clear_registry()
 {
 	VALUE registry = rb_iv_get( rant_cAntChannel, "@registry" );
+	unsigned int i;
+
+	for ( i = 0; i <= CHANNEL_NUMBER_MASK; i++ ) {
+		channel_table[ i ] = Qnil;
+		closing_channel_table[ i ] = Qnil;
+	}
 	rb_hash_clear( registry );
+
+	rb_iv_set( rant_mAnt, "@channel_pool", Qnil );
+}
+
+
+/*
+ * Return the current monotonic time in nanoseconds.
+ */
+static unsigned long long
+rant_channel_monotonic_ns()
+{
+	struct timespec now;
+
+	clock_gettime( CLOCK_MONOTONIC, &now );
+	return (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec;
+}
+
+
+
+/*
+ * The arguments to (and result of) the blocking channel commands, so they can
+ * be run via rant_blocking_call().
+ */
+typedef struct rant_channel_command_t rant_channel_command_t;
+struct rant_channel_command_t {
+	rant_channel_t *channel;
+	unsigned char channel_num;
+	unsigned int response_time;
+
+	unsigned short device_number;
+	unsigned char device_type;
+	unsigned char transmission_type;
+
+	unsigned short period;
+	unsigned char search_timeout;
+	unsigned char frequencies[ 3 ];
+
+	unsigned char *data;
+	unsigned short packets;
+	unsigned char packets_per_message;
+	bool last;
+
+	rant_tx_item_t *item;
+	rant_future_t *future;
+
+	unsigned char event_id;
+
+	bool result;
+};
+
+
+static void *
+rant_channel_set_channel_id_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = ANT_SetChannelId_RTO( cmd->channel_num, cmd->device_number, cmd->device_type,
+		cmd->transmission_type, cmd->response_time );
+
+	return NULL;
+}
+
+
+static void *
+rant_channel_set_channel_period_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = ANT_SetChannelPeriod_RTO( cmd->channel_num, cmd->period, cmd->response_time );
+
+	return NULL;
+}
+
+
+static void *
+rant_channel_set_channel_search_timeout_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = ANT_SetChannelSearchTimeout_RTO( cmd->channel_num, cmd->search_timeout,
+		cmd->response_time );
+
+	return NULL;
+}
+
+
+static void *
+rant_channel_open_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = ANT_OpenChannel_RTO( cmd->channel_num, cmd->response_time );
+
+	return NULL;
+}
+
+
+static void *
+rant_channel_close_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = ANT_CloseChannel_RTO( cmd->channel_num, cmd->response_time );
+
+	return NULL;
+}
+
+
+static void *
+rant_channel_unassign_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = ANT_UnAssignChannel_RTO( cmd->channel_num, cmd->response_time );
+
+	return NULL;
+}
+
+
+static void *
+rant_channel_set_channel_rf_freq_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = ANT_SetChannelRFFreq( cmd->channel_num, cmd->frequencies[0] );
+
+	return NULL;
+}
+
+
+static void *
+rant_channel_config_frequency_agility_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = ANT_ConfigFrequencyAgility( cmd->channel_num, cmd->frequencies[0],
+		cmd->frequencies[1], cmd->frequencies[2] );
+
+	return NULL;
+}
+
+
+/*
+ * Run the library command +fn+ for a send that only writes its message to the
+ * device instead of waiting for a response, with the GVL released. These are
+ * over too quickly to be worth a thread of their own under a fiber scheduler,
+ * which is what rant_blocking_call() would use.
+ */
+static void *
+rant_channel_quick_call( void *(*fn)(void *), void *data )
+{
+	return rb_thread_call_without_gvl( fn, data, NULL, NULL );
+}
+
+
+static void *
+rant_channel_send_acknowledged_data_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = ANT_SendAcknowledgedData( cmd->channel_num, cmd->data );
+
+	return NULL;
+}
+
+
+static void *
+rant_channel_send_broadcast_data_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = ANT_SendBroadcastData( cmd->channel_num, cmd->data );
+
+	return NULL;
+}
+
+
+static void *
+rant_channel_send_burst_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = ANT_SendBurstTransfer( cmd->channel_num, cmd->data, cmd->packets );
+
+	return NULL;
+}
+
+
+/*
+ * The state of a wait for a streamed burst transfer, so it can be run without
+ * the GVL and woken up when the thread is interrupted.
+ */
+typedef struct rant_channel_transfer_wait_t rant_channel_transfer_wait_t;
+struct rant_channel_transfer_wait_t {
+	rant_channel_t *channel;
+	bool until_done;
+	struct timespec deadline;
+	bool interrupted;
+	bool finished;
+	bool result;
+};
+
+
+static void *
+rant_channel_wait_for_transfer_command( void *ptr )
+{
+	rant_channel_transfer_wait_t *wait = (rant_channel_transfer_wait_t *)ptr;
+	rant_channel_t *channel = wait->channel;
+	bool timed_out = false;
+
+	pthread_mutex_lock( &channel->tx_mutex );
+
+	// Until the transfer has started, the device hasn't taken the first packets
+	// yet; after that, wait for each EVENT_TRANSFER_TX_NEXT_MESSAGE if the device
+	// sends them, and otherwise rely on the serial link's flow control
+	while ( !channel->tx_result && !wait->interrupted ) {
+		if ( !wait->until_done && channel->tx_started && (!channel->tx_paced || channel->tx_credits) )
+			break;
+		if ( pthread_cond_timedwait(&channel->tx_cond, &channel->tx_mutex, &wait->deadline) == ETIMEDOUT ) {
+			timed_out = true;
+			break;
+		}
+	}
+
+	if ( !wait->interrupted || channel->tx_result || timed_out ) {
+		wait->finished = true;
+
+		if ( wait->until_done ) {
+			wait->result = ( channel->tx_result == EVENT_TRANSFER_TX_COMPLETED );
+		} else {
+			wait->result = !timed_out && !channel->tx_result;
+			if ( wait->result && channel->tx_paced ) channel->tx_credits--;
+		}
+	}
+
+	pthread_mutex_unlock( &channel->tx_mutex );
+
+	return NULL;
+}
+
+
+/*
+ * Unblocking function for a wait for a streamed burst transfer; wakes it up so
+ * the thread can handle its interrupts.
+ */
+static void
+rant_channel_wait_for_transfer_interrupt( void *ptr )
+{
+	rant_channel_transfer_wait_t *wait = (rant_channel_transfer_wait_t *)ptr;
+	rant_channel_t *channel = wait->channel;
+
+	pthread_mutex_lock( &channel->tx_mutex );
+	wait->interrupted = true;
+	pthread_cond_broadcast( &channel->tx_cond );
+	pthread_mutex_unlock( &channel->tx_mutex );
+}
+
+
+/*
+ * Wait up to BURST_STREAM_TIMEOUT seconds for the device to be ready for more of
+ * the burst being streamed out on the channel +ptr+, or if +until_done+ is set,
+ * for it to finish sending it, without holding the GVL. Returns +false+ if the
+ * transfer ended (or timed out) instead.
+ */
+static bool
+rant_channel_wait_for_transfer( rant_channel_t *ptr, bool until_done )
+{
+	rant_channel_transfer_wait_t wait = { .channel = ptr, .until_done = until_done };
+
+	clock_gettime( TX_WAIT_CLOCK, &wait.deadline );
+	wait.deadline.tv_sec += BURST_STREAM_TIMEOUT;
+
+	// Interrupts that don't raise (or aren't for this thread) just go back to
+	// waiting
+	while ( !wait.finished ) {
+		wait.interrupted = false;
+		rb_thread_call_without_gvl( rant_channel_wait_for_transfer_command, &wait,
+			rant_channel_wait_for_transfer_interrupt, &wait );
+		rb_thread_check_ints();
+	}
+
+	return wait.result;
+}
+
+
+static void *
+rant_channel_send_burst_stream_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+	rant_channel_t *channel = cmd->channel;
+	unsigned char sequence;
+	unsigned short i;
+
+	for ( i = 0; i < cmd->packets; i++ ) {
+		sequence = channel->tx_sequence;
+		if ( cmd->last && i == cmd->packets - 1 ) sequence |= SEQUENCE_LAST_MESSAGE;
+
+		if ( !ANT_SendBurstTransferPacket(channel->channel_num | sequence,
+			cmd->data + i * ANT_STANDARD_DATA_PAYLOAD_SIZE) )
+		{
+			cmd->result = false;
+			return NULL;
+		}
+
+		channel->tx_sequence = ( channel->tx_sequence == SEQUENCE_NUMBER_ROLLOVER ) ?
+			SEQUENCE_NUMBER_INC : channel->tx_sequence + SEQUENCE_NUMBER_INC;
+		channel->tx_packets++;
+	}
+
+	cmd->result = true;
+	return NULL;
+}
+
+
+static void *
+rant_channel_queue_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+	rant_channel_t *channel = cmd->channel;
+
+	pthread_mutex_lock( &channel->tx_mutex );
+
+	// If the queue is full, hand back the oldest item's future to wait on instead
+	if ( channel->tx_queue_length >= channel->tx_queue_depth ) {
+		cmd->future = channel->tx_queue->future;
+		rant_future_retain( cmd->future );
+		pthread_mutex_unlock( &channel->tx_mutex );
+
+		cmd->result = false;
+		return NULL;
+	}
+
+	if ( channel->tx_queue_tail ) {
+		channel->tx_queue_tail->next = cmd->item;
+	} else {
+		channel->tx_queue = cmd->item;
+	}
+	channel->tx_queue_tail = cmd->item;
+	channel->tx_queue_length++;
+
+	if ( !channel->tx_queue_sending ) rant_channel_send_queued( channel );
+
+	pthread_mutex_unlock( &channel->tx_mutex );
+
+	cmd->result = true;
+	return NULL;
 }
 
 
+#ifdef HAVE_ANT_SENDADVANCEDBURST
+static void *
+rant_channel_send_advanced_burst_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = ANT_SendAdvancedBurst_RTO( cmd->channel_num, cmd->data, cmd->packets,
+		cmd->packets_per_message, cmd->response_time );
+
+	return NULL;
+}
+#endif
+
 
 /*
  * call-seq:
@@ -122,7 +704,6 @@ rant_channel_init( VALUE self, VALUE channel_number, VALUE channel_type, VALUE n
 	VALUE extended_options )
 {
 	rant_channel_t *ptr = rant_get_channel( self );
-	VALUE registry = rb_iv_get( rant_cAntChannel, "@registry" );
 
 	ptr->channel_num = NUM2USHORT( channel_number );
 	MEMZERO( ptr->buffer, unsigned char, MESG_MAX_SIZE );
@@ -136,13 +717,38 @@ rant_channel_init( VALUE self, VALUE channel_number, VALUE channel_type, VALUE n
 	rb_iv_set( self, "@transmission_type", Qnil );
 	rb_iv_set( self, "@rf_frequency", Qnil );
 	rb_iv_set( self, "@agility_frequencies", Qnil );
+	rb_iv_set( self, "@native_sinks", Qnil );
 
-	rb_hash_aset( registry, channel_number, self );
+	rant_channel_register( ptr->channel_num, self );
+	atomic_store( &ptr->last_event_time, rant_channel_monotonic_ns() );
+
+	// Always take the channel's events, even without a callback, so the ones that
+	// close it are seen
+	rant_channel_watch_events( ptr );
 
 	return self;
 }
 
 
+/*
+ * call-seq:
+ *    Ant::Channel[ channel_num ]   -> channel or nil
+ *
+ * Return the channel that's assigned to +channel_num+ and hasn't been closed,
+ * if there is one.
+ *
+ */
+static VALUE
+rant_channel_s_aref( VALUE klass, VALUE channel_num )
+{
+	const int num = NUM2INT( channel_num );
+
+	if ( num < 0 || num > CHANNEL_NUMBER_MASK ) return Qnil;
+
+	return channel_table[ num ];
+}
+
+
 /*
  * call-seq:
  *    channel.channel_number   -> integer
@@ -173,25 +779,20 @@ rant_channel_set_channel_id( int argc, VALUE *argv, VALUE self )
 {
 	rant_channel_t *ptr = rant_get_channel( self );
 	VALUE device_number, device_type, transmission_type, timeout;
-	unsigned short usDeviceNumber;
-	unsigned char ucDeviceType,
-		ucTransmissionType;
-	unsigned int ulResponseTime = 0;
-	bool result;
+	rant_channel_command_t cmd = { .channel_num = ptr->channel_num };
 
 	rb_scan_args( argc, argv, "31", &device_number, &device_type, &transmission_type, &timeout );
 
-	usDeviceNumber = NUM2USHORT( device_number );
-	ucDeviceType = NUM2CHR( device_type );
-	ucTransmissionType = NUM2CHR( transmission_type );
+	cmd.device_number = NUM2USHORT( device_number );
+	cmd.device_type = NUM2CHR( device_type );
+	cmd.transmission_type = NUM2CHR( transmission_type );
 
 	if ( RTEST(timeout) )
-		ulResponseTime = NUM2UINT( timeout );
+		cmd.response_time = NUM2UINT( timeout );
 
-	result = ANT_SetChannelId_RTO( ptr->channel_num, usDeviceNumber, ucDeviceType,
-		ucTransmissionType, ulResponseTime );
+	rant_blocking_call( rant_channel_set_channel_id_command, &cmd );
 
-	if ( !result ) {
+	if ( !cmd.result ) {
 		rb_raise( rb_eRuntimeError, "Failed to set the channel id." );
 	}
 
@@ -223,19 +824,17 @@ rant_channel_set_channel_period( int argc, VALUE *argv, VALUE self )
 {
 	rant_channel_t *ptr = rant_get_channel( self );
 	VALUE period, timeout;
-	unsigned int ulResponseTime = 0;
-	unsigned short usMesgPeriod;
-	bool result;
+	rant_channel_command_t cmd = { .channel_num = ptr->channel_num };
 
 	rb_scan_args( argc, argv, "11", &period, &timeout );
 
-	usMesgPeriod = NUM2USHORT( period );
+	cmd.period = NUM2USHORT( period );
 	if ( RTEST(timeout) )
-		ulResponseTime = NUM2UINT( timeout );
+		cmd.response_time = NUM2UINT( timeout );
 
-	result = ANT_SetChannelPeriod_RTO( ptr->channel_num, usMesgPeriod, ulResponseTime );
+	rant_blocking_call( rant_channel_set_channel_period_command, &cmd );
 
-	if ( !result )
+	if ( !cmd.result )
 		rb_raise( rb_eRuntimeError, "Failed to set the channel period." );
 
 	return Qtrue;
@@ -259,19 +858,17 @@ rant_channel_set_channel_search_timeout( int argc, VALUE *argv, VALUE self )
 {
 	rant_channel_t *ptr = rant_get_channel( self );
 	VALUE search_timeout, timeout;
-	unsigned int ulResponseTime = 0;
-	unsigned char ucSearchTimeout;
-	bool result;
+	rant_channel_command_t cmd = { .channel_num = ptr->channel_num };
 
 	rb_scan_args( argc, argv, "11", &search_timeout, &timeout );
 
-	ucSearchTimeout = NUM2CHR( search_timeout );
+	cmd.search_timeout = NUM2CHR( search_timeout );
 	if ( RTEST(timeout) )
-		ulResponseTime = NUM2UINT( timeout );
+		cmd.response_time = NUM2UINT( timeout );
 
-	result = ANT_SetChannelSearchTimeout_RTO( ptr->channel_num, ucSearchTimeout, ulResponseTime );
+	rant_blocking_call( rant_channel_set_channel_search_timeout_command, &cmd );
 
-	if ( !result )
+	if ( !cmd.result )
 		rb_raise( rb_eRuntimeError, "Failed to set the channel search timeout." );
 
 	return Qtrue;
@@ -290,12 +887,15 @@ rant_channel_set_channel_rf_freq( VALUE self, VALUE frequency )
 {
 	rant_channel_t *ptr = rant_get_channel( self );
 	unsigned short ucRFFreq = NUM2USHORT( frequency );
+	rant_channel_command_t cmd = { 0 };
 
 	if ( ucRFFreq > 124 ) {
 		rb_raise( rb_eArgError, "frequency must be between 0 and 124." );
 	}
 
-	ANT_SetChannelRFFreq( ptr->channel_num, ucRFFreq );
+	cmd.channel_num = ptr->channel_num;
+	cmd.frequencies[0] = (unsigned char)ucRFFreq;
+	rant_blocking_call( rant_channel_set_channel_rf_freq_command, &cmd );
 
 	rb_iv_set( self, "@rf_frequency", frequency );
 
@@ -319,6 +919,7 @@ rant_channel_set_frequency_agility( VALUE self, VALUE freq1, VALUE freq2, VALUE
 		ucFreq2 = NUM2CHR( freq2 ),
 		ucFreq3 = NUM2CHR( freq3 );
 	VALUE frequencies = rb_ary_new_from_args( 3, freq1, freq2, freq3 );
+	rant_channel_command_t cmd = { 0 };
 
 	if ( ucFreq1 > 124 || ucFreq2 > 124 || ucFreq3 > 124 ) {
 		rb_raise( rb_eArgError, "frequencies must be between 0 and 124." );
@@ -327,7 +928,11 @@ rant_channel_set_frequency_agility( VALUE self, VALUE freq1, VALUE freq2, VALUE
 	rant_log_obj( self, "info",
 		"Configuring channel %d to use frequency agility on %d, %d, and %d MHz.",
 		ptr->channel_num, ucFreq1 + 2400, ucFreq2 + 2400, ucFreq3 + 2400 );
-	ANT_ConfigFrequencyAgility( ptr->channel_num, ucFreq1, ucFreq2, ucFreq3 );
+	cmd.channel_num = ptr->channel_num;
+	cmd.frequencies[0] = ucFreq1;
+	cmd.frequencies[1] = ucFreq2;
+	cmd.frequencies[2] = ucFreq3;
+	rant_blocking_call( rant_channel_config_frequency_agility_command, &cmd );
 
 	rb_ary_freeze( frequencies );
 	rb_iv_set( self, "@agility_frequencies", frequencies );
@@ -349,16 +954,19 @@ rant_channel_open( int argc, VALUE *argv, VALUE self )
 {
 	rant_channel_t *ptr = rant_get_channel( self );
 	VALUE timeout;
-	unsigned int ulResponseTime = 0;
+	rant_channel_command_t cmd = { .channel_num = ptr->channel_num };
 
 	rb_scan_args( argc, argv, "01", &timeout );
 
 	if ( RTEST(timeout) )
-		ulResponseTime = NUM2UINT( timeout );
+		cmd.response_time = NUM2UINT( timeout );
 
-	if ( !ANT_OpenChannel_RTO( ptr->channel_num, ulResponseTime ) ) {
+	rant_blocking_call( rant_channel_open_command, &cmd );
+
+	if ( !cmd.result ) {
 		rb_raise( rb_eRuntimeError, "Failed to open the channel." );
 	}
+	atomic_store( &ptr->closed_by_device, false );
 
 	return Qtrue;
 }
@@ -376,21 +984,26 @@ rant_channel_close( int argc, VALUE *argv, VALUE self )
 {
 	rant_channel_t *ptr = rant_get_channel( self );
 	VALUE timeout;
-	VALUE registry = rb_iv_get( rant_cAntChannel, "@registry" );
-	unsigned int ulResponseTime = 0;
+	rant_channel_command_t cmd = { .channel_num = ptr->channel_num };
 
 	rb_scan_args( argc, argv, "01", &timeout );
 
 	if ( RTEST(timeout) )
-		ulResponseTime = NUM2UINT( timeout );
+		cmd.response_time = NUM2UINT( timeout );
 
-	rant_log_obj( self, "info", "Closing channel %d (with timeout %d).", ptr->channel_num, ulResponseTime );
-	if ( !ANT_CloseChannel_RTO( ptr->channel_num, ulResponseTime ) ) {
+	rant_log_obj( self, "info", "Closing channel %d (with timeout %d).", ptr->channel_num,
+		cmd.response_time );
+	rant_blocking_call( rant_channel_close_command, &cmd );
+
+	if ( !cmd.result ) {
 		rb_raise( rb_eRuntimeError, "Failed to close the channel." );
 	}
 	rant_log_obj( self, "info", "Channel %d closed.", ptr->channel_num );
 
-	rb_hash_delete( registry, INT2FIX( ptr->channel_num ) );
+	if ( channel_table[ptr->channel_num & CHANNEL_NUMBER_MASK] == self ) {
+		rant_channel_register( ptr->channel_num, Qnil );
+		closing_channel_table[ ptr->channel_num & CHANNEL_NUMBER_MASK ] = self;
+	}
 
 	return Qtrue;
 }
@@ -408,186 +1021,1942 @@ static VALUE
 rant_channel_closed_p( VALUE self )
 {
 	rant_channel_t *ptr = rant_get_channel( self );
-	VALUE registry = rb_iv_get( rant_cAntChannel, "@registry" );
-	VALUE channel = rb_hash_lookup( registry, INT2FIX( ptr->channel_num ) );
 
-	return self == channel ? Qfalse : Qtrue;
+	return channel_table[ ptr->channel_num & CHANNEL_NUMBER_MASK ] == self ? Qfalse : Qtrue;
 }
 
 
 /*
- * Event callback functions
+ * call-seq:
+ *    channel.unassign( timeout=nil )
+ *
+ * Unassign the closed channel from the device, which frees its number to be
+ * assigned to another channel. The channel can't be used after this.
+ *
  */
+static VALUE
+rant_channel_unassign( int argc, VALUE *argv, VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	VALUE timeout;
+	rant_channel_command_t cmd = { .channel_num = ptr->channel_num };
 
-struct on_event_call {
-	unsigned char ucANTChannel;
-	unsigned char ucEvent;
-};
+	rb_scan_args( argc, argv, "01", &timeout );
 
+	if ( ptr->unassigned ) return Qtrue;
+	if ( RTEST(timeout) )
+		cmd.response_time = NUM2UINT( timeout );
 
-/*
- * Handle the event callback -- Ruby side.
- */
-static VALUE
+	rant_blocking_call( rant_channel_unassign_command, &cmd );
+
+	if ( !cmd.result ) {
+		rb_raise( rb_eRuntimeError, "Failed to unassign the channel." );
+	}
+	rant_log_obj( self, "info", "Channel %d unassigned.", ptr->channel_num );
+
+	ptr->unassigned = true;
+	rant_channel_unwatch_events( ptr );
+	if ( channel_table[ptr->channel_num & CHANNEL_NUMBER_MASK] == self )
+		rant_channel_register( ptr->channel_num, Qnil );
+	rant_channel_forget_closed( ptr->channel_num, self );
+
+	return Qtrue;
+}
+
+
+/*
+ * call-seq:
+ *    channel.last_event_at   -> float
+ *
+ * Return the monotonic time (as returned by
+ * <tt>Process.clock_gettime(Process::CLOCK_MONOTONIC)</tt>) of the last event
+ * on the channel, or of when it was assigned if it hasn't had any yet.
+ *
+ */
+static VALUE
+rant_channel_last_event_at( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	const unsigned long long time = atomic_load( &ptr->last_event_time );
+
+	return DBL2NUM( (double)time / 1e9 );
+}
+
+
+/*
+ * call-seq:
+ *    channel.closed_by_device?   -> true or false
+ *
+ * Returns +true+ if the device has closed the channel (e.g., a slave channel's
+ * search timing out, or after #close) since it was last opened, whether or not
+ * it has a callback.
+ *
+ */
+static VALUE
+rant_channel_closed_by_device_p( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+
+	return atomic_load( &ptr->closed_by_device ) ? Qtrue : Qfalse;
+}
+
+
+/*
+ * Event callback functions
+ */
+
+/*
+ * Return the data for the event +call+ on the channel +ptr+ as a String. If
+ * the channel reuses its event buffers, this is the buffer for the data's
+ * length, overwritten in place. The buffer's length and encoding are put back
+ * in case a handler changed them, and its cached coderange is cleared so the
+ * new bytes are scanned again.
+ */
+static VALUE
+rant_channel_event_data( rant_channel_t *ptr, rant_callback_t *call )
+{
+	VALUE buffer;
+
+	if ( NIL_P(ptr->event_buffers) || call->length > MAX_REUSED_EVENT_BUFFER_SIZE )
+		return rb_enc_str_new( (char *)call->data, call->length, rb_ascii8bit_encoding() );
+
+	buffer = rb_ary_entry( ptr->event_buffers, call->length );
+	if ( NIL_P(buffer) || OBJ_FROZEN(buffer) ) {
+		buffer = rb_enc_str_new( NULL, call->length, rb_ascii8bit_encoding() );
+		rb_ary_store( ptr->event_buffers, call->length, buffer );
+	}
+
+	rb_str_modify( buffer );
+	rb_str_resize( buffer, call->length );
+	rb_enc_associate( buffer, rb_ascii8bit_encoding() );
+	MEMCPY( RSTRING_PTR(buffer), call->data, unsigned char, call->length );
+	ENC_CODERANGE_CLEAR( buffer );
+
+	return buffer;
+}
+
+
+/*
+ * Return the Ruby arguments for the event +call+ on the channel +ptr+.
+ */
+static VALUE
+rant_channel_event_args( rant_channel_t *ptr, rant_callback_t *call )
+{
+	VALUE args;
+
+	if ( ptr->event_objects ) {
+		args = rb_ary_new_from_args( 1, rant_event_new(call) );
+	} else {
+		args = rb_ary_new_from_args( 3,
+			INT2FIX(call->channel),
+			INT2FIX(call->id),
+			rant_channel_event_data(ptr, call) );
+	}
+
+	rant_push_timestamps( args, call );
+
+	return args;
+}
+
+
+/*
+ * Return the channel object that's registered for the given +channel_num+.
+ * Events that arrive after a channel is closed (e.g., its EVENT_CHANNEL_CLOSED)
+ * still go to it if it hasn't been replaced, and if there's no channel for them
+ * at all this returns +nil+. Callers should RB_GC_GUARD the channel for as long
+ * as they're using its struct, since dispatching the events can unregister it.
+ */
+static VALUE
+rant_channel_for_event( unsigned char channel_num )
+{
+	VALUE channel = channel_table[ channel_num & CHANNEL_NUMBER_MASK ];
+
+	if ( NIL_P(channel) ) channel = closing_channel_table[ channel_num & CHANNEL_NUMBER_MASK ];
+
+	return channel;
+}
+
+
+/*
+ * Handle the event callback -- Ruby side.
+ */
+static VALUE
 rant_channel_call_event_callback( VALUE callPtr )
 {
-	struct on_event_call *call = (struct on_event_call *)callPtr;
-	VALUE registry = rb_iv_get( rant_cAntChannel, "@registry" );
-	VALUE channel = rb_hash_fetch( registry, INT2FIX(call->ucANTChannel) );
-	rant_channel_t *ptr = rant_get_channel( channel );
-	VALUE rb_callback = ptr->callback;
+	rant_callback_t *call = (rant_callback_t *)callPtr;
+	VALUE channel = rant_channel_for_event( call->channel );
+	rant_channel_t *ptr = NIL_P( channel ) ? NULL : DATA_PTR( channel );
+	VALUE rb_callback = ptr ? ptr->callback : Qnil;
+	VALUE rval = Qnil;
+
+	if ( RTEST(rb_callback) ) {
+		VALUE args = rant_channel_event_args( ptr, call );
+		rval = rb_funcallv_public( rb_callback, rb_intern("call"),
+			RARRAY_LENINT(args), RARRAY_CONST_PTR(args) );
+		RB_GC_GUARD( args );
+	}
+
+	if ( call->id == EVENT_CHANNEL_CLOSED ) rant_channel_forget_closed( call->channel, channel );
+	RB_GC_GUARD( channel );
+
+	return rval;
+}
+
+
+/*
+ * Handle a batch of event callbacks for a single channel -- Ruby side. The
+ * events are passed to the channel's batch callback as an Array of
+ * [ channel_num, event_id, data ] tuples (plus timestamps, if requested), at
+ * most +batch_size+ at a time.
+ */
+static VALUE
+rant_channel_call_event_batch_callback( VALUE batchPtr )
+{
+	rant_callback_batch_t *batch = (rant_callback_batch_t *)batchPtr;
+	VALUE channel = rant_channel_for_event( batch->callbacks[0].channel );
+	rant_channel_t *ptr = NIL_P( channel ) ? NULL : DATA_PTR( channel );
+	VALUE rb_callback = ptr ? ptr->batch_callback : Qnil;
 	VALUE rval = Qnil;
+	size_t i = 0, j;
+
+	// The batch callback was replaced since these were queued
+	if ( !RTEST(rb_callback) ) {
+		for ( i = 0; i < batch->count; i++ )
+			rval = rant_channel_call_event_callback( (VALUE)&batch->callbacks[i] );
+		return rval;
+	}
+
+	while ( i < batch->count ) {
+		const size_t remaining = batch->count - i;
+		const size_t count = remaining < ptr->batch_size ? remaining : ptr->batch_size;
+		VALUE events = rb_ary_new_capa( count );
+
+		for ( j = 0; j < count; j++ ) {
+			rb_ary_push( events, rant_channel_event_args(ptr, &batch->callbacks[i + j]) );
+		}
+
+		rval = rb_funcallv_public( rb_callback, rb_intern("call"), 1, &events );
+		i += count;
+	}
+
+	for ( i = 0; i < batch->count; i++ ) {
+		if ( batch->callbacks[i].id == EVENT_CHANNEL_CLOSED )
+			rant_channel_forget_closed( batch->callbacks[i].channel, channel );
+	}
+	RB_GC_GUARD( channel );
+
+	return rval;
+}
+
+
+/*
+ * Handle a reassembled burst transfer -- Ruby side.
+ */
+static VALUE
+rant_channel_call_burst_callback( VALUE callPtr )
+{
+	rant_callback_t *call = (rant_callback_t *)callPtr;
+	VALUE channel = rant_channel_for_event( call->channel );
+	rant_channel_t *ptr = NIL_P( channel ) ? NULL : DATA_PTR( channel );
+	VALUE rb_callback = ptr ? ptr->burst_callback : Qnil;
+	VALUE args[ 2 ];
+
+	if ( !RTEST(rb_callback) ) return Qnil;
+
+	args[0] = INT2FIX( call->channel );
+	args[1] = rb_enc_str_new( (char *)call->payload, call->payload_length, rb_ascii8bit_encoding() );
+
+	return rb_funcallv_public( rb_callback, rb_intern("call"), 2, args );
+}
+
+
+/*
+ * Add the +data+ (up to 8 bytes) to the end of the broadcast ring on the channel
+ * +ptr+. Returns +false+ if the ring is full.
+ */
+static bool
+rant_channel_push_broadcast( rant_channel_t *ptr, VALUE data )
+{
+	unsigned char *slot;
+	bool rval = false;
+
+	StringValue( data );
+	if ( RSTRING_LEN(data) > 8 ) {
+		rb_raise( rb_eArgError, "Data can't be longer than 8 bytes." );
+	}
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+	if ( ptr->broadcast_ring_length < ptr->broadcast_ring_size ) {
+		slot = ptr->broadcast_ring + ANT_STANDARD_DATA_PAYLOAD_SIZE *
+			( (ptr->broadcast_ring_head + ptr->broadcast_ring_length) % ptr->broadcast_ring_size );
+		MEMZERO( slot, unsigned char, ANT_STANDARD_DATA_PAYLOAD_SIZE );
+		MEMCPY( slot, RSTRING_PTR(data), char, RSTRING_LEN(data) );
+		ptr->broadcast_ring_length++;
+		rval = true;
+	}
+	pthread_mutex_unlock( &ptr->tx_mutex );
+
+	return rval;
+}
+
+
+/*
+ * Call the broadcast ring refill callback and add the payloads it returns to the
+ * ring -- Ruby side, run via rb_ensure().
+ */
+static VALUE
+rant_channel_refill_broadcast_ring( VALUE callPtr )
+{
+	rant_callback_t *call = (rant_callback_t *)callPtr;
+	VALUE channel = rant_channel_for_event( call->channel );
+	rant_channel_t *ptr = NIL_P( channel ) ? NULL : DATA_PTR( channel );
+	VALUE rb_callback = ptr ? ptr->broadcast_refill_callback : Qnil;
+	VALUE args[ 2 ], payloads;
+	unsigned int space;
+	long i;
+
+	if ( !RTEST(rb_callback) ) return Qnil;
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+	space = ptr->broadcast_ring_size - ptr->broadcast_ring_length;
+	pthread_mutex_unlock( &ptr->tx_mutex );
+
+	args[0] = INT2FIX( call->channel );
+	args[1] = UINT2NUM( space );
+	payloads = rb_funcallv_public( rb_callback, rb_intern("call"), 2, args );
+	if ( NIL_P(payloads) ) return Qnil;
+
+	payloads = rb_Array( payloads );
+	for ( i = 0; i < RARRAY_LEN(payloads); i++ ) {
+		if ( !rant_channel_push_broadcast(ptr, RARRAY_AREF(payloads, i)) ) break;
+	}
+	RB_GC_GUARD( payloads );
+	RB_GC_GUARD( channel );
+
+	return Qnil;
+}
+
+
+/*
+ * Allow the next low broadcast ring to call the refill callback again.
+ */
+static VALUE
+rant_channel_finish_refill( VALUE callPtr )
+{
+	rant_callback_t *call = (rant_callback_t *)callPtr;
+	VALUE channel = rant_channel_for_event( call->channel );
+	rant_channel_t *ptr = NIL_P( channel ) ? NULL : DATA_PTR( channel );
+
+	if ( ptr ) atomic_store( &ptr->broadcast_refill_pending, false );
+	return Qnil;
+}
+
+
+/*
+ * Handle a broadcast ring that's running low -- Ruby side.
+ */
+static VALUE
+rant_channel_call_refill_callback( VALUE callPtr )
+{
+	return rb_ensure( rant_channel_refill_broadcast_ring, callPtr,
+		rant_channel_finish_refill, callPtr );
+}
+
+
+/*
+ * Returns +true+ if the event +event_id+ is a packet of a burst transfer.
+ */
+static inline bool
+rant_channel_burst_packet_p( unsigned char event_id )
+{
+	return event_id == EVENT_RX_BURST_PACKET ||
+		event_id == EVENT_RX_EXT_BURST_PACKET ||
+		event_id == EVENT_RX_RSSI_BURST_PACKET ||
+		event_id == EVENT_RX_FLAG_BURST_PACKET;
+}
+
+
+/*
+ * Throw away the burst transfer being reassembled on the channel +ptr+, if
+ * there is one.
+ */
+static void
+rant_channel_fail_burst( rant_channel_t *ptr )
+{
+	if ( !ptr->burst_in_progress ) return;
+
+	ptr->burst_in_progress = false;
+	ptr->burst_length = 0;
+	atomic_fetch_add( &ptr->failed_bursts, 1 );
+}
+
+
+/*
+ * Add the burst packet in the channel's buffer to the transfer being
+ * reassembled, and once its last packet arrives, set up the +callback+ to pass
+ * the whole transfer (as its payload) to the burst callback and return +true+.
+ * Packets that are out of sequence fail the transfer.
+ */
+static bool
+rant_channel_add_burst_packet( rant_channel_t *ptr, rant_callback_t *callback )
+{
+	const unsigned char sequence = ptr->buffer[0] & SEQUENCE_NUMBER_ROLLOVER;
+	const bool last = ( ptr->buffer[0] & SEQUENCE_LAST_MESSAGE ) != 0;
+
+	if ( sequence == SEQUENCE_FIRST_MESSAGE ) {
+		rant_channel_fail_burst( ptr );
+		ptr->burst_in_progress = true;
+		ptr->burst_length = 0;
+	} else if ( !ptr->burst_in_progress || sequence != ptr->burst_sequence ) {
+		rant_channel_fail_burst( ptr );
+		return false;
+	}
+
+	// This runs without the GVL, so it can't use Ruby's allocator
+	if ( ptr->burst_length + ANT_STANDARD_DATA_PAYLOAD_SIZE > ptr->burst_capacity ) {
+		const size_t capacity = ptr->burst_capacity ? ptr->burst_capacity * 2 : 64;
+		unsigned char *buffer = realloc( ptr->burst_buffer, capacity );
+
+		if ( !buffer ) {
+			rant_channel_fail_burst( ptr );
+			return false;
+		}
+		ptr->burst_buffer = buffer;
+		ptr->burst_capacity = capacity;
+	}
+
+	memcpy( ptr->burst_buffer + ptr->burst_length, ptr->buffer + MESG_CHANNEL_NUM_SIZE,
+		ANT_STANDARD_DATA_PAYLOAD_SIZE );
+	ptr->burst_length += ANT_STANDARD_DATA_PAYLOAD_SIZE;
+	ptr->burst_sequence = ( sequence == SEQUENCE_NUMBER_ROLLOVER ) ?
+		SEQUENCE_NUMBER_INC : sequence + SEQUENCE_NUMBER_INC;
+
+	if ( !last ) return false;
+
+	// Hand the buffer off with the callback; the next transfer gets a new one
+	callback->fn = rant_channel_call_burst_callback;
+	callback->batch_fn = NULL;
+	callback->channel = ptr->channel_num;
+	callback->id = EVENT_RX_BURST_PACKET;
+	callback->priority = false;
+	callback->length = 0;
+	callback->payload = ptr->burst_buffer;
+	callback->payload_length = ptr->burst_length;
+
+	ptr->burst_buffer = NULL;
+	ptr->burst_capacity = 0;
+	ptr->burst_length = 0;
+	ptr->burst_in_progress = false;
+
+	return true;
+}
+
+
+/*
+ * Resolve the oldest of the pending futures on the channel +ptr+ that the event
+ * +event_id+ finishes, or all of them if the channel closed. An EVENT_TX
+ * finishes every pending broadcast, but since each one replaces the data of the
+ * one before it, only the newest actually went out and the rest fail. Must be
+ * called with the channel's tx_mutex held.
+ */
+static void
+rant_channel_resolve_futures( rant_channel_t *ptr, unsigned char event_id )
+{
+	const unsigned char kind = ( event_id == EVENT_TX ) ? EVENT_TX : EVENT_TRANSFER_TX_COMPLETED;
+	rant_future_t *future, *prev = NULL, *next, *newest = NULL;
+
+	if ( event_id == EVENT_TX ) {
+		for ( future = ptr->pending_futures; future; future = future->next ) {
+			if ( future->kind == EVENT_TX ) newest = future;
+		}
+	}
+
+	future = ptr->pending_futures;
+	while ( future ) {
+		next = future->next;
+
+		if ( event_id != EVENT_CHANNEL_CLOSED && future->kind != kind ) {
+			prev = future;
+			future = next;
+			continue;
+		}
+
+		if ( prev ) {
+			prev->next = next;
+		} else {
+			ptr->pending_futures = next;
+		}
+		if ( ptr->last_pending_future == future ) ptr->last_pending_future = prev;
+
+		if ( event_id == EVENT_TX && future != newest ) {
+			rant_future_resolve( future, EVENT_TRANSFER_TX_FAILED );
+		} else {
+			rant_future_resolve( future, event_id );
+		}
+		rant_future_release( future );
+
+		if ( event_id != EVENT_CHANNEL_CLOSED && event_id != EVENT_TX ) return;
+		future = next;
+	}
+}
+
+
+/*
+ * Add the +future+ to the end of the pending futures on the channel +ptr+.
+ */
+static void
+rant_channel_add_future( rant_channel_t *ptr, rant_future_t *future )
+{
+	rant_future_retain( future );
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+	future->next = NULL;
+	if ( ptr->last_pending_future ) {
+		ptr->last_pending_future->next = future;
+	} else {
+		ptr->pending_futures = future;
+	}
+	ptr->last_pending_future = future;
+	pthread_mutex_unlock( &ptr->tx_mutex );
+}
+
+
+/*
+ * Take the +future+ back out of the pending futures on the channel +ptr+ and
+ * resolve it with the event +event_id+, if it hasn't been resolved already.
+ */
+static void
+rant_channel_cancel_future( rant_channel_t *ptr, rant_future_t *future, unsigned char event_id )
+{
+	rant_future_t *current, *prev = NULL;
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+	for ( current = ptr->pending_futures; current; prev = current, current = current->next ) {
+		if ( current != future ) continue;
+
+		if ( prev ) {
+			prev->next = current->next;
+		} else {
+			ptr->pending_futures = current->next;
+		}
+		if ( ptr->last_pending_future == current ) ptr->last_pending_future = prev;
+
+		rant_future_resolve( future, event_id );
+		rant_future_release( future );
+		break;
+	}
+	pthread_mutex_unlock( &ptr->tx_mutex );
+}
+
+
+/*
+ * Take the item at the head of the transmit queue on the channel +ptr+ off of
+ * it, and resolve its future with the event +event_id+. Must be called with the
+ * channel's tx_mutex held.
+ */
+static void
+rant_channel_finish_queued( rant_channel_t *ptr, unsigned char event_id )
+{
+	rant_tx_item_t *item = ptr->tx_queue;
+
+	ptr->tx_queue = item->next;
+	if ( !ptr->tx_queue ) ptr->tx_queue_tail = NULL;
+	ptr->tx_queue_length--;
+
+	rant_future_resolve( item->future, event_id );
+	rant_future_release( item->future );
+	free( item );
+}
+
+
+/*
+ * Send the item at the head of the transmit queue on the channel +ptr+, if
+ * there is one. Items that can't even be written to the device fail right
+ * away. Runs from the ANT library's receive thread when the previous item is
+ * done, or without the GVL from the thread that queued the item if the queue
+ * was idle. Must be called with the channel's tx_mutex held.
+ */
+static void
+rant_channel_send_queued( rant_channel_t *ptr )
+{
+	rant_tx_item_t *item;
+
+	ptr->tx_queue_blocked = false;
+
+	while ( (item = ptr->tx_queue) ) {
+		atomic_fetch_add( &item->future->attempts, 1 );
+		if ( ANT_SendAcknowledgedData(ptr->channel_num, item->data) ) {
+			ptr->tx_queue_sending = true;
+			return;
+		}
+
+		rant_channel_finish_queued( ptr, EVENT_TRANSFER_TX_FAILED );
+	}
+
+	ptr->tx_queue_sending = false;
+}
+
+
+/*
+ * Fail every item in the transmit queue on the channel +ptr+ with the event
+ * +event_id+. Must be called with the channel's tx_mutex held.
+ */
+static void
+rant_channel_clear_tx_queue( rant_channel_t *ptr, unsigned char event_id )
+{
+	while ( ptr->tx_queue ) rant_channel_finish_queued( ptr, event_id );
+
+	ptr->tx_queue_sending = false;
+	ptr->tx_queue_blocked = false;
+}
+
+
+/*
+ * Handle the end of a transfer on the channel +ptr+ while its transmit queue is
+ * sending: finish or retry the item that was being sent, and send the next one.
+ * If the device turned down the last send because another transfer was in
+ * progress, this is the end of that one, so the item is just sent again.
+ * Returns +false+ if the queue wasn't sending. Must be called with the
+ * channel's tx_mutex held.
+ */
+static bool
+rant_channel_queued_transfer_ended( rant_channel_t *ptr, unsigned char event_id )
+{
+	rant_tx_item_t *item = ptr->tx_queue;
+
+	if ( !ptr->tx_queue_sending || !item ) return false;
+
+	if ( ptr->tx_queue_blocked ) {
+		// Already retried when it was turned down
+	} else if ( event_id == EVENT_TRANSFER_TX_FAILED && item->retries ) {
+		item->retries--;
+		atomic_fetch_add( &ptr->tx_queue_retried, 1 );
+	} else {
+		rant_channel_finish_queued( ptr, event_id );
+	}
+
+	rant_channel_send_queued( ptr );
+
+	return true;
+}
+
+
+/*
+ * Handle a response event from the device for the channel +channel_num+ about
+ * the message +message_id+ -- called from the ANT library's receive thread. If
+ * it turned down the acknowledged data the transmit queue is sending because
+ * another transfer is in progress, the item is sent again once that transfer
+ * ends (if it has any retries left).
+ */
+void
+rant_channel_on_response_event( unsigned char channel_num, unsigned char message_id,
+	unsigned char code )
+{
+	rant_channel_t *ptr;
+	rant_tx_item_t *item;
+
+	if ( message_id != MESG_ACKNOWLEDGED_DATA_ID ) return;
+	if ( code != TRANSFER_IN_PROGRESS && code != TRANSFER_BUSY ) return;
+	if ( !(ptr = rant_channel_hold(channel_num)) ) return;
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+
+	if ( (item = ptr->tx_queue) && ptr->tx_queue_sending && !ptr->tx_queue_blocked ) {
+		if ( item->retries ) {
+			item->retries--;
+			atomic_fetch_add( &ptr->tx_queue_retried, 1 );
+			ptr->tx_queue_blocked = true;
+		} else {
+			rant_channel_finish_queued( ptr, EVENT_TRANSFER_TX_FAILED );
+			rant_channel_send_queued( ptr );
+		}
+	}
+
+	pthread_mutex_unlock( &ptr->tx_mutex );
+	rant_channel_let_go( ptr );
+}
+
+
+/*
+ * Send the next payload in the broadcast ring on the channel +ptr+, if it has
+ * one -- called from the ANT library's receive thread on each EVENT_TX, so the
+ * next message period's data is loaded without going through Ruby. A payload
+ * that can't be written to the device is tried again on the next EVENT_TX.
+ * Returns +true+ if the ring has run low enough that it should be refilled.
+ */
+static bool
+rant_channel_send_from_ring( rant_channel_t *ptr )
+{
+	bool refill = false;
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+
+	if ( ptr->broadcast_ring_size ) {
+		if ( ptr->broadcast_ring_length ) {
+			unsigned char *data = ptr->broadcast_ring +
+				ptr->broadcast_ring_head * ANT_STANDARD_DATA_PAYLOAD_SIZE;
+
+			if ( ANT_SendBroadcastData(ptr->channel_num, data) ) {
+				ptr->broadcast_ring_head = ( ptr->broadcast_ring_head + 1 ) % ptr->broadcast_ring_size;
+				ptr->broadcast_ring_length--;
+				atomic_fetch_add( &ptr->broadcast_ring_sent, 1 );
+			}
+		} else {
+			atomic_fetch_add( &ptr->broadcast_ring_underruns, 1 );
+		}
+
+		refill = ptr->broadcast_ring_length <= ptr->broadcast_ring_low_water;
+	}
+
+	pthread_mutex_unlock( &ptr->tx_mutex );
+
+	return refill;
+}
+
+
+/*
+ * Set up the +callback+ to call the broadcast ring refill callback of the
+ * channel +ptr+ and return +true+, if it has one and a call isn't already
+ * waiting to be handled.
+ */
+static bool
+rant_channel_request_refill( rant_channel_t *ptr, rant_callback_t *callback )
+{
+	if ( !RTEST(ptr->broadcast_refill_callback) ) return false;
+	if ( atomic_exchange(&ptr->broadcast_refill_pending, true) ) return false;
+
+	rant_capture_timestamps( callback, 0 );
+	callback->fn = rant_channel_call_refill_callback;
+	callback->batch_fn = NULL;
+	callback->channel = ptr->channel_num;
+	callback->id = EVENT_TX;
+	callback->priority = false;
+	callback->length = 0;
+	callback->payload = NULL;
+
+	return true;
+}
+
+
+/*
+ * Let the channel on +channel_num+ ask for a refill again after a request for
+ * one couldn't be queued.
+ */
+static void
+rant_channel_refill_not_queued( unsigned char channel_num )
+{
+	rant_channel_t *ptr = rant_channel_hold( channel_num );
+
+	if ( !ptr ) return;
+	atomic_store( &ptr->broadcast_refill_pending, false );
+	rant_channel_let_go( ptr );
+}
+
+
+/*
+ * Update the state of the burst being streamed out, the transmit queue, and the
+ * pending futures on the channel +ptr+ for the event +event_id+, and wake up
+ * anything that's waiting for it.
+ */
+static void
+rant_channel_update_transfer( rant_channel_t *ptr, unsigned char event_id )
+{
+	switch ( event_id ) {
+		case EVENT_TX:
+		case EVENT_TRANSFER_TX_START:
+		case EVENT_TRANSFER_TX_NEXT_MESSAGE:
+		case EVENT_TRANSFER_TX_COMPLETED:
+		case EVENT_TRANSFER_TX_FAILED:
+		case EVENT_CHANNEL_CLOSED:
+			break;
+		default:
+			return;
+	}
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+
+	if ( event_id == EVENT_TRANSFER_TX_START ) {
+		ptr->tx_started = true;
+	} else if ( event_id == EVENT_TRANSFER_TX_NEXT_MESSAGE ) {
+		ptr->tx_paced = true;
+		ptr->tx_credits++;
+	} else if ( event_id == EVENT_TX ) {
+		rant_channel_resolve_futures( ptr, event_id );
+	} else if ( event_id == EVENT_CHANNEL_CLOSED ) {
+		ptr->tx_result = event_id;
+		rant_channel_clear_tx_queue( ptr, event_id );
+		rant_channel_resolve_futures( ptr, event_id );
+	} else {
+		ptr->tx_result = event_id;
+
+		// While the transmit queue is sending, the transfers are its own
+		if ( !rant_channel_queued_transfer_ended(ptr, event_id) ) {
+			rant_channel_resolve_futures( ptr, event_id );
+		}
+	}
+
+	pthread_cond_broadcast( &ptr->tx_cond );
+	pthread_mutex_unlock( &ptr->tx_mutex );
+}
+
+
+/*
+ * Handle the event callback -- C side. Runs in the ANT library's receive
+ * thread, so it copies the message out of the channel's buffer and then clears
+ * it for the next one. The channel is only held while it's being used here, and
+ * anything for Ruby is queued after it's let go of, since waiting for Ruby to
+ * handle it could otherwise keep the GC waiting to free the channel.
+ */
+static BOOL
+rant_channel_on_event_callback( unsigned char ucANTChannel, unsigned char ucEvent )
+{
+	rant_channel_t *ptr = rant_channel_hold( ucANTChannel );
+	rant_callback_t callback, refill;
+	bool queue_refill = false, queue_burst = false, queue_event = false;
+	unsigned int i, sink_count;
+	size_t length;
+
+	if ( !ptr ) return FALSE;
+
+	rant_capture_timestamps( &callback, ptr->timestamps );
+	atomic_store_explicit( &ptr->last_event_time, rant_channel_monotonic_ns(), memory_order_relaxed );
+
+	if ( ucEvent == EVENT_CHANNEL_CLOSED ) atomic_store( &ptr->closed_by_device, true );
+
+	length = rant_event_size( ucEvent, ptr->buffer );
+	if ( length > MESG_MAX_SIZE ) length = MESG_MAX_SIZE;
+
+	// Native sinks see every event first, straight from the receive thread
+	sink_count = atomic_load_explicit( &ptr->native_sink_count, memory_order_acquire );
+	for ( i = 0; i < sink_count; i++ ) {
+		rant_native_sink_t *sink = ptr->native_sinks[ i ];
+		sink->handler( ucANTChannel, ucEvent, ptr->buffer, length, sink->arg );
+	}
+
+	rant_channel_update_transfer( ptr, ucEvent );
+
+	// Master channels with a broadcast ring load their next page right away
+	if ( ucEvent == EVENT_TX && rant_channel_send_from_ring(ptr) ) {
+		queue_refill = rant_channel_request_refill( ptr, &refill );
+	}
+
+	// With a burst callback, burst packets are reassembled instead of being
+	// passed on one at a time
+	if ( RTEST(ptr->burst_callback) && rant_channel_burst_packet_p(ucEvent) ) {
+		queue_burst = rant_channel_add_burst_packet( ptr, &callback );
+	} else {
+		if ( RTEST(ptr->burst_callback) && ucEvent == EVENT_TRANSFER_RX_FAILED ) {
+			rant_channel_fail_burst( ptr );
+		}
+
+		if ( RTEST(ptr->callback) || RTEST(ptr->batch_callback) ) {
+			callback.fn = rant_channel_call_event_callback;
+			callback.batch_fn = RTEST( ptr->batch_callback ) ?
+				rant_channel_call_event_batch_callback : NULL;
+			callback.channel = ucANTChannel;
+			callback.id = ucEvent;
+			callback.priority = false;
+			callback.payload = NULL;
+			callback.length = (unsigned char)length;
+			MEMCPY( callback.data, ptr->buffer, unsigned char, length );
+			queue_event = true;
+		}
+	}
+
+	MEMZERO( ptr->buffer, unsigned char, MESG_MAX_SIZE );
+	rant_channel_let_go( ptr );
+
+	if ( queue_refill && !rant_callback(&refill) ) {
+		rant_channel_refill_not_queued( ucANTChannel );
+	}
+	if ( queue_burst ) rant_callback( &callback );
+	if ( queue_event ) return rant_callback( &callback );
+
+	return TRUE;
+}
+
+
+/*
+ * call-seq:
+ *    channel.dispatch_weight   -> integer
+ *
+ * Return the number of this channel's queued events that are dispatched each
+ * time it's the channel's turn, before moving on to the next channel.
+ *
+ */
+static VALUE
+rant_channel_dispatch_weight( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	return UINT2NUM( rant_callback_lane_weight(ptr->channel_num) );
+}
+
+
+/*
+ * call-seq:
+ *    channel.dispatch_weight = integer
+ *
+ * Set the number of this channel's queued events that are dispatched each
+ * time it's the channel's turn. Channels take turns, so giving a busy channel
+ * a higher weight gets its events through faster at the expense of the others.
+ *
+ */
+static VALUE
+rant_channel_dispatch_weight_eq( VALUE self, VALUE weight )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	const unsigned int new_weight = NUM2UINT( weight );
+
+	if ( new_weight < 1 || new_weight > MAX_CALLBACK_LANE_WEIGHT ) {
+		rb_raise( rb_eArgError, "expected a dispatch weight between 1 and %d, got %u",
+			MAX_CALLBACK_LANE_WEIGHT, new_weight );
+	}
+
+	rant_callback_set_lane_weight( ptr->channel_num, new_weight );
+
+	return weight;
+}
+
+
+/*
+ * call-seq:
+ *    channel.dropped_events   -> integer
+ *
+ * Return the number of events for this channel's number that have been dropped
+ * because its queue was full. See Ant.callback_overflow_policy=.
+ *
+ */
+static VALUE
+rant_channel_dropped_events( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	return ULL2NUM( rant_callback_lane_drops(ptr->channel_num) );
+}
+
+
+static void *
+rant_channel_receive_event_command( void *ptr )
+{
+	rant_channel_command_t *cmd = (rant_channel_command_t *)ptr;
+
+	cmd->result = rant_channel_on_event_callback( cmd->channel_num, cmd->event_id );
+
+	return NULL;
+}
+
+
+/*
+ * call-seq:
+ *    channel.receive_event( event_id, data )   -> true or false
+ *
+ * Handle an event for the channel as if it had just arrived from the ANT
+ * device, e.g., to replay recorded events or to try out handlers without a
+ * device. The +data+ is the event's message, starting with the channel
+ * number, and goes through the same native sinks, burst reassembly, transfer
+ * tracking, and callbacks as a real event's would. Returns +false+ if the
+ * event's callback was dropped, or (with synchronous callbacks) it returned
+ * a false value.
+ *
+ * The channel has to be the one assigned to its channel number, and shouldn't
+ * be getting events from a device at the same time.
+ *
+ */
+static VALUE
+rant_channel_receive_event( VALUE self, VALUE event_id, VALUE data )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	rant_channel_command_t cmd = { 0 };
+	bool watching;
+
+	StringValue( data );
+	if ( RSTRING_LEN(data) > MESG_MAX_SIZE ) {
+		rb_raise( rb_eArgError, "event data can't be longer than %d bytes", MESG_MAX_SIZE );
+	}
+
+	pthread_mutex_lock( &event_channels_mutex );
+	watching = ( event_channels[ptr->channel_num & CHANNEL_NUMBER_MASK] == ptr );
+	pthread_mutex_unlock( &event_channels_mutex );
+
+	if ( !watching ) {
+		rb_raise( rb_eRuntimeError, "channel %d isn't assigned", ptr->channel_num );
+	}
+
+	MEMZERO( ptr->buffer, unsigned char, MESG_MAX_SIZE );
+	MEMCPY( ptr->buffer, RSTRING_PTR(data), char, RSTRING_LEN(data) );
+
+	cmd.channel_num = ptr->channel_num;
+	cmd.event_id = NUM2CHR( event_id );
+	rb_thread_call_without_gvl( rant_channel_receive_event_command, &cmd, NULL, NULL );
+
+	return cmd.result ? Qtrue : Qfalse;
+}
+
+
+/*
+ * call-seq:
+ *    channel.add_native_sink( sink )
+ *
+ * Add the given Ant::NativeSink to the channel, so it's called for every
+ * event on the channel as soon as it arrives. Native sinks run in addition to
+ * any callback set with #on_event or #on_events, and before it's queued. A
+ * channel can have up to 8 of them, and they stay attached for the life of the
+ * channel.
+ *
+ */
+static VALUE
+rant_channel_add_native_sink( VALUE self, VALUE sink )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	rant_native_sink_t *sink_ptr = rant_get_native_sink( sink );
+	const unsigned int count = atomic_load( &ptr->native_sink_count );
+	VALUE sinks = rb_iv_get( self, "@native_sinks" );
+
+	if ( count >= MAX_NATIVE_SINKS ) {
+		rb_raise( rb_eRuntimeError, "a channel can't have more than %d native sinks",
+			MAX_NATIVE_SINKS );
+	}
+
+	// Keep a reference to the sink so it isn't collected while the receive
+	// thread could be using it.
+	if ( NIL_P(sinks) ) {
+		sinks = rb_ary_new();
+		rb_iv_set( self, "@native_sinks", sinks );
+	}
+	rb_ary_push( sinks, sink );
+
+	ptr->native_sinks[ count ] = sink_ptr;
+	atomic_store_explicit( &ptr->native_sink_count, count + 1, memory_order_release );
+
+	rant_log_obj( self, "debug", "Added native sink %s", RSTRING_PTR(rb_inspect(sink)) );
+	rant_channel_watch_events( ptr );
+
+	return self;
+}
+
+
+/*
+ * call-seq:
+ *    channel.native_sinks   -> array
+ *
+ * Return the Ant::NativeSinks that have been added to the channel.
+ *
+ */
+static VALUE
+rant_channel_native_sinks( VALUE self )
+{
+	VALUE sinks = rb_iv_get( self, "@native_sinks" );
+
+	if ( NIL_P(sinks) ) return rb_ary_new();
+	return rb_ary_dup( sinks );
+}
+
+
+/*
+ * call-seq:
+ *    channel.on_event( timestamps: false, realtime: false, reuse_buffer: false ) {|channel_num, event_id, data| ... }
+ *    channel.on_event( event_objects: true, **options ) {|event| ... }
+ *
+ * Set up a callback for events on the receiving channel. The +data+ is the
+ * message for the event, sized to its actual length.
+ *
+ * If +reuse_buffer+ is true, the +data+ is a String that the channel
+ * overwrites for each event instead of allocating a new one, so it's only
+ * valid until the callback returns; +dup+ it to keep it any longer. It isn't
+ * frozen, since its contents change from one event to the next, but changes
+ * a callback makes to it are thrown away.
+ *
+ * If +event_objects+ is true, the callback is passed an Ant::Event instead of
+ * the channel number, event ID, and data, which decodes the event's fields
+ * without any byte-twiddling in Ruby.
+ *
+ * If +timestamps+ is true, the callback is also passed the time the event
+ * arrived from the ANT library according to the monotonic clock, as a Float
+ * number of seconds comparable with
+ * <tt>Process.clock_gettime(Process::CLOCK_MONOTONIC)</tt>. If +realtime+ is
+ * true, it's passed the wall-clock time it arrived as a Time after that.
+ *
+ */
+static VALUE
+rant_channel_on_event( int argc, VALUE *argv, VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	VALUE opts = Qnil, callback = Qnil;
+	VALUE values[ 4 ] = { Qundef, Qundef, Qundef, Qundef };
+	ID keys[ 4 ];
+
+	rb_scan_args( argc, argv, "0:&", &opts, &callback );
+
+	if ( !RTEST(callback) ) {
+		rb_raise( rb_eLocalJumpError, "block required, but not given" );
+	}
+
+	if ( !NIL_P(opts) ) {
+		keys[0] = rb_intern( "timestamps" );
+		keys[1] = rb_intern( "realtime" );
+		keys[2] = rb_intern( "reuse_buffer" );
+		keys[3] = rb_intern( "event_objects" );
+		rb_get_kwargs( opts, keys, 0, 4, values );
+	}
+
+	rant_log_obj( self, "debug", "Channel event callback is: %s", RSTRING_PTR(rb_inspect(callback)) );
+	ptr->callback = callback;
+	ptr->batch_callback = Qnil;
+	ptr->timestamps = rant_timestamp_flags( values[0], values[1] );
+	ptr->event_buffers = ( values[2] != Qundef && RTEST(values[2]) ) ?
+		rb_ary_new_capa( MAX_REUSED_EVENT_BUFFER_SIZE + 1 ) : Qnil;
+	ptr->event_objects = ( values[3] != Qundef && RTEST(values[3]) );
+
+	rant_channel_watch_events( ptr );
+
+	return Qtrue;
+}
+
+
+/*
+ * call-seq:
+ *    channel.on_events( batch: 64, timestamps: false, realtime: false, event_objects: false ) {|events| ... }
+ *
+ * Set up a callback for events on the receiving channel that is called with
+ * an Array of <tt>[channel_num, event_id, data]</tt> tuples instead of once
+ * per event. Events that are queued together are delivered together, up to
+ * +batch+ at a time. Replaces any callback set with #on_event. The
+ * +timestamps+ and +realtime+ options add the same receive times to each
+ * tuple as they do for #on_event, and +event_objects+ replaces the channel
+ * number, event ID, and data in each with an Ant::Event.
+ *
+ */
+static VALUE
+rant_channel_on_events( int argc, VALUE *argv, VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	VALUE opts = Qnil, callback = Qnil;
+	VALUE values[ 4 ] = { Qundef, Qundef, Qundef, Qundef };
+	size_t batch_size = DEFAULT_CALLBACK_BATCH_SIZE;
+	ID keys[ 4 ];
+
+	rb_scan_args( argc, argv, "0:&", &opts, &callback );
+
+	if ( !RTEST(callback) ) {
+		rb_raise( rb_eLocalJumpError, "block required, but not given" );
+	}
+
+	if ( !NIL_P(opts) ) {
+		keys[0] = rb_intern( "batch" );
+		keys[1] = rb_intern( "timestamps" );
+		keys[2] = rb_intern( "realtime" );
+		keys[3] = rb_intern( "event_objects" );
+		rb_get_kwargs( opts, keys, 0, 4, values );
+	}
+	if ( values[0] != Qundef && !NIL_P(values[0]) ) {
+		batch_size = NUM2SIZET( values[0] );
+		if ( batch_size < 1 ) {
+			rb_raise( rb_eArgError, "batch size must be at least 1" );
+		}
+	}
+
+	rant_log_obj( self, "debug", "Channel batch event callback is: %s (batches of %zu)",
+		RSTRING_PTR(rb_inspect(callback)), batch_size );
+	ptr->batch_size = batch_size;
+	ptr->batch_callback = callback;
+	ptr->callback = Qnil;
+	ptr->timestamps = rant_timestamp_flags( values[1], values[2] );
+	ptr->event_buffers = Qnil;
+	ptr->event_objects = ( values[3] != Qundef && RTEST(values[3]) );
+
+	rant_channel_watch_events( ptr );
+
+	return Qtrue;
+}
+
+
+/*
+ * call-seq:
+ *    channel.on_burst {|channel_num, data| ... }
+ *
+ * Set up a callback for burst transfers received on the channel. The packets of
+ * each transfer are reassembled as they arrive, and the callback is called
+ * once with all of its data when the last one does. Transfers with missing
+ * packets, or that fail with an EVENT_TRANSFER_RX_FAILED, are discarded and
+ * counted in #failed_bursts. While a burst callback is set, burst packets
+ * aren't passed to the #on_event callback.
+ *
+ */
+static VALUE
+rant_channel_on_burst( int argc, VALUE *argv, VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	VALUE callback = Qnil;
+
+	rb_scan_args( argc, argv, "0&", &callback );
+
+	if ( !RTEST(callback) ) {
+		rb_raise( rb_eLocalJumpError, "block required, but not given" );
+	}
+
+	rant_log_obj( self, "debug", "Channel burst callback is: %s", RSTRING_PTR(rb_inspect(callback)) );
+	ptr->burst_callback = callback;
+
+	rant_channel_watch_events( ptr );
+
+	return Qtrue;
+}
+
+
+/*
+ * call-seq:
+ *    channel.failed_bursts   -> integer
+ *
+ * Return the number of burst transfers received on the channel that were
+ * discarded because they failed or were missing packets.
+ *
+ */
+static VALUE
+rant_channel_failed_bursts( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	return ULL2NUM( atomic_load(&ptr->failed_bursts) );
+}
+
+
+/*
+ * Return the bytes of +data+ as a String that's safe to read without the GVL,
+ * padded with zeroes to a whole number of burst packets, and set +packets+ to
+ * how many there are. If the data is already a whole number of packets, its
+ * bytes are shared instead of copied.
+ */
+static VALUE
+rant_channel_burst_data( VALUE data, unsigned short *packets )
+{
+	const long data_len = RSTRING_LEN( StringValue(data) );
+	const long remainder = data_len % ANT_STANDARD_DATA_PAYLOAD_SIZE;
+	const long packet_count = data_len / ANT_STANDARD_DATA_PAYLOAD_SIZE + ( remainder ? 1 : 0 );
+	VALUE buffer;
+
+	if ( packet_count == 0 || packet_count > USHRT_MAX ) {
+		rb_raise( rb_eArgError, "expected between 1 and %d bytes of burst data, got %ld",
+			USHRT_MAX * ANT_STANDARD_DATA_PAYLOAD_SIZE, data_len );
+	}
+	*packets = (unsigned short)packet_count;
+
+	// A frozen copy shares the string's bytes, and keeps them from changing
+	// out from under the send if another thread modifies the original
+	if ( !remainder ) return rb_str_new_frozen( data );
+
+	// Otherwise only the final packet needs padding
+	buffer = rb_str_new( NULL, packet_count * ANT_STANDARD_DATA_PAYLOAD_SIZE );
+	MEMCPY( RSTRING_PTR(buffer), RSTRING_PTR(data), char, data_len );
+	MEMZERO( RSTRING_PTR(buffer) + data_len, char, ANT_STANDARD_DATA_PAYLOAD_SIZE - remainder );
+
+	return buffer;
+}
+
+
+/*
+ * Log the burst +data+ that's about to be sent as a hexdump, if the logger
+ * will show it.
+ */
+static void
+rant_channel_log_burst_data( VALUE self, const char *description, VALUE data )
+{
+	VALUE hexdump;
+
+	if ( !rant_log_debug_p() ) return;
+
+	hexdump = rb_funcall( rant_mAntDataUtilities, rb_intern("hexdump"), 1, data );
+	rant_log_obj( self, "debug", "Sending %s:\n%s", description, RSTRING_PTR(hexdump) );
+}
+
+
+/*
+ * call-seq:
+ *    channel.send_burst_transfer( data )
+ *
+ * Send the given +data+ as one or more burst packets. The last packet is
+ * padded with zeroes if the data doesn't fill it. Other threads can run while
+ * the transfer is being sent.
+ *
+ */
+static VALUE
+rant_channel_send_burst_transfer( VALUE self, VALUE data )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	rant_channel_command_t cmd = { 0 };
+	VALUE burst_data = rant_channel_burst_data( data, &cmd.packets );
+
+	rant_channel_log_burst_data( self, "burst packets", burst_data );
+
+	cmd.channel_num = ptr->channel_num;
+	cmd.data = (unsigned char *)RSTRING_PTR( burst_data );
+	rant_blocking_call( rant_channel_send_burst_command, &cmd );
+	RB_GC_GUARD( burst_data );
+
+	if ( !cmd.result ) {
+		rb_raise( rb_eRuntimeError, "failed to send burst transfer." );
+	}
+
+	return Qtrue;
+}
+
+
+/*
+ * call-seq:
+ *    channel.start_burst_stream
+ *
+ * Get ready to stream out a new burst transfer. Used by #stream_burst.
+ *
+ */
+static VALUE
+rant_channel_start_burst_stream( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+	ptr->tx_sequence = SEQUENCE_FIRST_MESSAGE;
+	ptr->tx_packets = 0;
+	ptr->tx_credits = 0;
+	ptr->tx_started = false;
+	ptr->tx_paced = false;
+	ptr->tx_result = 0;
+	pthread_mutex_unlock( &ptr->tx_mutex );
+
+	// The transfer events are what pace the stream, so make sure they're seen
+	rant_channel_watch_events( ptr );
+
+	return Qtrue;
+}
+
+
+/*
+ * call-seq:
+ *    channel.send_burst_stream_packets( data, last )   -> true or false
+ *
+ * Send the given +data+ as the next packets of the burst transfer being
+ * streamed out, padding it with zeroes to a whole number of packets, and
+ * marking the final packet as the end of the transfer if +last+ is true. If
+ * some of the transfer has already been sent, waits for the device to be ready
+ * for more first. Returns +false+ if the transfer failed instead. Used by
+ * #stream_burst.
+ *
+ */
+static VALUE
+rant_channel_send_burst_stream_packets( VALUE self, VALUE data, VALUE last )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	rant_channel_command_t cmd = { 0 };
+	VALUE burst_data = rant_channel_burst_data( data, &cmd.packets );
+
+	rant_channel_log_burst_data( self, "streamed burst packets", burst_data );
+
+	if ( ptr->tx_packets && !rant_channel_wait_for_transfer(ptr, false) ) return Qfalse;
+
+	cmd.channel = ptr;
+	cmd.data = (unsigned char *)RSTRING_PTR( burst_data );
+	cmd.last = RTEST( last );
+	rant_blocking_call( rant_channel_send_burst_stream_command, &cmd );
+	RB_GC_GUARD( burst_data );
+
+	return cmd.result ? Qtrue : Qfalse;
+}
+
+
+/*
+ * call-seq:
+ *    channel.finish_burst_stream   -> true or false
+ *
+ * Wait for the device to finish sending the burst transfer that's been
+ * streamed out. Returns +true+ if it was sent successfully. Used by
+ * #stream_burst.
+ *
+ */
+static VALUE
+rant_channel_finish_burst_stream( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+
+	return rant_channel_wait_for_transfer( ptr, true ) ? Qtrue : Qfalse;
+}
+
+
+/*
+ * call-seq:
+ *    channel.burst_stream_result   -> integer or nil
+ *
+ * Return the ID of the event that ended the burst transfer being streamed out,
+ * or +nil+ if it hasn't ended.
+ *
+ */
+static VALUE
+rant_channel_burst_stream_result( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	unsigned char result;
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+	result = ptr->tx_result;
+	pthread_mutex_unlock( &ptr->tx_mutex );
+
+	return result ? INT2FIX( result ) : Qnil;
+}
+
+
+/*
+ * call-seq:
+ *    channel.send_acknowledged_data( data )
+ *
+ * Send the given +data+ as an acknowledged transmission. The +data+ cannot be longer
+ * than 8 bytes in length. Returns +false+ if it couldn't be sent to the device.
+ *
+ */
+static VALUE
+rant_channel_send_acknowledged_data( VALUE self, VALUE data )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	UCHAR aucTempBuffer[] = {0, 0, 0, 0, 0, 0, 0, 0};
+	rant_channel_command_t cmd = { 0 };
+
+	StringValue( data );
+	if ( RSTRING_LEN(data) > 8 ) {
+		rb_raise( rb_eArgError, "Data can't be longer than 8 bytes." );
+	}
+	MEMCPY( aucTempBuffer, RSTRING_PTR(data), char, RSTRING_LEN(data) );
+
+	cmd.channel_num = ptr->channel_num;
+	cmd.data = aucTempBuffer;
+	rant_channel_quick_call( rant_channel_send_acknowledged_data_command, &cmd );
+
+	return cmd.result ? Qtrue : Qfalse;
+}
+
+
+/*
+ * call-seq:
+ *    channel.send_broadcast_data( data )
+ *
+ * Send the given +data+ as a broadcast transmission. The +data+ cannot be longer
+ * than 8 bytes in length. Returns +false+ if it couldn't be sent to the device.
+ *
+ */
+static VALUE
+rant_channel_send_broadcast_data( VALUE self, VALUE data )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	UCHAR aucTempBuffer[8] = {0, 0, 0, 0, 0, 0, 0, 0,};
+	rant_channel_command_t cmd = { 0 };
+
+	StringValue( data );
+	if ( RSTRING_LEN(data) > 8 ) {
+		rb_raise( rb_eArgError, "Data can't be longer than 8 bytes." );
+	}
+	MEMCPY( aucTempBuffer, RSTRING_PTR(data), char, RSTRING_LEN(data) );
+
+	cmd.channel_num = ptr->channel_num;
+	cmd.data = aucTempBuffer;
+	rant_channel_quick_call( rant_channel_send_broadcast_data_command, &cmd );
+
+	return cmd.result ? Qtrue : Qfalse;
+}
+
+
+/*
+ * Start a send with the command +fn+ and its +cmd+, and return an Ant::Future
+ * that's resolved by the event +kind+ (or a failure) once it's finished. If
+ * +blocking+ is true, the command waits on the device (e.g., to send all of a
+ * burst) instead of just writing a message to it.
+ */
+static VALUE
+rant_channel_send_async( VALUE self, unsigned char kind, void *(*fn)(void *),
+	rant_channel_command_t *cmd, bool blocking )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	rant_future_t *future = rant_future_create( kind );
+	VALUE rval = rant_future_wrap( future );
+
+	// The completion events are what resolve the future, so make sure they're seen
+	rant_channel_watch_events( ptr );
+
+	// Queue it before sending, as the event that finishes it can arrive before
+	// the send returns
+	rant_channel_add_future( ptr, future );
+
+	cmd->channel_num = ptr->channel_num;
+	atomic_fetch_add( &future->attempts, 1 );
+	if ( blocking ) {
+		rant_blocking_call( fn, cmd );
+	} else {
+		rant_channel_quick_call( fn, cmd );
+	}
+
+	if ( !cmd->result ) {
+		rant_channel_cancel_future( ptr, future, EVENT_TRANSFER_TX_FAILED );
+	}
+
+	return rval;
+}
+
+
+/*
+ * call-seq:
+ *    channel.send_acknowledged_data_async( data )   -> future
+ *
+ * Send the given +data+ (up to 8 bytes) as an acknowledged transmission, and
+ * return an Ant::Future that finishes when the device reports whether it was
+ * acknowledged.
+ *
+ */
+static VALUE
+rant_channel_send_acknowledged_data_async( VALUE self, VALUE data )
+{
+	UCHAR aucTempBuffer[8] = {0, 0, 0, 0, 0, 0, 0, 0,};
+	rant_channel_command_t cmd = { 0 };
+
+	StringValue( data );
+	if ( RSTRING_LEN(data) > 8 ) {
+		rb_raise( rb_eArgError, "Data can't be longer than 8 bytes." );
+	}
+	MEMCPY( aucTempBuffer, RSTRING_PTR(data), char, RSTRING_LEN(data) );
+
+	cmd.data = aucTempBuffer;
+	return rant_channel_send_async( self, EVENT_TRANSFER_TX_COMPLETED,
+		rant_channel_send_acknowledged_data_command, &cmd, false );
+}
 
-	if ( RTEST(rb_callback) ) {
-		VALUE args[3];
 
-		args[0] = INT2FIX( call->ucANTChannel );
-		args[1] = INT2FIX( call->ucEvent );
-		args[2] = rb_enc_str_new( (char *)ptr->buffer, MESG_MAX_SIZE, rb_ascii8bit_encoding() );
+/*
+ * call-seq:
+ *    channel.send_broadcast_data_async( data )   -> future
+ *
+ * Send the given +data+ (up to 8 bytes) as a broadcast transmission, and return
+ * an Ant::Future that finishes with the next EVENT_TX on the channel, i.e.,
+ * when the data has gone out. If another broadcast is sent before then, it
+ * replaces this one's data, so this one's future fails with
+ * Ant::EVENT_TRANSFER_TX_FAILED.
+ *
+ */
+static VALUE
+rant_channel_send_broadcast_data_async( VALUE self, VALUE data )
+{
+	UCHAR aucTempBuffer[8] = {0, 0, 0, 0, 0, 0, 0, 0,};
+	rant_channel_command_t cmd = { 0 };
 
-		rval = rb_funcallv_public( rb_callback, rb_intern("call"), 3, args );
+	StringValue( data );
+	if ( RSTRING_LEN(data) > 8 ) {
+		rb_raise( rb_eArgError, "Data can't be longer than 8 bytes." );
 	}
+	MEMCPY( aucTempBuffer, RSTRING_PTR(data), char, RSTRING_LEN(data) );
 
-	MEMZERO( ptr->buffer, unsigned char, MESG_MAX_SIZE );
+	cmd.data = aucTempBuffer;
+	return rant_channel_send_async( self, EVENT_TX, rant_channel_send_broadcast_data_command,
+		&cmd, false );
+}
+
+
+/*
+ * call-seq:
+ *    channel.send_burst_transfer_async( data )   -> future
+ *
+ * Send the given +data+ as one or more burst packets like #send_burst_transfer,
+ * and return an Ant::Future that finishes when the device reports whether the
+ * whole transfer was sent.
+ *
+ */
+static VALUE
+rant_channel_send_burst_transfer_async( VALUE self, VALUE data )
+{
+	rant_channel_command_t cmd = { 0 };
+	VALUE burst_data = rant_channel_burst_data( data, &cmd.packets );
+	VALUE rval;
+
+	rant_channel_log_burst_data( self, "burst packets", burst_data );
+
+	cmd.data = (unsigned char *)RSTRING_PTR( burst_data );
+	rval = rant_channel_send_async( self, EVENT_TRANSFER_TX_COMPLETED,
+		rant_channel_send_burst_command, &cmd, true );
+	RB_GC_GUARD( burst_data );
 
 	return rval;
 }
 
 
 /*
- * Handle the event callback -- C side.
+ * Wait for the +future+ of the oldest item in a full transmit queue -- Ruby side.
  */
-static BOOL
-rant_channel_on_event_callback( unsigned char ucANTChannel, unsigned char ucEvent )
+static VALUE
+rant_channel_wait_for_queued( VALUE future )
+{
+	rant_future_wait_for( (rant_future_t *)future, -1.0 );
+	return Qnil;
+}
+
+
+/*
+ * call-seq:
+ *    channel.queue_acknowledged_data( data )   -> future
+ *
+ * Add the given +data+ (up to 8 bytes) to the channel's transmit queue, and
+ * return an Ant::Future that finishes once it's been acknowledged or has run
+ * out of retries. The queue sends the next item as soon as the previous one is
+ * acknowledged, straight from the ANT library's receive thread, retrying items
+ * that fail or that the device turns down because another transfer is in
+ * progress up to #tx_queue_retries times. If the queue already has
+ * #tx_queue_depth items in it, waits for the oldest one to finish first.
+ *
+ * While the queue is sending, the channel's acknowledged and burst transfer
+ * events belong to it, so don't mix it with #send_acknowledged_data_async or
+ * #send_burst_transfer_async.
+ *
+ */
+static VALUE
+rant_channel_queue_acknowledged_data( VALUE self, VALUE data )
 {
-	rant_callback_t callback;
-	struct on_event_call call;
+	rant_channel_t *ptr = rant_get_channel( self );
+	rant_channel_command_t cmd = { 0 };
+	rant_tx_item_t *item;
+	VALUE rval;
+	int state = 0;
+
+	StringValue( data );
+	if ( RSTRING_LEN(data) > 8 ) {
+		rb_raise( rb_eArgError, "Data can't be longer than 8 bytes." );
+	}
+
+	// Transfer events and the device's responses are what drive the queue
+	rant_channel_watch_events( ptr );
+	rant_watch_responses();
+
+	item = calloc( 1, sizeof(rant_tx_item_t) );
+	if ( !item ) rb_raise( rb_eNoMemError, "couldn't allocate a transmit queue item" );
+
+	MEMCPY( item->data, RSTRING_PTR(data), char, RSTRING_LEN(data) );
+	item->retries = ptr->tx_queue_retries;
+	item->future = rant_future_create( EVENT_TRANSFER_TX_COMPLETED );
+	item->next = NULL;
+
+	// The queue's reference is the one the future starts with
+	rant_future_retain( item->future );
+	rval = rant_future_wrap( item->future );
+
+	cmd.channel = ptr;
+	cmd.item = item;
+
+	// Checking for room and adding the item happen under the same lock, so wait
+	// on the oldest item until there's room
+	for ( ;; ) {
+		rant_channel_quick_call( rant_channel_queue_command, &cmd );
+		if ( cmd.result ) break;
 
-	call.ucANTChannel = ucANTChannel;
-	call.ucEvent = ucEvent;
+		rb_protect( rant_channel_wait_for_queued, (VALUE)cmd.future, &state );
+		rant_future_release( cmd.future );
 
-	callback.data = &call;
-	callback.fn = rant_channel_call_event_callback;
+		if ( state ) {
+			rant_future_release( item->future );
+			free( item );
+			rb_jump_tag( state );
+		}
+	}
 
-	return rant_callback( &callback );
+	return rval;
 }
 
 
 /*
  * call-seq:
- *    channel.on_event {|channel_num, event_id, data| ... }
+ *    channel.tx_queue_depth   -> integer
  *
- * Set up a callback for events on the receiving channel.
+ * Return the number of items the channel's transmit queue can hold before
+ * #queue_acknowledged_data waits for room.
  *
  */
 static VALUE
-rant_channel_on_event( int argc, VALUE *argv, VALUE self )
+rant_channel_tx_queue_depth( VALUE self )
 {
 	rant_channel_t *ptr = rant_get_channel( self );
-	VALUE callback = Qnil;
+	return UINT2NUM( ptr->tx_queue_depth );
+}
 
-	rb_scan_args( argc, argv, "0&", &callback );
 
-	if ( !RTEST(callback) ) {
-		rb_raise( rb_eLocalJumpError, "block required, but not given" );
+/*
+ * call-seq:
+ *    channel.tx_queue_depth = integer
+ *
+ * Set the number of items the channel's transmit queue can hold.
+ *
+ */
+static VALUE
+rant_channel_tx_queue_depth_eq( VALUE self, VALUE depth )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	const unsigned int new_depth = NUM2UINT( depth );
+
+	if ( new_depth < 1 ) {
+		rb_raise( rb_eArgError, "transmit queue depth must be at least 1" );
 	}
 
-	rant_log_obj( self, "debug", "Channel event callback is: %s", RSTRING_PTR(rb_inspect(callback)) );
-	ptr->callback = callback;
+	pthread_mutex_lock( &ptr->tx_mutex );
+	ptr->tx_queue_depth = new_depth;
+	pthread_mutex_unlock( &ptr->tx_mutex );
 
-	ANT_AssignChannelEventFunction( ptr->channel_num, rant_channel_on_event_callback, ptr->buffer );
+	return depth;
+}
 
-	return Qtrue;
+
+/*
+ * call-seq:
+ *    channel.tx_queue_retries   -> integer
+ *
+ * Return how many times each item queued after this is retried before it
+ * fails.
+ *
+ */
+static VALUE
+rant_channel_tx_queue_retries( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	return UINT2NUM( ptr->tx_queue_retries );
 }
 
 
 /*
  * call-seq:
- *    channel.send_burst_transfer( data )
+ *    channel.tx_queue_retries = integer
  *
- * Send the given +data+ as one or more burst packets.
+ * Set how many times each item queued after this is retried before it fails.
  *
  */
 static VALUE
-rant_channel_send_burst_transfer( VALUE self, VALUE data )
+rant_channel_tx_queue_retries_eq( VALUE self, VALUE retries )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+	ptr->tx_queue_retries = NUM2UINT( retries );
+	pthread_mutex_unlock( &ptr->tx_mutex );
+
+	return retries;
+}
+
+
+/*
+ * call-seq:
+ *    channel.tx_queue_length   -> integer
+ *
+ * Return the number of items in the channel's transmit queue, including the
+ * one being sent.
+ *
+ */
+static VALUE
+rant_channel_tx_queue_length( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	unsigned int length;
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+	length = ptr->tx_queue_length;
+	pthread_mutex_unlock( &ptr->tx_mutex );
+
+	return UINT2NUM( length );
+}
+
+
+/*
+ * call-seq:
+ *    channel.tx_queue_retried   -> integer
+ *
+ * Return the number of times items in the channel's transmit queue have been
+ * retried.
+ *
+ */
+static VALUE
+rant_channel_tx_queue_retried( VALUE self )
 {
 	rant_channel_t *ptr = rant_get_channel( self );
-	unsigned char *data_s;
-	long data_len = RSTRING_LEN( data );
-	unsigned short usNumDataPackets = data_len / 8,
-		remainingBytes = data_len % 8;
+	return ULL2NUM( atomic_load(&ptr->tx_queue_retried) );
+}
 
-	data_s = ALLOC_N( unsigned char, data_len );
-	strncpy( (char *)data_s, StringValuePtr(data), data_len );
 
-	// Pad it to 8-byte alignment
-	if ( remainingBytes ) {
-		int pad_bytes = (8 - remainingBytes);
-		REALLOC_N( data_s, unsigned char, data_len + pad_bytes );
-		memset( data_s + data_len, 0, pad_bytes );
+/*
+ * Change the number of payloads the broadcast ring on the channel +ptr+ can
+ * hold to +size+, keeping the ones that are already in it. A +size+ of 0 gets
+ * rid of the ring.
+ */
+static void
+rant_channel_resize_broadcast_ring( rant_channel_t *ptr, unsigned int size )
+{
+	unsigned char *ring = NULL, *old_ring;
+	unsigned int i, length;
 
-		usNumDataPackets += 1;
+	if ( size ) {
+		ring = calloc( size, ANT_STANDARD_DATA_PAYLOAD_SIZE );
+		if ( !ring ) rb_raise( rb_eNoMemError, "couldn't allocate a broadcast ring" );
 	}
 
-	VALUE data_string = rb_enc_str_new( (char *)data_s, usNumDataPackets * 8, rb_ascii8bit_encoding() );
-	VALUE hexdump = rb_funcall( rant_mAntDataUtilities, rb_intern("hexdump"), 1, data_string );
+	pthread_mutex_lock( &ptr->tx_mutex );
 
-	rant_log_obj( self, "debug", "Sending burst packets:\n%s", RSTRING_PTR(hexdump) );
-	if ( !ANT_SendBurstTransfer(ptr->channel_num, data_s, usNumDataPackets) ) {
-		rb_raise( rb_eRuntimeError, "failed to send burst transfer." );
+	length = ptr->broadcast_ring_length;
+	if ( length > size ) {
+		pthread_mutex_unlock( &ptr->tx_mutex );
+		free( ring );
+		rb_raise( rb_eArgError, "the broadcast ring still has %u payloads in it", length );
 	}
 
-	return Qtrue;
+	for ( i = 0; i < length; i++ ) {
+		memcpy( ring + i * ANT_STANDARD_DATA_PAYLOAD_SIZE,
+			ptr->broadcast_ring + ANT_STANDARD_DATA_PAYLOAD_SIZE *
+				( (ptr->broadcast_ring_head + i) % ptr->broadcast_ring_size ),
+			ANT_STANDARD_DATA_PAYLOAD_SIZE );
+	}
+
+	old_ring = ptr->broadcast_ring;
+	ptr->broadcast_ring = ring;
+	ptr->broadcast_ring_size = size;
+	ptr->broadcast_ring_head = 0;
+
+	pthread_mutex_unlock( &ptr->tx_mutex );
+
+	free( old_ring );
 }
 
 
 /*
  * call-seq:
- *    channel.send_acknowledged_data( data )
+ *    channel.push_broadcast_data( data )   -> true or false
  *
- * Send the given +data+ as an acknowledged transmission. The +data+ cannot be longer
- * than 8 bytes in length.
+ * Add the given +data+ (up to 8 bytes) to the end of the channel's broadcast
+ * ring, setting up a ring of #broadcast_ring_size payloads first if it doesn't
+ * have one yet. Returns +false+ if the ring is full.
+ *
+ * On a master channel with a broadcast ring, each EVENT_TX sends the next
+ * payload in the ring straight from the ANT library's receive thread, so every
+ * message period gets fresh data even if Ruby is busy (e.g., in a GC pause).
+ * When the ring is empty the device just sends the last payload again. Don't
+ * also call #send_broadcast_data from the #on_event callback while the ring is
+ * in use.
  *
  */
 static VALUE
-rant_channel_send_acknowledged_data( VALUE self, VALUE data )
+rant_channel_push_broadcast_data( VALUE self, VALUE data )
 {
 	rant_channel_t *ptr = rant_get_channel( self );
-	UCHAR aucTempBuffer[] = {0, 0, 0, 0, 0, 0, 0, 0};
 
-	StringValue( data );
-	if ( RSTRING_LEN(data) > 8 ) {
-		rb_raise( rb_eArgError, "Data can't be longer than 8 bytes." );
+	if ( !ptr->broadcast_ring_size ) {
+		rant_channel_resize_broadcast_ring( ptr, DEFAULT_BROADCAST_RING_SIZE );
 	}
-	strncpy( (char *)aucTempBuffer, StringValuePtr(data), RSTRING_LEN(data) );
 
-	ANT_SendAcknowledgedData( ptr->channel_num, aucTempBuffer );
+	// The EVENT_TX is what sends the payloads in the ring
+	rant_channel_watch_events( ptr );
 
-	return Qtrue;
+	return rant_channel_push_broadcast( ptr, data ) ? Qtrue : Qfalse;
 }
 
 
 /*
  * call-seq:
- *    channel.send_broadcast_data( data )
+ *    channel.broadcast_ring_size   -> integer
  *
- * Send the given +data+ as a broadcast transmission. The +data+ cannot be longer
- * than 8 bytes in length.
+ * Return the number of payloads the channel's broadcast ring can hold, or 0 if
+ * the channel doesn't have one.
  *
  */
 static VALUE
-rant_channel_send_broadcast_data( VALUE self, VALUE data )
+rant_channel_broadcast_ring_size( VALUE self )
 {
 	rant_channel_t *ptr = rant_get_channel( self );
-	UCHAR aucTempBuffer[8] = {0, 0, 0, 0, 0, 0, 0, 0,};
+	return UINT2NUM( ptr->broadcast_ring_size );
+}
 
-	StringValue( data );
-	if ( RSTRING_LEN(data) > 8 ) {
-		rb_raise( rb_eArgError, "Data can't be longer than 8 bytes." );
+
+/*
+ * call-seq:
+ *    channel.broadcast_ring_size = integer
+ *
+ * Set the number of payloads the channel's broadcast ring can hold, keeping the
+ * ones already in it. Setting it to 0 gets rid of the ring once it's empty.
+ *
+ */
+static VALUE
+rant_channel_broadcast_ring_size_eq( VALUE self, VALUE size )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+
+	rant_channel_resize_broadcast_ring( ptr, NUM2UINT(size) );
+
+	return size;
+}
+
+
+/*
+ * call-seq:
+ *    channel.broadcast_ring_length   -> integer
+ *
+ * Return the number of payloads waiting in the channel's broadcast ring.
+ *
+ */
+static VALUE
+rant_channel_broadcast_ring_length( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	unsigned int length;
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+	length = ptr->broadcast_ring_length;
+	pthread_mutex_unlock( &ptr->tx_mutex );
+
+	return UINT2NUM( length );
+}
+
+
+/*
+ * call-seq:
+ *    channel.clear_broadcast_ring
+ *
+ * Throw away the payloads waiting in the channel's broadcast ring.
+ *
+ */
+static VALUE
+rant_channel_clear_broadcast_ring( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+	ptr->broadcast_ring_head = 0;
+	ptr->broadcast_ring_length = 0;
+	pthread_mutex_unlock( &ptr->tx_mutex );
+
+	return self;
+}
+
+
+/*
+ * call-seq:
+ *    channel.on_broadcast_ring_low( low_water=4 ) {|channel_num, space| ... }
+ *
+ * Set up a callback for when the channel's broadcast ring is down to
+ * +low_water+ payloads or fewer. It's called with the number of payloads
+ * there's room for, and whatever payloads it returns (a String or an Array of
+ * them) are added to the ring. It won't be called again until it has returned.
+ *
+ */
+static VALUE
+rant_channel_on_broadcast_ring_low( int argc, VALUE *argv, VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	VALUE low_water = Qnil, callback = Qnil;
+
+	rb_scan_args( argc, argv, "01&", &low_water, &callback );
+
+	if ( !RTEST(callback) ) {
+		rb_raise( rb_eLocalJumpError, "block required, but not given" );
 	}
-	strncpy( (char *)aucTempBuffer, StringValuePtr(data), RSTRING_LEN(data) );
 
-	ANT_SendBroadcastData( ptr->channel_num, aucTempBuffer );
+	rant_log_obj( self, "debug", "Channel broadcast ring refill callback is: %s",
+		RSTRING_PTR(rb_inspect(callback)) );
+
+	pthread_mutex_lock( &ptr->tx_mutex );
+	ptr->broadcast_ring_low_water = NIL_P( low_water ) ?
+		DEFAULT_BROADCAST_RING_LOW_WATER : NUM2UINT( low_water );
+	pthread_mutex_unlock( &ptr->tx_mutex );
+	ptr->broadcast_refill_callback = callback;
+
+	rant_channel_watch_events( ptr );
 
 	return Qtrue;
 }
@@ -595,11 +2964,60 @@ rant_channel_send_broadcast_data( VALUE self, VALUE data )
 
 /*
  * call-seq:
- *    channel.send_advanced_transfer( data, packets_per_message=3 )
+ *    channel.broadcast_ring_sent   -> integer
+ *
+ * Return the number of payloads the channel's broadcast ring has sent.
+ *
+ */
+static VALUE
+rant_channel_broadcast_ring_sent( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	return ULL2NUM( atomic_load(&ptr->broadcast_ring_sent) );
+}
+
+
+/*
+ * call-seq:
+ *    channel.broadcast_ring_underruns   -> integer
+ *
+ * Return the number of message periods the channel's broadcast ring was empty
+ * for, so the device sent the previous payload again.
+ *
+ */
+static VALUE
+rant_channel_broadcast_ring_underruns( VALUE self )
+{
+	rant_channel_t *ptr = rant_get_channel( self );
+	return ULL2NUM( atomic_load(&ptr->broadcast_ring_underruns) );
+}
+
+
+#ifdef HAVE_ANT_SENDADVANCEDBURST
+/*
+ * Return the number of packets to send with each advanced burst message given
+ * the +packets+ argument to one of the advanced burst methods.
+ */
+static unsigned char
+rant_channel_advanced_packets( VALUE packets )
+{
+	if ( NIL_P(packets) ) {
+		packets = rb_ivar_get( rant_mAnt, rb_intern("@advanced_burst_packets") );
+	}
+	return RTEST( packets ) ? NUM2CHR( packets ) : DEFAULT_ADV_PACKETS;
+}
+#endif
+
+
+/*
+ * call-seq:
+ *    channel.send_advanced_transfer( data, packets_per_message=nil )
  *
  * Send the given +data+ as one or more advanced burst packets. The +packets_per_message+
  * may be set to a value between 1 and 3 to control how many 8-byte packets are send with
- * each message.
+ * each message. It defaults to the largest number the device supports if
+ * Ant.negotiate_advanced_burst has been called, and 3 otherwise. Raises a
+ * RuntimeError if the transfer couldn't be sent.
  *
  */
 static VALUE
@@ -607,38 +3025,23 @@ rant_channel_send_advanced_transfer( int argc, VALUE *argv, VALUE self )
 {
 #ifdef HAVE_ANT_SENDADVANCEDBURST
 	rant_channel_t *ptr = rant_get_channel( self );
-	VALUE data = Qnil, packets = Qnil;
-	unsigned char *data_s;
-	long data_len;
-	unsigned short usNumDataPackets, remainingBytes;
-	unsigned char ucStdPcktsPerSerialMsg = DEFAULT_ADV_PACKETS;
+	VALUE data = Qnil, packets = Qnil, burst_data;
+	rant_channel_command_t cmd = { 0 };
 
 	rb_scan_args( argc, argv, "11", &data, &packets );
-	data_len = RSTRING_LEN( data );
-	usNumDataPackets = data_len / 8;
-	remainingBytes = data_len % 8;
-	if ( RTEST(packets) ) {
-		ucStdPcktsPerSerialMsg = NUM2CHR(packets);
-	}
+	cmd.packets_per_message = rant_channel_advanced_packets( packets );
+	burst_data = rant_channel_burst_data( data, &cmd.packets );
 
-	data_s = ALLOC_N( unsigned char, data_len );
-	strncpy( (char *)data_s, StringValuePtr(data), data_len );
+	rant_channel_log_burst_data( self, "advanced burst packets", burst_data );
 
-	// Pad it to 8-byte alignment
-	if ( remainingBytes ) {
-		int pad_bytes = (8 - remainingBytes);
-		REALLOC_N( data_s, unsigned char, data_len + pad_bytes );
-		memset( data_s + data_len, 0, pad_bytes );
-
-		usNumDataPackets += 1;
-	}
+	cmd.channel_num = ptr->channel_num;
+	cmd.data = (unsigned char *)RSTRING_PTR( burst_data );
+	cmd.response_time = ADVANCED_BURST_TIMEOUT;
+	rant_blocking_call( rant_channel_send_advanced_burst_command, &cmd );
+	RB_GC_GUARD( burst_data );
 
-	rant_log_obj( self, "warn", "Sending advanced burst packets (%d-byte messages): %s",
-		ucStdPcktsPerSerialMsg * 8, data_s );
-	if ( !ANT_SendAdvancedBurst_RTO(ptr->channel_num, data_s, usNumDataPackets,
-		ucStdPcktsPerSerialMsg, ADVANCED_BURST_TIMEOUT) )
-	{
-		rant_log_obj( self, "error", "failed to send advanced burst transfer." );
+	if ( !cmd.result ) {
+		rb_raise( rb_eRuntimeError, "failed to send advanced burst transfer." );
 	}
 
 	return Qtrue;
@@ -648,9 +3051,46 @@ rant_channel_send_advanced_transfer( int argc, VALUE *argv, VALUE self )
 }
 
 
+/*
+ * call-seq:
+ *    channel.send_advanced_transfer_async( data, packets_per_message=nil )   -> future
+ *
+ * Send the given +data+ as one or more advanced burst packets like
+ * #send_advanced_transfer, and return an Ant::Future that finishes when the
+ * device reports whether the whole transfer was sent.
+ *
+ */
+static VALUE
+rant_channel_send_advanced_transfer_async( int argc, VALUE *argv, VALUE self )
+{
+#ifdef HAVE_ANT_SENDADVANCEDBURST
+	VALUE data = Qnil, packets = Qnil, burst_data, rval;
+	rant_channel_command_t cmd = { 0 };
+
+	rb_scan_args( argc, argv, "11", &data, &packets );
+	cmd.packets_per_message = rant_channel_advanced_packets( packets );
+	burst_data = rant_channel_burst_data( data, &cmd.packets );
+
+	rant_channel_log_burst_data( self, "advanced burst packets", burst_data );
+
+	cmd.data = (unsigned char *)RSTRING_PTR( burst_data );
+	cmd.response_time = ADVANCED_BURST_TIMEOUT;
+	rval = rant_channel_send_async( self, EVENT_TRANSFER_TX_COMPLETED,
+		rant_channel_send_advanced_burst_command, &cmd, true );
+	RB_GC_GUARD( burst_data );
+
+	return rval;
+#else
+	rb_notimplement();
+#endif
+}
+
+
 void
 init_ant_channel()
 {
+	unsigned int i;
+
 #ifdef FOR_RDOC
 	rb_cData = rb_define_class( "Data" );
 	rant_mAnt = rb_define_module( "Ant" );
@@ -665,9 +3105,17 @@ init_ant_channel()
 	rant_cAntChannel = rb_define_class_under( rant_mAnt, "Channel", rb_cObject );
 	rb_iv_set( rant_cAntChannel, "@registry", rb_hash_new() );
 
+	for ( i = 0; i <= CHANNEL_NUMBER_MASK; i++ ) {
+		channel_table[ i ] = Qnil;
+		closing_channel_table[ i ] = Qnil;
+		rb_gc_register_address( &channel_table[i] );
+		rb_gc_register_address( &closing_channel_table[i] );
+	}
+
 	rant_mAntDataUtilities = rb_define_module_under( rant_mAnt, "DataUtilities" );
 
 	rb_define_alloc_func( rant_cAntChannel, rant_channel_alloc );
+	rb_define_singleton_method( rant_cAntChannel, "[]", rant_channel_s_aref, 1 );
 	rb_define_protected_method( rant_cAntChannel, "initialize", rant_channel_init, 4 );
 
 	rb_define_method( rant_cAntChannel, "channel_number", rant_channel_channel_number, 0 );
@@ -692,13 +3140,59 @@ init_ant_channel()
 	rb_define_method( rant_cAntChannel, "open", rant_channel_open, -1 );
 	rb_define_method( rant_cAntChannel, "close", rant_channel_close, -1 );
 	rb_define_method( rant_cAntChannel, "closed?", rant_channel_closed_p, 0 );
+	rb_define_method( rant_cAntChannel, "unassign", rant_channel_unassign, -1 );
+	rb_define_method( rant_cAntChannel, "last_event_at", rant_channel_last_event_at, 0 );
+	rb_define_method( rant_cAntChannel, "closed_by_device?", rant_channel_closed_by_device_p, 0 );
 
 	rb_define_method( rant_cAntChannel, "send_burst_transfer", rant_channel_send_burst_transfer, 1 );
 	rb_define_method( rant_cAntChannel, "send_acknowledged_data", rant_channel_send_acknowledged_data, 1 );
 	rb_define_method( rant_cAntChannel, "send_broadcast_data", rant_channel_send_broadcast_data, 1 );
 	rb_define_method( rant_cAntChannel, "send_advanced_transfer", rant_channel_send_advanced_transfer, -1 );
 
+	rb_define_method( rant_cAntChannel, "send_acknowledged_data_async",
+		rant_channel_send_acknowledged_data_async, 1 );
+	rb_define_method( rant_cAntChannel, "send_broadcast_data_async",
+		rant_channel_send_broadcast_data_async, 1 );
+	rb_define_method( rant_cAntChannel, "send_burst_transfer_async",
+		rant_channel_send_burst_transfer_async, 1 );
+	rb_define_method( rant_cAntChannel, "send_advanced_transfer_async",
+		rant_channel_send_advanced_transfer_async, -1 );
+
+	rb_define_method( rant_cAntChannel, "queue_acknowledged_data",
+		rant_channel_queue_acknowledged_data, 1 );
+	rb_define_method( rant_cAntChannel, "tx_queue_depth", rant_channel_tx_queue_depth, 0 );
+	rb_define_method( rant_cAntChannel, "tx_queue_depth=", rant_channel_tx_queue_depth_eq, 1 );
+	rb_define_method( rant_cAntChannel, "tx_queue_retries", rant_channel_tx_queue_retries, 0 );
+	rb_define_method( rant_cAntChannel, "tx_queue_retries=", rant_channel_tx_queue_retries_eq, 1 );
+	rb_define_method( rant_cAntChannel, "tx_queue_length", rant_channel_tx_queue_length, 0 );
+	rb_define_method( rant_cAntChannel, "tx_queue_retried", rant_channel_tx_queue_retried, 0 );
+
+	rb_define_method( rant_cAntChannel, "push_broadcast_data", rant_channel_push_broadcast_data, 1 );
+	rb_define_method( rant_cAntChannel, "broadcast_ring_size", rant_channel_broadcast_ring_size, 0 );
+	rb_define_method( rant_cAntChannel, "broadcast_ring_size=", rant_channel_broadcast_ring_size_eq, 1 );
+	rb_define_method( rant_cAntChannel, "broadcast_ring_length", rant_channel_broadcast_ring_length, 0 );
+	rb_define_method( rant_cAntChannel, "clear_broadcast_ring", rant_channel_clear_broadcast_ring, 0 );
+	rb_define_method( rant_cAntChannel, "on_broadcast_ring_low", rant_channel_on_broadcast_ring_low, -1 );
+	rb_define_method( rant_cAntChannel, "broadcast_ring_sent", rant_channel_broadcast_ring_sent, 0 );
+	rb_define_method( rant_cAntChannel, "broadcast_ring_underruns",
+		rant_channel_broadcast_ring_underruns, 0 );
+
+	rb_define_private_method( rant_cAntChannel, "start_burst_stream", rant_channel_start_burst_stream, 0 );
+	rb_define_private_method( rant_cAntChannel, "send_burst_stream_packets",
+		rant_channel_send_burst_stream_packets, 2 );
+	rb_define_private_method( rant_cAntChannel, "finish_burst_stream", rant_channel_finish_burst_stream, 0 );
+	rb_define_private_method( rant_cAntChannel, "burst_stream_result", rant_channel_burst_stream_result, 0 );
+
 	rb_define_method( rant_cAntChannel, "on_event", rant_channel_on_event, -1 );
+	rb_define_method( rant_cAntChannel, "on_events", rant_channel_on_events, -1 );
+	rb_define_method( rant_cAntChannel, "on_burst", rant_channel_on_burst, -1 );
+	rb_define_method( rant_cAntChannel, "failed_bursts", rant_channel_failed_bursts, 0 );
+	rb_define_method( rant_cAntChannel, "add_native_sink", rant_channel_add_native_sink, 1 );
+	rb_define_method( rant_cAntChannel, "native_sinks", rant_channel_native_sinks, 0 );
+	rb_define_method( rant_cAntChannel, "dispatch_weight", rant_channel_dispatch_weight, 0 );
+	rb_define_method( rant_cAntChannel, "dispatch_weight=", rant_channel_dispatch_weight_eq, 1 );
+	rb_define_method( rant_cAntChannel, "dropped_events", rant_channel_dropped_events, 0 );
+	rb_define_method( rant_cAntChannel, "receive_event", rant_channel_receive_event, 2 );
 
 	rb_require( "ant/channel" );
 }
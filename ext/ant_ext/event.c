@@ -0,0 +1,514 @@
+/*
+ *  event.c - Ant::Event class
+ *  $Id$
+ *
+ *  Authors:
+ *    * Michael Granger <ged@FaerieMUD.org>
+ *
+ */
+
+#include "ant_ext.h"
+
+// Bits for the fields an event has, set when it's decoded
+#define RANT_EVENT_HAS_PAYLOAD    0x01
+#define RANT_EVENT_HAS_FLAGS      0x02
+#define RANT_EVENT_HAS_DEVICE_ID  0x04
+#define RANT_EVENT_HAS_RSSI       0x08
+#define RANT_EVENT_HAS_TIMESTAMP  0x10
+
+// Offsets into event data
+#define EVENT_PAYLOAD_OFFSET  MESG_CHANNEL_NUM_SIZE
+#define EVENT_EXTENDED_OFFSET MESG_DATA_SIZE
+
+VALUE rant_cAntEvent;
+
+static ID id_channel, id_event_id, id_payload, id_flags, id_device_number, id_device_type,
+	id_transmission_type, id_rssi, id_timestamp;
+
+static void rant_event_mark( void * );
+
+
+static const rb_data_type_t rant_event_datatype_t = {
+	.wrap_struct_name = "Ant::Event",
+	.function = {
+		.dmark = rant_event_mark,
+		.dfree = RUBY_TYPED_DEFAULT_FREE,
+	},
+	.data = NULL,
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+
+/*
+ * Mark function
+ */
+static void
+rant_event_mark( void *ptr )
+{
+	rant_event_t *event = (rant_event_t *)ptr;
+	rb_gc_mark( event->data_str );
+	rb_gc_mark( event->payload );
+}
+
+
+/*
+ * Alloc function
+ */
+static VALUE
+rant_event_alloc( VALUE klass )
+{
+	rant_event_t *ptr;
+
+	VALUE rval = TypedData_Make_Struct( klass, rant_event_t, &rant_event_datatype_t, ptr );
+	ptr->data_str = Qnil;
+	ptr->payload = Qnil;
+
+	return rval;
+}
+
+
+/*
+ * Fetch the data pointer and check it for sanity.
+ */
+static rant_event_t *
+rant_get_event( VALUE self )
+{
+	return rb_check_typeddata( self, &rant_event_datatype_t );
+}
+
+
+/*
+ * Decode the fields of the event +ptr+ from its data if they haven't been
+ * already.
+ */
+static rant_event_t *
+rant_event_decode( rant_event_t *ptr )
+{
+	const unsigned char *data = ptr->data;
+	size_t offset = EVENT_EXTENDED_OFFSET;
+
+	if ( ptr->decoded ) return ptr;
+	ptr->decoded = true;
+
+	switch ( ptr->event_id ) {
+		case EVENT_RX_BROADCAST:
+		case EVENT_RX_ACKNOWLEDGED:
+		case EVENT_RX_BURST_PACKET:
+			break;
+
+		// Legacy extended data: the channel ID follows the payload
+		case EVENT_RX_EXT_BROADCAST:
+		case EVENT_RX_EXT_ACKNOWLEDGED:
+		case EVENT_RX_EXT_BURST_PACKET:
+			if ( ptr->length >= offset + ANT_EXT_MESG_DEVICE_ID_FIELD_SIZE ) {
+				ptr->fields |= RANT_EVENT_HAS_DEVICE_ID;
+				ptr->device_number = data[ offset ] | ( data[offset + 1] << 8 );
+				ptr->device_type = data[ offset + 2 ];
+				ptr->transmission_type = data[ offset + 3 ];
+			}
+			break;
+
+		// Legacy RSSI data: measurement type, RSSI, and threshold follow the payload
+		case EVENT_RX_RSSI_BROADCAST:
+		case EVENT_RX_RSSI_ACKNOWLEDGED:
+		case EVENT_RX_RSSI_BURST_PACKET:
+			if ( ptr->length >= offset + 2 ) {
+				ptr->fields |= RANT_EVENT_HAS_RSSI;
+				ptr->rssi = (signed char)data[ offset + 1 ];
+			}
+			break;
+
+		// Flagged extended data: the flag byte says which fields follow it
+		case EVENT_RX_FLAG_BROADCAST:
+		case EVENT_RX_FLAG_ACKNOWLEDGED:
+		case EVENT_RX_FLAG_BURST_PACKET:
+			if ( ptr->length <= offset ) break;
+
+			ptr->fields |= RANT_EVENT_HAS_FLAGS;
+			ptr->flags = data[ offset++ ];
+
+			if ( ptr->flags & ANT_EXT_MESG_BITFIELD_DEVICE_ID ) {
+				if ( ptr->length < offset + ANT_EXT_MESG_DEVICE_ID_FIELD_SIZE ) break;
+				ptr->fields |= RANT_EVENT_HAS_DEVICE_ID;
+				ptr->device_number = data[ offset ] | ( data[offset + 1] << 8 );
+				ptr->device_type = data[ offset + 2 ];
+				ptr->transmission_type = data[ offset + 3 ];
+				offset += ANT_EXT_MESG_DEVICE_ID_FIELD_SIZE;
+			}
+			if ( ptr->flags & ANT_LIB_CONFIG_MESG_OUT_INC_RSSI ) {
+				if ( ptr->length < offset + 3 ) break;
+				ptr->fields |= RANT_EVENT_HAS_RSSI;
+				ptr->rssi = (signed char)data[ offset + 1 ];
+				offset += 3;
+			}
+			if ( ptr->flags & ANT_LIB_CONFIG_MESG_OUT_INC_TIME_STAMP ) {
+				if ( ptr->length < offset + 2 ) break;
+				ptr->fields |= RANT_EVENT_HAS_TIMESTAMP;
+				ptr->timestamp = data[ offset ] | ( data[offset + 1] << 8 );
+			}
+			break;
+
+		// Everything else is a channel response without a payload
+		default:
+			return ptr;
+	}
+
+	if ( ptr->length >= EVENT_PAYLOAD_OFFSET + ANT_STANDARD_DATA_PAYLOAD_SIZE )
+		ptr->fields |= RANT_EVENT_HAS_PAYLOAD;
+
+	return ptr;
+}
+
+
+/*
+ * Return a new Ant::Event for the event +call+. Its fields aren't decoded
+ * until they're asked for.
+ */
+VALUE
+rant_event_new( rant_callback_t *call )
+{
+	rant_event_t *ptr;
+	VALUE event = TypedData_Make_Struct( rant_cAntEvent, rant_event_t, &rant_event_datatype_t, ptr );
+
+	ptr->channel = call->channel;
+	ptr->event_id = call->id;
+	ptr->length = call->length;
+	MEMCPY( ptr->data, call->data, unsigned char, call->length );
+	ptr->data_str = Qnil;
+	ptr->payload = Qnil;
+
+	return rb_obj_freeze( event );
+}
+
+
+/*
+ * call-seq:
+ *    Ant::Event.new( channel_num, event_id, data )   -> event
+ *
+ * Create an event for the given +channel_num+ and +event_id+ from its raw
+ * +data+, as it'd be passed to a Channel#on_event callback.
+ *
+ */
+static VALUE
+rant_event_init( VALUE self, VALUE channel_num, VALUE event_id, VALUE data )
+{
+	rant_event_t *ptr = rant_get_event( self );
+	long length;
+
+	StringValue( data );
+	length = RSTRING_LEN( data );
+	if ( length > MESG_MAX_SIZE ) {
+		rb_raise( rb_eArgError, "event data can't be longer than %d bytes", MESG_MAX_SIZE );
+	}
+
+	ptr->channel = NUM2CHR( channel_num );
+	ptr->event_id = NUM2CHR( event_id );
+	ptr->length = (unsigned char)length;
+	MEMCPY( ptr->data, RSTRING_PTR(data), char, length );
+	ptr->decoded = false;
+	ptr->fields = 0;
+	ptr->data_str = Qnil;
+	ptr->payload = Qnil;
+
+	rb_obj_freeze( self );
+
+	return self;
+}
+
+
+/*
+ * call-seq:
+ *    event.channel   -> integer
+ *
+ * Return the number of the channel the event happened on.
+ *
+ */
+static VALUE
+rant_event_channel( VALUE self )
+{
+	rant_event_t *ptr = rant_get_event( self );
+	return INT2FIX( ptr->channel );
+}
+
+
+/*
+ * call-seq:
+ *    event.event_id   -> integer
+ *
+ * Return the event's ID, e.g., Ant::EVENT_RX_BROADCAST.
+ *
+ */
+static VALUE
+rant_event_event_id( VALUE self )
+{
+	rant_event_t *ptr = rant_get_event( self );
+	return INT2FIX( ptr->event_id );
+}
+
+
+/*
+ * call-seq:
+ *    event.data   -> string
+ *
+ * Return the event's raw message data, the same as an +on_event+ callback's
+ * +data+ argument.
+ *
+ */
+static VALUE
+rant_event_data( VALUE self )
+{
+	rant_event_t *ptr = rant_get_event( self );
+
+	if ( NIL_P(ptr->data_str) ) {
+		VALUE data = rb_enc_str_new( (char *)ptr->data, ptr->length, rb_ascii8bit_encoding() );
+		RB_OBJ_WRITE( self, &ptr->data_str, rb_obj_freeze(data) );
+	}
+
+	return ptr->data_str;
+}
+
+
+/*
+ * call-seq:
+ *    event.payload   -> string or nil
+ *
+ * Return the 8-byte data payload of a receive event, or +nil+ if the event
+ * doesn't have one.
+ *
+ */
+static VALUE
+rant_event_payload( VALUE self )
+{
+	rant_event_t *ptr = rant_event_decode( rant_get_event(self) );
+
+	if ( !(ptr->fields & RANT_EVENT_HAS_PAYLOAD) ) return Qnil;
+
+	if ( NIL_P(ptr->payload) ) {
+		VALUE payload = rb_enc_str_new( (char *)ptr->data + EVENT_PAYLOAD_OFFSET,
+			ANT_STANDARD_DATA_PAYLOAD_SIZE, rb_ascii8bit_encoding() );
+		RB_OBJ_WRITE( self, &ptr->payload, rb_obj_freeze(payload) );
+	}
+
+	return ptr->payload;
+}
+
+
+/*
+ * call-seq:
+ *    event.flags   -> integer or nil
+ *
+ * Return the extended-data flag byte of a flagged receive event, or +nil+ if
+ * the event isn't one.
+ *
+ */
+static VALUE
+rant_event_flags( VALUE self )
+{
+	rant_event_t *ptr = rant_event_decode( rant_get_event(self) );
+
+	if ( !(ptr->fields & RANT_EVENT_HAS_FLAGS) ) return Qnil;
+	return INT2FIX( ptr->flags );
+}
+
+
+/*
+ * call-seq:
+ *    event.device_number   -> integer or nil
+ *
+ * Return the device number from the channel ID included with an extended
+ * receive event, or +nil+ if it wasn't included.
+ *
+ */
+static VALUE
+rant_event_device_number( VALUE self )
+{
+	rant_event_t *ptr = rant_event_decode( rant_get_event(self) );
+
+	if ( !(ptr->fields & RANT_EVENT_HAS_DEVICE_ID) ) return Qnil;
+	return INT2FIX( ptr->device_number );
+}
+
+
+/*
+ * call-seq:
+ *    event.device_type   -> integer or nil
+ *
+ * Return the device type from the channel ID included with an extended
+ * receive event, or +nil+ if it wasn't included.
+ *
+ */
+static VALUE
+rant_event_device_type( VALUE self )
+{
+	rant_event_t *ptr = rant_event_decode( rant_get_event(self) );
+
+	if ( !(ptr->fields & RANT_EVENT_HAS_DEVICE_ID) ) return Qnil;
+	return INT2FIX( ptr->device_type );
+}
+
+
+/*
+ * call-seq:
+ *    event.transmission_type   -> integer or nil
+ *
+ * Return the transmission type from the channel ID included with an extended
+ * receive event, or +nil+ if it wasn't included.
+ *
+ */
+static VALUE
+rant_event_transmission_type( VALUE self )
+{
+	rant_event_t *ptr = rant_event_decode( rant_get_event(self) );
+
+	if ( !(ptr->fields & RANT_EVENT_HAS_DEVICE_ID) ) return Qnil;
+	return INT2FIX( ptr->transmission_type );
+}
+
+
+/*
+ * call-seq:
+ *    event.rssi   -> integer or nil
+ *
+ * Return the signal strength the event was received with in dBm, or +nil+ if
+ * it wasn't included.
+ *
+ */
+static VALUE
+rant_event_rssi( VALUE self )
+{
+	rant_event_t *ptr = rant_event_decode( rant_get_event(self) );
+
+	if ( !(ptr->fields & RANT_EVENT_HAS_RSSI) ) return Qnil;
+	return INT2FIX( ptr->rssi );
+}
+
+
+/*
+ * call-seq:
+ *    event.timestamp   -> integer or nil
+ *
+ * Return the device's receive timestamp for the event, in 1/32768ths of a
+ * second, or +nil+ if it wasn't included. The timestamp rolls over every two
+ * seconds.
+ *
+ */
+static VALUE
+rant_event_timestamp( VALUE self )
+{
+	rant_event_t *ptr = rant_event_decode( rant_get_event(self) );
+
+	if ( !(ptr->fields & RANT_EVENT_HAS_TIMESTAMP) ) return Qnil;
+	return INT2FIX( ptr->timestamp );
+}
+
+
+/*
+ * call-seq:
+ *    event.deconstruct_keys( keys )   -> hash
+ *
+ * Return a Hash of the event's fields for pattern matching, limited to the
+ * given +keys+ if they aren't +nil+. Fields the event doesn't have are +nil+.
+ *
+ *    case event
+ *    in { event_id: Ant::EVENT_RX_FLAG_BROADCAST, device_number:, rssi: }
+ *      ...
+ *
+ */
+static VALUE
+rant_event_deconstruct_keys( VALUE self, VALUE keys )
+{
+	static VALUE (*const readers[])( VALUE ) = {
+		rant_event_channel, rant_event_event_id, rant_event_payload, rant_event_flags,
+		rant_event_device_number, rant_event_device_type, rant_event_transmission_type,
+		rant_event_rssi, rant_event_timestamp,
+	};
+	const ID ids[] = {
+		id_channel, id_event_id, id_payload, id_flags, id_device_number, id_device_type,
+		id_transmission_type, id_rssi, id_timestamp,
+	};
+	const size_t count = sizeof( ids ) / sizeof( ids[0] );
+	VALUE hash = rb_hash_new();
+	size_t i;
+	long j;
+
+	if ( NIL_P(keys) ) {
+		for ( i = 0; i < count; i++ )
+			rb_hash_aset( hash, ID2SYM(ids[i]), readers[i](self) );
+		return hash;
+	}
+
+	Check_Type( keys, T_ARRAY );
+	for ( j = 0; j < RARRAY_LEN(keys); j++ ) {
+		VALUE key = RARRAY_AREF( keys, j );
+
+		if ( !SYMBOL_P(key) ) continue;
+		for ( i = 0; i < count; i++ ) {
+			if ( SYM2ID(key) == ids[i] ) {
+				rb_hash_aset( hash, key, readers[i](self) );
+				break;
+			}
+		}
+	}
+
+	return hash;
+}
+
+
+/*
+ * call-seq:
+ *    event.to_h   -> hash
+ *
+ * Return the event's fields as a Hash.
+ *
+ */
+static VALUE
+rant_event_to_h( VALUE self )
+{
+	return rant_event_deconstruct_keys( self, Qnil );
+}
+
+
+void
+init_ant_event()
+{
+#ifdef FOR_RDOC
+	rant_mAnt = rb_define_module( "Ant" );
+#endif
+
+	id_channel = rb_intern( "channel" );
+	id_event_id = rb_intern( "event_id" );
+	id_payload = rb_intern( "payload" );
+	id_flags = rb_intern( "flags" );
+	id_device_number = rb_intern( "device_number" );
+	id_device_type = rb_intern( "device_type" );
+	id_transmission_type = rb_intern( "transmission_type" );
+	id_rssi = rb_intern( "rssi" );
+	id_timestamp = rb_intern( "timestamp" );
+
+	/*
+	 * Document-class: Ant::Event
+	 *
+	 * An event on a channel, as passed to a Channel#on_event callback set up
+	 * with <tt>event_objects: true</tt>. Its fields are decoded from the raw
+	 * message only when they're asked for.
+	 *
+	 */
+	rant_cAntEvent = rb_define_class_under( rant_mAnt, "Event", rb_cObject );
+	rb_define_alloc_func( rant_cAntEvent, rant_event_alloc );
+
+	rb_define_method( rant_cAntEvent, "initialize", rant_event_init, 3 );
+
+	rb_define_method( rant_cAntEvent, "channel", rant_event_channel, 0 );
+	rb_define_method( rant_cAntEvent, "event_id", rant_event_event_id, 0 );
+	rb_define_method( rant_cAntEvent, "data", rant_event_data, 0 );
+	rb_define_method( rant_cAntEvent, "payload", rant_event_payload, 0 );
+	rb_define_method( rant_cAntEvent, "flags", rant_event_flags, 0 );
+	rb_define_method( rant_cAntEvent, "device_number", rant_event_device_number, 0 );
+	rb_define_method( rant_cAntEvent, "device_type", rant_event_device_type, 0 );
+	rb_define_method( rant_cAntEvent, "transmission_type", rant_event_transmission_type, 0 );
+	rb_define_method( rant_cAntEvent, "rssi", rant_event_rssi, 0 );
+	rb_define_method( rant_cAntEvent, "timestamp", rant_event_timestamp, 0 );
+
+	rb_define_method( rant_cAntEvent, "deconstruct_keys", rant_event_deconstruct_keys, 1 );
+	rb_define_method( rant_cAntEvent, "to_h", rant_event_to_h, 0 );
+}
@@ -12,6 +12,17 @@ have_header( 'libant.h' ) or
 	abort "No libant.h header!"
 have_header( 'ruby/thread.h' ) or
 	abort "Your Ruby is too old!"
+have_header( 'stdatomic.h' ) or
+	abort "Your compiler doesn't support C11 atomics!"
+
+# Use an eventfd for Ant.event_io if there is one, otherwise fall back to a pipe
+have_header( 'sys/eventfd.h' )
+
+# Blocking calls yield to the fiber scheduler if there is one (Ruby 3.0+)
+have_func( 'rb_fiber_scheduler_current', 'ruby/fiber/scheduler.h' )
+
+# Time waits for futures with the monotonic clock if the condvars can use it
+have_func( 'pthread_condattr_setclock', 'pthread.h' )
 
 have_func( 'ANT_Init', 'libant.h' )
 have_func( 'ANT_IsInitialized', 'libant.h' )
@@ -27,6 +38,31 @@ $CPPFLAGS << " -Wno-compound-token-split-by-macro "
 
 $CFLAGS << " -g "
 
+
+# Generate the table of message sizes used to size message payloads from the
+# ID and SIZE pairs in antmessage.h. Messages whose size varies are left out,
+# and so are sent with the maximum size.
+VARIABLE_SIZE_MESSAGES = %w[ CONFIG_ADV_BURST ]
+
+message_header = File.read( File.join(__dir__, 'antmessage.h') )
+message_ids = message_header.scan( /^#define\s+MESG_(\w+)_ID\s+\(\(UCHAR\)\s*(0x\h+)\)/ )
+message_sizes = message_header.scan( /^#define\s+MESG_(\w+)_SIZE\s+\(\(UCHAR\)\s*(\d+)\)/ ).to_h
+
+entries = message_ids.uniq {|_, id| id.hex }.filter_map do |name, id|
+	size = message_sizes[ name ].to_i
+	next if size.zero?
+	next if VARIABLE_SIZE_MESSAGES.include?( name )
+	"\t[ %s ] = %d, /* MESG_%s */" % [ id, size, name ]
+end
+
+File.write( 'ant_message_sizes.h', <<~END_HEADER )
+	/* Generated by extconf.rb from antmessage.h -- do not edit. */
+	static const unsigned char rant_message_sizes[ 256 ] = {
+	#{entries.join("\n")}
+	};
+END_HEADER
+message( "generated ant_message_sizes.h with %d message sizes\n" % [entries.length] )
+
 create_header()
 create_makefile( 'ant_ext' )
 
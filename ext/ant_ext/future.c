@@ -0,0 +1,432 @@
+/*
+ *  future.c - Ant::Future class
+ *  $Id$
+ *
+ *  Authors:
+ *    * Michael Granger <ged@FaerieMUD.org>
+ *
+ */
+
+#include "ant_ext.h"
+
+#include <errno.h>
+
+// The clock the futures' condition variables time their waits with
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+# define FUTURE_WAIT_CLOCK  CLOCK_MONOTONIC
+#else
+# define FUTURE_WAIT_CLOCK  CLOCK_REALTIME
+#endif
+
+VALUE rant_cAntFuture;
+
+static void rant_future_free( void * );
+
+
+static const rb_data_type_t rant_future_datatype_t = {
+	.wrap_struct_name = "Ant::Future",
+	.function = {
+		.dmark = NULL,
+		.dfree = rant_future_free,
+	},
+	.data = NULL,
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+
+/*
+ * The arguments to a wait for a future, so it can be run without the GVL, and
+ * whether it ended because the thread was interrupted.
+ */
+typedef struct rant_future_wait_t rant_future_wait_t;
+struct rant_future_wait_t {
+	rant_future_t *future;
+	bool timed;
+	struct timespec deadline;
+	bool interrupted;
+	bool timed_out;
+};
+
+
+/*
+ * Create a pending future that's resolved by an event of the given +kind+. The
+ * caller owns the one reference it starts with. Futures are resolved and
+ * released from the ANT library's receive thread, so they're malloc()ed instead
+ * of being allocated by Ruby.
+ */
+rant_future_t *
+rant_future_create( unsigned char kind )
+{
+	rant_future_t *future = calloc( 1, sizeof(rant_future_t) );
+	pthread_condattr_t attr;
+
+	if ( !future ) rb_raise( rb_eNoMemError, "couldn't allocate a future" );
+
+	pthread_condattr_init( &attr );
+#ifdef HAVE_PTHREAD_CONDATTR_SETCLOCK
+	pthread_condattr_setclock( &attr, FUTURE_WAIT_CLOCK );
+#endif
+	pthread_mutex_init( &future->mutex, NULL );
+	pthread_cond_init( &future->cond, &attr );
+	pthread_condattr_destroy( &attr );
+	atomic_init( &future->refcount, 1 );
+	future->kind = kind;
+	future->result = 0;
+	atomic_init( &future->attempts, 0 );
+	future->next = NULL;
+
+	return future;
+}
+
+
+/*
+ * Add a reference to the given +future+.
+ */
+void
+rant_future_retain( rant_future_t *future )
+{
+	atomic_fetch_add( &future->refcount, 1 );
+}
+
+
+/*
+ * Drop a reference to the given +future+, freeing it if it was the last one.
+ */
+void
+rant_future_release( rant_future_t *future )
+{
+	if ( atomic_fetch_sub(&future->refcount, 1) != 1 ) return;
+
+	pthread_mutex_destroy( &future->mutex );
+	pthread_cond_destroy( &future->cond );
+	free( future );
+}
+
+
+/*
+ * Resolve the +future+ with the event +result+ and wake up anything waiting
+ * on it, unless it's already been resolved.
+ */
+void
+rant_future_resolve( rant_future_t *future, unsigned char result )
+{
+	pthread_mutex_lock( &future->mutex );
+	if ( !future->result ) {
+		future->result = result;
+		pthread_cond_broadcast( &future->cond );
+	}
+	pthread_mutex_unlock( &future->mutex );
+}
+
+
+/*
+ * Return a new Ant::Future object for the given +future+, which takes over the
+ * caller's reference to it.
+ */
+VALUE
+rant_future_wrap( rant_future_t *future )
+{
+	return TypedData_Wrap_Struct( rant_cAntFuture, &rant_future_datatype_t, future );
+}
+
+
+/*
+ * Free function
+ */
+static void
+rant_future_free( void *ptr )
+{
+	if ( ptr ) rant_future_release( (rant_future_t *)ptr );
+}
+
+
+/*
+ * Fetch the data pointer and check it for sanity.
+ */
+static rant_future_t *
+rant_get_future( VALUE self )
+{
+	return rb_check_typeddata( self, &rant_future_datatype_t );
+}
+
+
+/*
+ * Return the event that resolved the +future+, or 0 if it's still pending.
+ */
+static unsigned char
+rant_future_result( rant_future_t *future )
+{
+	unsigned char result;
+
+	pthread_mutex_lock( &future->mutex );
+	result = future->result;
+	pthread_mutex_unlock( &future->mutex );
+
+	return result;
+}
+
+
+/*
+ * Returns +true+ if the event +result+ means the send succeeded.
+ */
+static bool
+rant_future_result_ok_p( unsigned char result )
+{
+	return result == EVENT_TX || result == EVENT_TRANSFER_TX_COMPLETED;
+}
+
+
+static void *
+rant_future_wait_command( void *ptr )
+{
+	rant_future_wait_t *wait = (rant_future_wait_t *)ptr;
+	rant_future_t *future = wait->future;
+
+	pthread_mutex_lock( &future->mutex );
+	while ( !future->result && !wait->interrupted ) {
+		if ( !wait->timed ) {
+			pthread_cond_wait( &future->cond, &future->mutex );
+		} else if ( pthread_cond_timedwait(&future->cond, &future->mutex, &wait->deadline) == ETIMEDOUT ) {
+			wait->timed_out = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock( &future->mutex );
+
+	return NULL;
+}
+
+
+/*
+ * Unblocking function for a wait for a future; wakes it up so the thread can
+ * handle its interrupts.
+ */
+static void
+rant_future_wait_interrupt( void *ptr )
+{
+	rant_future_wait_t *wait = (rant_future_wait_t *)ptr;
+	rant_future_t *future = wait->future;
+
+	pthread_mutex_lock( &future->mutex );
+	wait->interrupted = true;
+	pthread_cond_broadcast( &future->cond );
+	pthread_mutex_unlock( &future->mutex );
+}
+
+
+/*
+ * Wait up to +timeout+ seconds (forever if it's negative) for the +future+ to
+ * be resolved, without holding the GVL. Returns the event that resolved it, or
+ * 0 if it timed out.
+ */
+unsigned char
+rant_future_wait_for( rant_future_t *future, double timeout )
+{
+	rant_future_wait_t wait = { .future = future, .timed = timeout >= 0 };
+	unsigned char result;
+
+	if ( wait.timed ) {
+		clock_gettime( FUTURE_WAIT_CLOCK, &wait.deadline );
+		wait.deadline.tv_sec += (time_t)timeout;
+		wait.deadline.tv_nsec += (long)( (timeout - (time_t)timeout) * 1e9 );
+		if ( wait.deadline.tv_nsec >= 1000000000L ) {
+			wait.deadline.tv_sec++;
+			wait.deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	// Interrupts that don't raise (or aren't for this thread) just go back to
+	// waiting
+	while ( !(result = rant_future_result(future)) && !wait.timed_out ) {
+		wait.interrupted = false;
+		rb_thread_call_without_gvl( rant_future_wait_command, &wait,
+			rant_future_wait_interrupt, &wait );
+		rb_thread_check_ints();
+	}
+
+	return result;
+}
+
+
+/*
+ * Return the Ruby value for the result of a wait that resolved with the event
+ * +result+.
+ */
+static VALUE
+rant_future_wait_value( unsigned char result )
+{
+	if ( !result ) return Qnil;
+	return rant_future_result_ok_p( result ) ? Qtrue : Qfalse;
+}
+
+
+/*
+ * call-seq:
+ *    future.wait( timeout=nil )   -> true, false, or nil
+ *
+ * Wait up to +timeout+ seconds (forever if it's +nil+) for the send to finish.
+ * Returns +true+ if it was sent, +false+ if it failed, and +nil+ if it was still
+ * pending when the timeout expired. Other threads can run while it waits.
+ *
+ */
+static VALUE
+rant_future_wait( int argc, VALUE *argv, VALUE self )
+{
+	rant_future_t *future = rant_get_future( self );
+	VALUE timeout = Qnil;
+
+	rb_scan_args( argc, argv, "01", &timeout );
+
+	return rant_future_wait_value(
+		rant_future_wait_for(future, NIL_P(timeout) ? -1.0 : NUM2DBL(timeout)) );
+}
+
+
+/*
+ * call-seq:
+ *    future.result   -> integer or nil
+ *
+ * Return the ID of the event the send finished with (e.g.,
+ * Ant::EVENT_TRANSFER_TX_COMPLETED), or +nil+ if it's still pending.
+ *
+ */
+static VALUE
+rant_future_result_id( VALUE self )
+{
+	const unsigned char result = rant_future_result( rant_get_future(self) );
+	return result ? INT2FIX( result ) : Qnil;
+}
+
+
+/*
+ * call-seq:
+ *    future.attempts   -> integer
+ *
+ * Return how many times the data has been sent to the device so far,
+ * including any retries.
+ *
+ */
+static VALUE
+rant_future_attempts( VALUE self )
+{
+	return UINT2NUM( atomic_load(&rant_get_future(self)->attempts) );
+}
+
+
+/*
+ * call-seq:
+ *    future.pending?   -> true or false
+ *
+ * Returns +true+ if the send hasn't finished yet.
+ *
+ */
+static VALUE
+rant_future_pending_p( VALUE self )
+{
+	return rant_future_result( rant_get_future(self) ) ? Qfalse : Qtrue;
+}
+
+
+/*
+ * call-seq:
+ *    future.completed?   -> true or false
+ *
+ * Returns +true+ if the send finished successfully.
+ *
+ */
+static VALUE
+rant_future_completed_p( VALUE self )
+{
+	return rant_future_result_ok_p( rant_future_result(rant_get_future(self)) ) ? Qtrue : Qfalse;
+}
+
+
+/*
+ * call-seq:
+ *    future.failed?   -> true or false
+ *
+ * Returns +true+ if the send finished and failed.
+ *
+ */
+static VALUE
+rant_future_failed_p( VALUE self )
+{
+	const unsigned char result = rant_future_result( rant_get_future(self) );
+	return result && !rant_future_result_ok_p( result ) ? Qtrue : Qfalse;
+}
+
+
+/*
+ * call-seq:
+ *    Ant::Future.wait_all( futures, timeout=nil )   -> true, false, or nil
+ *
+ * Wait up to +timeout+ seconds in total (forever if it's +nil+) for all of
+ * the given +futures+ to finish. Returns +true+ if they were all sent, +false+
+ * if any of them failed, and +nil+ if some were still pending when the timeout
+ * expired.
+ *
+ */
+static VALUE
+rant_future_s_wait_all( int argc, VALUE *argv, VALUE klass )
+{
+	VALUE futures = Qnil, timeout = Qnil, rval = Qtrue;
+	struct timespec start, now;
+	double remaining = -1.0;
+	long i;
+
+	rb_scan_args( argc, argv, "11", &futures, &timeout );
+	futures = rb_Array( futures );
+
+	clock_gettime( CLOCK_MONOTONIC, &start );
+
+	for ( i = 0; i < RARRAY_LEN(futures); i++ ) {
+		rant_future_t *future = rant_get_future( RARRAY_AREF(futures, i) );
+		unsigned char result;
+
+		if ( !NIL_P(timeout) ) {
+			clock_gettime( CLOCK_MONOTONIC, &now );
+			remaining = NUM2DBL( timeout ) - ( (now.tv_sec - start.tv_sec) +
+				(now.tv_nsec - start.tv_nsec) / 1e9 );
+			if ( remaining < 0 ) remaining = 0;
+		}
+
+		result = rant_future_wait_for( future, remaining );
+		if ( !result ) return Qnil;
+		if ( !rant_future_result_ok_p(result) ) rval = Qfalse;
+	}
+
+	RB_GC_GUARD( futures );
+
+	return rval;
+}
+
+
+void
+init_ant_future()
+{
+#ifdef FOR_RDOC
+	rb_cData = rb_define_class( "Data" );
+	rant_mAnt = rb_define_module( "Ant" );
+#endif
+
+	/*
+	 * Document-class: Ant::Future
+	 *
+	 * The eventual outcome of one of the Ant::Channel#send_*_async methods. It's
+	 * resolved as soon as the ANT library's receive thread sees the event that
+	 * finishes the send, so many sends can be started and then waited on
+	 * together with Ant::Future.wait_all.
+	 *
+	 */
+	rant_cAntFuture = rb_define_class_under( rant_mAnt, "Future", rb_cObject );
+	rb_undef_alloc_func( rant_cAntFuture );
+
+	rb_define_singleton_method( rant_cAntFuture, "wait_all", rant_future_s_wait_all, -1 );
+
+	rb_define_method( rant_cAntFuture, "wait", rant_future_wait, -1 );
+	rb_define_method( rant_cAntFuture, "result", rant_future_result_id, 0 );
+	rb_define_method( rant_cAntFuture, "attempts", rant_future_attempts, 0 );
+	rb_define_method( rant_cAntFuture, "pending?", rant_future_pending_p, 0 );
+	rb_define_method( rant_cAntFuture, "completed?", rant_future_completed_p, 0 );
+	rb_define_method( rant_cAntFuture, "failed?", rant_future_failed_p, 0 );
+}
@@ -8,10 +8,111 @@
  */
 
 #include "ant_ext.h"
+#include "ant_message_sizes.h"
+
+// Sizes of the optional fields of a flagged extended message
+#define FLAGGED_RSSI_FIELD_SIZE       3
+#define FLAGGED_TIMESTAMP_FIELD_SIZE  2
 
 VALUE rant_cAntMessage;
 
 
+/*
+ * Return the size of the payload of a message with the given +mesg_id+, or
+ * MESG_MAX_SIZE_VALUE if it's unknown or varies.
+ */
+size_t
+rant_message_size( unsigned char mesg_id )
+{
+	const size_t size = rant_message_sizes[ mesg_id ];
+	return size ? size : MESG_MAX_SIZE_VALUE;
+}
+
+
+/*
+ * Return the size of the +data+ of the channel event +event_id+. Flagged
+ * extended data is sized by the fields its flag byte says follow it.
+ */
+size_t
+rant_event_size( unsigned char event_id, const unsigned char *data )
+{
+	size_t size;
+	unsigned char flags;
+
+	switch ( event_id ) {
+		case EVENT_RX_BROADCAST:
+		case EVENT_RX_ACKNOWLEDGED:
+		case EVENT_RX_BURST_PACKET:
+			return MESG_DATA_SIZE;
+
+		case EVENT_RX_EXT_BROADCAST:
+		case EVENT_RX_EXT_ACKNOWLEDGED:
+		case EVENT_RX_EXT_BURST_PACKET:
+			return MESG_EXT_DATA_SIZE;
+
+		case EVENT_RX_RSSI_BROADCAST:
+		case EVENT_RX_RSSI_ACKNOWLEDGED:
+		case EVENT_RX_RSSI_BURST_PACKET:
+			return MESG_RSSI_DATA_SIZE;
+
+		case EVENT_RX_FLAG_BROADCAST:
+		case EVENT_RX_FLAG_ACKNOWLEDGED:
+		case EVENT_RX_FLAG_BURST_PACKET:
+			size = MESG_DATA_SIZE + MESG_EXT_MESG_BF_SIZE;
+			flags = data[ MESG_DATA_SIZE ];
+
+			if ( flags & ANT_EXT_MESG_BITFIELD_DEVICE_ID )
+				size += ANT_EXT_MESG_DEVICE_ID_FIELD_SIZE;
+			if ( flags & ANT_LIB_CONFIG_MESG_OUT_INC_RSSI )
+				size += FLAGGED_RSSI_FIELD_SIZE;
+			if ( flags & ANT_LIB_CONFIG_MESG_OUT_INC_TIME_STAMP )
+				size += FLAGGED_TIMESTAMP_FIELD_SIZE;
+
+			return size;
+
+		// Everything else is a channel response
+		default:
+			return MESG_RESPONSE_EVENT_SIZE;
+	}
+}
+
+
+/*
+ * call-seq:
+ *    Ant::Message.payload_size( mesg_id )   -> integer
+ *
+ * Return the size of the payload of a message with the given +mesg_id+, or
+ * MESG_MAX_SIZE_VALUE if it's unknown or varies.
+ *
+ */
+static VALUE
+rant_message_s_payload_size( VALUE _class, VALUE mesg_id )
+{
+	return SIZET2NUM( rant_message_size(NUM2CHR( mesg_id )) );
+}
+
+
+/*
+ * call-seq:
+ *    Ant::Message.event_size( event_id, data )   -> integer
+ *
+ * Return the size of the +data+ of a channel event with the given +event_id+,
+ * i.e., the length of the data an +on_event+ callback would be passed.
+ *
+ */
+static VALUE
+rant_message_s_event_size( VALUE _class, VALUE event_id, VALUE data )
+{
+	unsigned char buffer[ MESG_MAX_SIZE ] = { 0 };
+
+	StringValue( data );
+	if ( RSTRING_LEN(data) > MESG_MAX_SIZE ) {
+		rb_raise( rb_eArgError, "event data can't be longer than %d bytes", MESG_MAX_SIZE );
+	}
+	MEMCPY( buffer, RSTRING_PTR(data), char, RSTRING_LEN(data) );
+
+	return SIZET2NUM( rant_event_size(NUM2CHR( event_id ), buffer) );
+}
 
 
 void
@@ -25,6 +126,9 @@ init_ant_message()
 
 	rant_cAntMessage = rb_define_class_under( rant_mAnt, "Message", rb_cObject );
 
+	rb_define_singleton_method( rant_cAntMessage, "payload_size", rant_message_s_payload_size, 1 );
+	rb_define_singleton_method( rant_cAntMessage, "event_size", rant_message_s_event_size, 2 );
+
 #define EXPOSE_CONST( name ) \
 	rb_define_const( rant_cAntMessage, #name, INT2FIX( (name) ) )
 
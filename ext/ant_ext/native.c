@@ -0,0 +1,709 @@
+/*
+ *  native.c - Ant::NativeSink class
+ *  $Id$
+ *
+ *  Authors:
+ *    * Michael Granger <ged@FaerieMUD.org>
+ *
+ */
+
+#include "ant_ext.h"
+
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <limits.h>
+#include <sys/mman.h>
+
+// The most events a ring can hold
+#define MAX_NATIVE_RING_CAPACITY  ( 1U << 20 )
+
+VALUE rant_cAntNativeSink;
+VALUE rant_cAntNativeSinkCounter;
+VALUE rant_cAntNativeSinkWriter;
+VALUE rant_cAntNativeSinkRing;
+
+static void rant_native_sink_mark( void * );
+static void rant_native_sink_free( void * );
+
+
+static const rb_data_type_t rant_native_sink_datatype_t = {
+	.wrap_struct_name = "Ant::NativeSink",
+	.function = {
+		.dmark = rant_native_sink_mark,
+		.dfree = rant_native_sink_free,
+	},
+	.data = NULL,
+	.flags = RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+
+/*
+ * Mark function
+ */
+static void
+rant_native_sink_mark( void *ptr )
+{
+	rant_native_sink_t *sink = (rant_native_sink_t *)ptr;
+	rb_gc_mark( sink->io );
+}
+
+
+/*
+ * Free function
+ */
+static void
+rant_native_sink_free( void *ptr )
+{
+	rant_native_sink_t *sink = (rant_native_sink_t *)ptr;
+
+	if ( !sink ) return;
+	if ( sink->release ) sink->release( sink );
+	xfree( sink );
+}
+
+
+/*
+ * Alloc function
+ */
+static VALUE
+rant_native_sink_alloc( VALUE klass )
+{
+	rant_native_sink_t *ptr;
+
+	VALUE rval = TypedData_Make_Struct( klass, rant_native_sink_t, &rant_native_sink_datatype_t, ptr );
+	ptr->handler = NULL;
+	ptr->arg = NULL;
+	ptr->io = Qnil;
+	ptr->fd = -1;
+	ptr->release = NULL;
+	atomic_init( &ptr->events, 0 );
+	atomic_init( &ptr->bytes, 0 );
+	atomic_init( &ptr->errors, 0 );
+
+	return rval;
+}
+
+
+/*
+ * Fetch the data pointer and check it for sanity.
+ */
+rant_native_sink_t *
+rant_get_native_sink( VALUE self )
+{
+	rant_native_sink_t *ptr = rb_check_typeddata( self, &rant_native_sink_datatype_t );
+
+	if ( !ptr->handler ) {
+		rb_raise( rb_eRuntimeError, "uninitialized native sink" );
+	}
+
+	return ptr;
+}
+
+
+/*
+ * Native handler for Ant::NativeSink::Counter.
+ */
+static void
+rant_native_sink_count( unsigned char channel, unsigned char event_id, const unsigned char *data,
+	size_t length, void *arg )
+{
+	rant_native_sink_t *sink = (rant_native_sink_t *)arg;
+
+	atomic_fetch_add_explicit( &sink->events, 1, memory_order_relaxed );
+	atomic_fetch_add_explicit( &sink->bytes, length, memory_order_relaxed );
+}
+
+
+/*
+ * Native handler for Ant::NativeSink::Writer.
+ */
+static void
+rant_native_sink_write( unsigned char channel, unsigned char event_id, const unsigned char *data,
+	size_t length, void *arg )
+{
+	rant_native_sink_t *sink = (rant_native_sink_t *)arg;
+	unsigned char record[ 3 + MESG_MAX_SIZE ];
+	size_t record_len;
+	ssize_t rval;
+
+	if ( length > MESG_MAX_SIZE ) length = MESG_MAX_SIZE;
+
+	record[0] = channel;
+	record[1] = event_id;
+	record[2] = (unsigned char)length;
+	memcpy( record + 3, data, length );
+	record_len = 3 + length;
+
+	do {
+		rval = write( sink->fd, record, record_len );
+	} while ( rval < 0 && errno == EINTR );
+
+	if ( rval == (ssize_t)record_len ) {
+		atomic_fetch_add_explicit( &sink->events, 1, memory_order_relaxed );
+		atomic_fetch_add_explicit( &sink->bytes, record_len, memory_order_relaxed );
+	} else {
+		atomic_fetch_add_explicit( &sink->errors, 1, memory_order_relaxed );
+	}
+}
+
+
+/*
+ * Returns +true+ if there aren't any events in the +ring+.
+ */
+static inline bool
+rant_native_ring_empty_p( rant_native_ring_t *ring )
+{
+	return atomic_load( &ring->head ) == atomic_load( &ring->tail );
+}
+
+
+/*
+ * Add an event to the end of the +ring+, and wake up the consumer if it's
+ * waiting for one. Returns +false+ (and counts the event as dropped) if the ring
+ * is full. Only one thread (in one process) may push at a time.
+ */
+static bool
+rant_native_ring_push( rant_native_ring_t *ring, unsigned char channel, unsigned char event_id,
+	const unsigned char *data, size_t length )
+{
+	const unsigned int tail = atomic_load_explicit( &ring->tail, memory_order_relaxed );
+	const unsigned int head = atomic_load_explicit( &ring->head, memory_order_acquire );
+	const unsigned char one = 1;
+	rant_native_ring_record_t *record;
+	ssize_t rval;
+
+	if ( tail - head >= ring->capacity ) {
+		atomic_fetch_add_explicit( &ring->dropped, 1, memory_order_relaxed );
+		return false;
+	}
+
+	if ( length > MESG_MAX_SIZE ) length = MESG_MAX_SIZE;
+
+	record = &ring->records[ tail & (ring->capacity - 1) ];
+	record->channel = channel;
+	record->event_id = event_id;
+	record->length = (unsigned char)length;
+	memcpy( record->data, data, length );
+
+	atomic_store( &ring->tail, tail + 1 );
+
+	if ( atomic_load(&ring->waiting) && atomic_exchange(&ring->waiting, false) ) {
+		do {
+			rval = write( ring->wake_write_fd, &one, sizeof(one) );
+		} while ( rval < 0 && errno == EINTR );
+	}
+
+	return true;
+}
+
+
+/*
+ * Native handler for Ant::NativeSink::Ring.
+ */
+static void
+rant_native_sink_push( unsigned char channel, unsigned char event_id, const unsigned char *data,
+	size_t length, void *arg )
+{
+	rant_native_ring_push( (rant_native_ring_t *)arg, channel, event_id, data, length );
+}
+
+
+/*
+ * Release function for Ant::NativeSink::Ring; unmaps the sink's ring (in this
+ * process) and closes its wake pipe.
+ */
+static void
+rant_native_ring_release( rant_native_sink_t *sink )
+{
+	rant_native_ring_t *ring = (rant_native_ring_t *)sink->arg;
+
+	if ( !ring ) return;
+
+	close( ring->wake_read_fd );
+	close( ring->wake_write_fd );
+	munmap( ring, ring->mapped_size );
+	sink->arg = NULL;
+}
+
+
+/*
+ * Fetch the ring of an Ant::NativeSink::Ring.
+ */
+static rant_native_ring_t *
+rant_get_native_ring( VALUE self )
+{
+	rant_native_sink_t *ptr = rant_get_native_sink( self );
+	return (rant_native_ring_t *)ptr->arg;
+}
+
+
+/*
+ * call-seq:
+ *    Ant::NativeSink.new( handler_address, arg_address=0 )   -> sink
+ *
+ * Create a sink that calls the native handler function at +handler_address+
+ * (a function with the signature in ant_native.h) with the pointer at
+ * +arg_address+ for every event on the channels it's added to. The addresses
+ * can be Integers or anything with a #to_i that returns one, such as a
+ * Fiddle::Pointer.
+ *
+ */
+static VALUE
+rant_native_sink_init( int argc, VALUE *argv, VALUE self )
+{
+	rant_native_sink_t *ptr = rb_check_typeddata( self, &rant_native_sink_datatype_t );
+	VALUE handler_address, arg_address;
+
+	rb_scan_args( argc, argv, "11", &handler_address, &arg_address );
+
+	ptr->handler = (rant_native_handler_t)(uintptr_t)NUM2ULL( rb_Integer(handler_address) );
+	if ( !RTEST(arg_address) ) {
+		ptr->arg = NULL;
+	} else {
+		ptr->arg = (void *)(uintptr_t)NUM2ULL( rb_Integer(arg_address) );
+	}
+
+	if ( !ptr->handler ) {
+		rb_raise( rb_eArgError, "handler address can't be NULL" );
+	}
+
+	return self;
+}
+
+
+/*
+ * call-seq:
+ *    Ant::NativeSink::Counter.new   -> sink
+ *
+ * Create a sink that counts events and their bytes.
+ *
+ */
+static VALUE
+rant_native_sink_counter_init( VALUE self )
+{
+	rant_native_sink_t *ptr = rb_check_typeddata( self, &rant_native_sink_datatype_t );
+
+	ptr->handler = rant_native_sink_count;
+	ptr->arg = ptr;
+
+	return self;
+}
+
+
+/*
+ * call-seq:
+ *    Ant::NativeSink::Writer.new( io )   -> sink
+ *
+ * Create a sink that writes each event to the file descriptor of the given
+ * +io+ as a record made up of the channel number, the event ID, and the length
+ * of the data (one byte each), followed by the data itself. The descriptor is
+ * written to directly with write(2), bypassing the IO's buffering, so if it's
+ * a pipe or socket it should be a blocking one that can keep up.
+ *
+ */
+static VALUE
+rant_native_sink_writer_init( VALUE self, VALUE io )
+{
+	rant_native_sink_t *ptr = rb_check_typeddata( self, &rant_native_sink_datatype_t );
+
+	ptr->fd = NUM2INT( rb_funcall(io, rb_intern("fileno"), 0) );
+	ptr->io = io;
+	ptr->handler = rant_native_sink_write;
+	ptr->arg = ptr;
+
+	return self;
+}
+
+
+/*
+ * call-seq:
+ *    Ant::NativeSink::Ring.new( capacity=1024 )   -> sink
+ *
+ * Create a sink that adds each event to a ring of up to +capacity+ events
+ * (rounded up to a power of two) in shared memory, so a process forked after
+ * it's created can read the events of the channels it's added to in this
+ * one, or the other way around. Events that arrive while the ring is full are
+ * dropped and counted in #dropped.
+ *
+ * Only one process should add events, and only one should read them.
+ *
+ */
+static VALUE
+rant_native_sink_ring_init( int argc, VALUE *argv, VALUE self )
+{
+	rant_native_sink_t *ptr = rb_check_typeddata( self, &rant_native_sink_datatype_t );
+	VALUE capacity_arg = Qnil;
+	unsigned int requested = DEFAULT_NATIVE_RING_CAPACITY, capacity = 1;
+	rant_native_ring_t *ring;
+	size_t mapped_size;
+	int fds[ 2 ];
+
+	rb_scan_args( argc, argv, "01", &capacity_arg );
+
+	if ( ptr->handler ) {
+		rb_raise( rb_eRuntimeError, "native sink is already initialized" );
+	}
+
+	if ( !NIL_P(capacity_arg) ) requested = NUM2UINT( capacity_arg );
+	if ( requested < 1 || requested > MAX_NATIVE_RING_CAPACITY ) {
+		rb_raise( rb_eArgError, "ring capacity must be between 1 and %u", MAX_NATIVE_RING_CAPACITY );
+	}
+	while ( capacity < requested ) capacity <<= 1;
+
+	mapped_size = sizeof( rant_native_ring_t ) + capacity * sizeof( rant_native_ring_record_t );
+	ring = mmap( NULL, mapped_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0 );
+	if ( ring == MAP_FAILED ) rb_sys_fail( "mmap" );
+
+	if ( pipe(fds) < 0 ) {
+		munmap( ring, mapped_size );
+		rb_sys_fail( "pipe" );
+	}
+	rb_update_max_fd( fds[0] );
+	rb_update_max_fd( fds[1] );
+	fcntl( fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK );
+	fcntl( fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK );
+	rb_fd_fix_cloexec( fds[0] );
+	rb_fd_fix_cloexec( fds[1] );
+
+	atomic_init( &ring->head, 0 );
+	atomic_init( &ring->tail, 0 );
+	atomic_init( &ring->waiting, false );
+	atomic_init( &ring->dropped, 0 );
+	ring->capacity = capacity;
+	ring->mapped_size = mapped_size;
+	ring->wake_read_fd = fds[0];
+	ring->wake_write_fd = fds[1];
+
+	ptr->handler = rant_native_sink_push;
+	ptr->arg = ring;
+	ptr->release = rant_native_ring_release;
+
+	return self;
+}
+
+
+/*
+ * call-seq:
+ *    ring.push( channel_num, event_id, data )   -> true or false
+ *
+ * Add an event to the ring as if it had arrived on the channel +channel_num+.
+ * Returns +false+ if the ring is full.
+ *
+ */
+static VALUE
+rant_native_sink_ring_push( VALUE self, VALUE channel_num, VALUE event_id, VALUE data )
+{
+	rant_native_ring_t *ring = rant_get_native_ring( self );
+
+	StringValue( data );
+	if ( RSTRING_LEN(data) > MESG_MAX_SIZE ) {
+		rb_raise( rb_eArgError, "event data can't be longer than %d bytes", MESG_MAX_SIZE );
+	}
+
+	return rant_native_ring_push( ring, NUM2CHR(channel_num), NUM2CHR(event_id),
+		(unsigned char *)RSTRING_PTR(data), RSTRING_LEN(data) ) ? Qtrue : Qfalse;
+}
+
+
+/*
+ * call-seq:
+ *    ring.shift   -> [ channel_num, event_id, data ] or nil
+ *
+ * Take the oldest event out of the ring and return it, or +nil+ if the ring is
+ * empty.
+ *
+ */
+static VALUE
+rant_native_sink_ring_shift( VALUE self )
+{
+	rant_native_ring_t *ring = rant_get_native_ring( self );
+	const unsigned int head = atomic_load_explicit( &ring->head, memory_order_relaxed );
+	const unsigned int tail = atomic_load_explicit( &ring->tail, memory_order_acquire );
+	rant_native_ring_record_t *record;
+	VALUE rval;
+
+	if ( head == tail ) return Qnil;
+
+	record = &ring->records[ head & (ring->capacity - 1) ];
+	rval = rb_ary_new_from_args( 3,
+		INT2FIX(record->channel),
+		INT2FIX(record->event_id),
+		rb_enc_str_new((char *)record->data, record->length, rb_ascii8bit_encoding()) );
+
+	atomic_store_explicit( &ring->head, head + 1, memory_order_release );
+
+	return rval;
+}
+
+
+/*
+ * The arguments to a wait for events, so it can be run without the GVL.
+ */
+typedef struct rant_native_ring_wait_t rant_native_ring_wait_t;
+struct rant_native_ring_wait_t {
+	rant_native_ring_t *ring;
+	int timeout;
+};
+
+
+static void *
+rant_native_ring_wait_command( void *ptr )
+{
+	rant_native_ring_wait_t *wait = (rant_native_ring_wait_t *)ptr;
+	rant_native_ring_t *ring = wait->ring;
+	struct pollfd pfd = { .fd = ring->wake_read_fd, .events = POLLIN };
+	unsigned char buf[ 64 ];
+
+	atomic_store( &ring->waiting, true );
+	if ( rant_native_ring_empty_p(ring) ) poll( &pfd, 1, wait->timeout );
+	atomic_store( &ring->waiting, false );
+
+	// Drain the wake pipe so the next wait doesn't return right away
+	while ( read(ring->wake_read_fd, buf, sizeof(buf)) > 0 )
+		;
+
+	return NULL;
+}
+
+
+/*
+ * Unblocking function for a wait for events; wakes it up so the thread can
+ * handle its interrupts.
+ */
+static void
+rant_native_ring_wait_interrupt( void *ptr )
+{
+	rant_native_ring_wait_t *wait = (rant_native_ring_wait_t *)ptr;
+	const unsigned char one = 1;
+	ssize_t rval;
+
+	rval = write( wait->ring->wake_write_fd, &one, sizeof(one) );
+	(void)rval;
+}
+
+
+/*
+ * call-seq:
+ *    ring.wait( timeout=nil )   -> true or false
+ *
+ * Wait up to +timeout+ seconds (forever if it's +nil+) for the ring to have at
+ * least one event in it. Returns +false+ if it's still empty when the timeout
+ * expires. Other threads can run while it waits.
+ *
+ */
+static VALUE
+rant_native_sink_ring_wait( int argc, VALUE *argv, VALUE self )
+{
+	rant_native_ring_t *ring = rant_get_native_ring( self );
+	rant_native_ring_wait_t wait = { .ring = ring };
+	VALUE timeout_arg = Qnil;
+	double timeout = -1.0, remaining;
+	struct timespec start, now;
+
+	rb_scan_args( argc, argv, "01", &timeout_arg );
+	if ( !NIL_P(timeout_arg) ) timeout = NUM2DBL( timeout_arg );
+
+	clock_gettime( CLOCK_MONOTONIC, &start );
+
+	// Interrupts that don't raise (or aren't for this thread) just go back to
+	// waiting for whatever's left of the timeout
+	while ( rant_native_ring_empty_p(ring) ) {
+		wait.timeout = -1;
+
+		if ( timeout >= 0 ) {
+			clock_gettime( CLOCK_MONOTONIC, &now );
+			remaining = timeout - ( (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9 );
+			if ( remaining <= 0 ) return Qfalse;
+			wait.timeout = remaining * 1000 < INT_MAX ? (int)( remaining * 1000 ) + 1 : INT_MAX;
+		}
+
+		rb_thread_call_without_gvl( rant_native_ring_wait_command, &wait,
+			rant_native_ring_wait_interrupt, &wait );
+		rb_thread_check_ints();
+	}
+
+	return Qtrue;
+}
+
+
+/*
+ * call-seq:
+ *    ring.length   -> integer
+ *
+ * Return the number of events waiting in the ring.
+ *
+ */
+static VALUE
+rant_native_sink_ring_length( VALUE self )
+{
+	rant_native_ring_t *ring = rant_get_native_ring( self );
+	return UINT2NUM( atomic_load(&ring->tail) - atomic_load(&ring->head) );
+}
+
+
+/*
+ * call-seq:
+ *    ring.capacity   -> integer
+ *
+ * Return the number of events the ring can hold.
+ *
+ */
+static VALUE
+rant_native_sink_ring_capacity( VALUE self )
+{
+	rant_native_ring_t *ring = rant_get_native_ring( self );
+	return UINT2NUM( ring->capacity );
+}
+
+
+/*
+ * call-seq:
+ *    ring.dropped   -> integer
+ *
+ * Return the number of events that were dropped because the ring was full, in
+ * any process.
+ *
+ */
+static VALUE
+rant_native_sink_ring_dropped( VALUE self )
+{
+	rant_native_ring_t *ring = rant_get_native_ring( self );
+	return ULL2NUM( atomic_load(&ring->dropped) );
+}
+
+
+/*
+ * call-seq:
+ *    sink.events   -> integer
+ *
+ * Return the number of events the sink has handled.
+ *
+ */
+static VALUE
+rant_native_sink_events( VALUE self )
+{
+	rant_native_sink_t *ptr = rant_get_native_sink( self );
+	return ULL2NUM( atomic_load(&ptr->events) );
+}
+
+
+/*
+ * call-seq:
+ *    sink.bytes   -> integer
+ *
+ * Return the number of bytes the sink has handled.
+ *
+ */
+static VALUE
+rant_native_sink_bytes( VALUE self )
+{
+	rant_native_sink_t *ptr = rant_get_native_sink( self );
+	return ULL2NUM( atomic_load(&ptr->bytes) );
+}
+
+
+/*
+ * call-seq:
+ *    sink.errors   -> integer
+ *
+ * Return the number of events the sink failed to write.
+ *
+ */
+static VALUE
+rant_native_sink_errors( VALUE self )
+{
+	rant_native_sink_t *ptr = rant_get_native_sink( self );
+	return ULL2NUM( atomic_load(&ptr->errors) );
+}
+
+
+/*
+ * call-seq:
+ *    sink.reset
+ *
+ * Reset the sink's counters to zero.
+ *
+ */
+static VALUE
+rant_native_sink_reset( VALUE self )
+{
+	rant_native_sink_t *ptr = rant_get_native_sink( self );
+
+	atomic_store( &ptr->events, 0 );
+	atomic_store( &ptr->bytes, 0 );
+	atomic_store( &ptr->errors, 0 );
+
+	return self;
+}
+
+
+void
+init_ant_native()
+{
+#ifdef FOR_RDOC
+	rb_cData = rb_define_class( "Data" );
+	rant_mAnt = rb_define_module( "Ant" );
+#endif
+
+	/*
+	 * Document-class: Ant::NativeSink
+	 *
+	 * A handler for channel events that runs in native code as soon as each event
+	 * arrives, without waiting on the GVL, so it keeps up with the radio even if
+	 * Ruby can't. Sinks are added to a channel with
+	 * Ant::Channel#add_native_sink, and run in addition to any Ruby event
+	 * callback.
+	 *
+	 */
+	rant_cAntNativeSink = rb_define_class_under( rant_mAnt, "NativeSink", rb_cObject );
+	rb_define_alloc_func( rant_cAntNativeSink, rant_native_sink_alloc );
+	rb_define_method( rant_cAntNativeSink, "initialize", rant_native_sink_init, -1 );
+
+	/*
+	 * Document-class: Ant::NativeSink::Counter
+	 *
+	 * A native sink that counts the events on its channels.
+	 *
+	 */
+	rant_cAntNativeSinkCounter = rb_define_class_under( rant_cAntNativeSink, "Counter",
+		rant_cAntNativeSink );
+	rb_define_method( rant_cAntNativeSinkCounter, "initialize", rant_native_sink_counter_init, 0 );
+	rb_define_method( rant_cAntNativeSinkCounter, "events", rant_native_sink_events, 0 );
+	rb_define_method( rant_cAntNativeSinkCounter, "bytes", rant_native_sink_bytes, 0 );
+	rb_define_method( rant_cAntNativeSinkCounter, "reset", rant_native_sink_reset, 0 );
+
+	/*
+	 * Document-class: Ant::NativeSink::Writer
+	 *
+	 * A native sink that writes the raw events on its channels to a file
+	 * descriptor.
+	 *
+	 */
+	rant_cAntNativeSinkWriter = rb_define_class_under( rant_cAntNativeSink, "Writer",
+		rant_cAntNativeSink );
+	rb_define_method( rant_cAntNativeSinkWriter, "initialize", rant_native_sink_writer_init, 1 );
+	rb_define_method( rant_cAntNativeSinkWriter, "records", rant_native_sink_events, 0 );
+	rb_define_method( rant_cAntNativeSinkWriter, "bytes", rant_native_sink_bytes, 0 );
+	rb_define_method( rant_cAntNativeSinkWriter, "errors", rant_native_sink_errors, 0 );
+	rb_define_method( rant_cAntNativeSinkWriter, "reset", rant_native_sink_reset, 0 );
+
+	/*
+	 * Document-class: Ant::NativeSink::Ring
+	 *
+	 * A native sink that adds the events on its channels to a lock-free ring
+	 * in shared memory, for reading from another process. Ant::Cluster uses
+	 * them to forward events from its worker processes.
+	 *
+	 */
+	rant_cAntNativeSinkRing = rb_define_class_under( rant_cAntNativeSink, "Ring",
+		rant_cAntNativeSink );
+	rb_define_method( rant_cAntNativeSinkRing, "initialize", rant_native_sink_ring_init, -1 );
+	rb_define_method( rant_cAntNativeSinkRing, "push", rant_native_sink_ring_push, 3 );
+	rb_define_method( rant_cAntNativeSinkRing, "shift", rant_native_sink_ring_shift, 0 );
+	rb_define_method( rant_cAntNativeSinkRing, "wait", rant_native_sink_ring_wait, -1 );
+	rb_define_method( rant_cAntNativeSinkRing, "length", rant_native_sink_ring_length, 0 );
+	rb_define_method( rant_cAntNativeSinkRing, "capacity", rant_native_sink_ring_capacity, 0 );
+	rb_define_method( rant_cAntNativeSinkRing, "dropped", rant_native_sink_ring_dropped, 0 );
+}
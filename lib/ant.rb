@@ -1,6 +1,7 @@
 # -*- ruby -*-
 # frozen_string_literal: true
 
+require 'io/wait'
 require 'loggability'
 
 require_relative 'ant_ext'
@@ -35,12 +36,48 @@ module Ant
 	}
 
 
+	# How long Ant.configure_channels waits for the device's responses to each
+	# step, in seconds
+	DEFAULT_CHANNEL_CONFIG_TIMEOUT = 0.5
+
+	# The settings a channel spec passed to Ant.configure_channels can have
+	CHANNEL_SPEC_KEYS = %i[
+		channel
+		channel_type
+		network_number
+		extended_options
+		device_number
+		device_type
+		transmission_type
+		period
+		search_timeout
+		rf_frequency
+		open
+	].freeze
+
+
+	# The outcome of configuring one of the channels passed to
+	# Ant.configure_channels: the Ant::Channel if it was assigned, and the step
+	# that failed and the device's response code for it if one did. The response
+	# code is +nil+ if the device didn't respond in time.
+	ChannelConfiguration = Struct.new( :spec, :channel, :failed_step, :response_code ) do
+
+		### Returns +true+ if every step of the channel's configuration succeeded.
+		def ok?
+			return self.failed_step.nil?
+		end
+
+	end
+
+
 	# Loggability API -- set up a logger for the library
 	log_as :ant
 
 
 	autoload :ResponseCallbacks, 'ant/response_callbacks'
 	autoload :DataUtilities, 'ant/mixins'
+	autoload :Cluster, 'ant/cluster'
+	autoload :ChannelPool, 'ant/channel_pool'
 
 
 	# Capabilities hash -- set asynchronously by calling Ant.request_capabilities
@@ -56,6 +93,24 @@ module Ant
 	@hardware_version = nil
 	singleton_class.attr_reader( :hardware_version )
 
+	# Advanced burst capabilities -- set asynchronously by calling
+	# Ant.request_advanced_burst_capabilities
+	@advanced_burst_capabilities = nil
+	singleton_class.attr_reader( :advanced_burst_capabilities )
+
+	# Advanced burst configuration -- set asynchronously when the device reports it
+	@advanced_burst_config = nil
+	singleton_class.attr_reader( :advanced_burst_config )
+
+	# The number of packets advanced burst transfers send per serial message, or
+	# +nil+ if advanced burst isn't in use -- set by Ant.negotiate_advanced_burst
+	@advanced_burst_packets = nil
+	singleton_class.attr_reader( :advanced_burst_packets )
+
+	# The Ant::ChannelPool for the current device -- set up by Ant.channel_pool,
+	# and cleared when the device is closed or reset
+	@channel_pool = nil
+
 	# Add some convenience aliases
 	singleton_class.alias_method( :is_initialized?, :initialized? )
 
@@ -152,14 +207,130 @@ module Ant
 	end
 
 
+	### Return the Ant::ChannelPool for the current device, creating it if it
+	### doesn't exist yet. It's sized from the device's +max_channels+ capability,
+	### which is requested (waiting up to +timeout+ seconds for it) if it isn't
+	### already known. The +options+ are passed to Ant::ChannelPool.new, or set on
+	### the existing pool if there already is one.
+	def self::channel_pool( timeout: 2.0, **options )
+		if @channel_pool
+			@channel_pool.recycle_idle = options.delete( :recycle_idle ) if options.key?( :recycle_idle )
+			raise ArgumentError, "unknown channel pool options: %p" % [ options.keys ] unless options.empty?
+			return @channel_pool
+		end
+
+		caps = self.capabilities || ( self.request_capabilities &&
+			self.wait_for_response(timeout) { self.capabilities } ) or
+			raise "couldn't get the device's capabilities to size the channel pool"
+
+		return @channel_pool = Ant::ChannelPool.new( caps[:max_channels], **options )
+	end
+
+
+	### Assign, configure, and open a channel for each of the given +specs+ at
+	### once. Each spec is a Hash with the <tt>:channel</tt> number and
+	### <tt>:channel_type</tt> to assign, and any of the other CHANNEL_SPEC_KEYS;
+	### the channel is opened unless <tt>open: false</tt> is given. Rather than
+	### waiting for the device's response to every command in turn, each step is
+	### sent for all of the channels before waiting up to +timeout+ seconds for
+	### the responses to it, so bringing up a whole device takes about as long as
+	### one channel. Returns an Ant::ChannelConfiguration for each spec, in order;
+	### channels that were assigned but failed a later step are left assigned.
+	def self::configure_channels( specs, timeout: DEFAULT_CHANNEL_CONFIG_TIMEOUT )
+		specs = specs.map {|spec| self.validate_channel_spec(spec) }
+
+		numbers = specs.map {|spec| spec[:channel] }
+		raise ArgumentError, "duplicate channel numbers in %p" % [ numbers ] unless
+			numbers.uniq.length == numbers.length
+
+		results = self.pipeline_channel_config( specs, (timeout * 1000).round )
+
+		return specs.zip( results ).map do |spec, (channel, failed_step, code)|
+			ChannelConfiguration.new( spec, channel, failed_step, code )
+		end
+	end
+
+
+	### Check that the specified channel +spec+ for Ant.configure_channels is
+	### valid and raise an appropriate exception if it isn't. Returns a copy of it
+	### with the defaults filled in if it is valid.
+	def self::validate_channel_spec( spec )
+		spec = spec.to_h.transform_keys( &:to_sym )
+
+		unknown = spec.keys - CHANNEL_SPEC_KEYS
+		raise ArgumentError, "unknown channel settings %p" % [ unknown ] unless unknown.empty?
+		raise ArgumentError, "channel spec %p doesn't have a channel number and type" % [ spec ] unless
+			spec[:channel] && spec[:channel_type]
+
+		spec[:open] = true unless spec.key?( :open )
+		spec[:channel] = self.validate_byte( spec[:channel], "channel number", 0..31 )
+		spec[:channel_type] = self.validate_byte( spec[:channel_type], "channel type" )
+		spec[:network_number] = self.validate_network_number( spec[:network_number] || 0 )
+		spec[:extended_options] = self.validate_byte( spec[:extended_options] || 0, "extended options" )
+
+		if spec.key?( :device_number ) || spec.key?( :device_type ) || spec.key?( :transmission_type )
+			spec[:device_number] = self.validate_device_number( spec[:device_number] || 0 )
+			spec[:device_type] = self.validate_byte( spec[:device_type] || 0, "device type" )
+			spec[:transmission_type] = self.validate_byte( spec[:transmission_type] || 0, "transmission type" )
+		end
+
+		spec[:period] = self.validate_channel_period( spec[:period] ) if spec[:period]
+		spec[:search_timeout] = self.validate_byte( spec[:search_timeout], "search timeout" ) if
+			spec[:search_timeout]
+		spec[:rf_frequency] = self.validate_rf_frequency( spec[:rf_frequency] ) if spec[:rf_frequency]
+
+		return spec
+	end
+
+
+	### Check that the specified +value+ of the setting called +description+ is in
+	### the given +range+ and raise an appropriate exception if it isn't. Returns
+	### the value as an Integer if it is valid.
+	def self::validate_byte( value, description, range=0..255 )
+		value = Integer( value )
+		unless range.include?( value )
+			raise RangeError, "invalid %s; expected a number between %d and %d, got %p" %
+				[ description, range.begin, range.end, value ]
+		end
+
+		return value
+	end
+
+
+	### Wait up to +timeout+ seconds (forever if +timeout+ is +nil+) for ANT
+	### callbacks to be queued, then run up to +max+ of them in the current thread.
+	### Returns the number of callbacks that were run. Under a fiber scheduler,
+	### only the current fiber waits.
+	def self::dispatch_events( timeout=nil, max: nil )
+		return 0 unless self.event_io.wait_readable( timeout )
+		return self.read_events( max )
+	end
+
+
+	### Set which fields the device includes with each received message as flagged
+	### extended data, leaving the rest of the lib config as it is.
+	def self::include_extended_data( device_id: true, rssi: false, timestamp: false )
+		fields = 0
+		fields |= Ant::ANT_LIB_CONFIG_MESG_OUT_INC_DEVICE_ID if device_id
+		fields |= Ant::ANT_LIB_CONFIG_MESG_OUT_INC_RSSI if rssi
+		fields |= Ant::ANT_LIB_CONFIG_MESG_OUT_INC_TIME_STAMP if timestamp
+
+		mask = Ant::ANT_LIB_CONFIG_MESG_OUT_INC_DEVICE_ID |
+			Ant::ANT_LIB_CONFIG_MESG_OUT_INC_RSSI |
+			Ant::ANT_LIB_CONFIG_MESG_OUT_INC_TIME_STAMP
+
+		self.lib_config = ( self.lib_config & ~mask ) | fields
+	end
+
+
 	### Enable advanced burst mode with the given +options+.
 	def self::enable_advanced_burst( **options )
 		options = DEFAULT_ADVANCED_OPTIONS.merge( options )
 
 		max_packet_length = self.convert_max_packet_length( options[:max_packet_length] )
 
-		required_fields = self.make_required_fields_config( options )
-		optional_fields = self.make_optional_fields_config( options )
+		required_fields = self.make_required_fields_config( **options )
+		optional_fields = self.make_optional_fields_config( **options )
 
 		stall_count = options[:stall_count]
 		retry_count = options[:retry_count]
@@ -169,6 +340,60 @@ module Ant
 	end
 
 
+	### Ask the device what advanced burst settings it supports, and enable advanced
+	### burst with the largest packets it can send, along with any other +options+
+	### (see DEFAULT_ADVANCED_OPTIONS). Waits up to +timeout+ seconds for the
+	### device's reply. Returns the max packet length that was enabled, or +nil+ if
+	### the device doesn't support advanced burst, in which case Channel#send_burst
+	### sends standard burst transfers instead.
+	def self::negotiate_advanced_burst( timeout: 2.0, **options )
+		@advanced_burst_capabilities = nil
+		@advanced_burst_packets = nil
+
+		self.request_advanced_burst_capabilities or return nil
+		caps = self.wait_for_response( timeout ) { self.advanced_burst_capabilities }
+
+		unless caps && [ 8, 16, 24 ].include?( caps[:max_packet_length] )
+			self.log.info "Advanced burst isn't supported; using standard burst transfers."
+			return nil
+		end
+
+		options[:max_packet_length] = caps[:max_packet_length]
+		options[:frequency_hopping] = nil unless caps[:frequency_hopping]
+
+		unless self.enable_advanced_burst( **options )
+			self.log.warn "Couldn't enable advanced burst; using standard burst transfers."
+			return nil
+		end
+
+		@advanced_burst_packets = caps[:max_packet_length] / 8
+		self.log.info "Enabled advanced burst with %d-byte packets." % [ caps[:max_packet_length] ]
+
+		return caps[:max_packet_length]
+	end
+
+
+	### Wait up to +timeout+ seconds for the block to return a true value, running
+	### callbacks in the current thread while waiting if there aren't any callback
+	### workers to run them. Returns the block's value, or +nil+ if it timed out.
+	def self::wait_for_response( timeout )
+		deadline = Process.clock_gettime( Process::CLOCK_MONOTONIC ) + timeout
+
+		until ( result = yield )
+			remaining = deadline - Process.clock_gettime( Process::CLOCK_MONOTONIC )
+			return nil unless remaining.positive?
+
+			if self.callback_workers.zero?
+				self.dispatch_events( [remaining, 0.1].min )
+			else
+				sleep( [remaining, 0.01].min )
+			end
+		end
+
+		return result
+	end
+
+
 	### Validate that the specified +length+ (in bytes) is a valid setting as an
 	### advanced burst max packet length configuration value. Returns the equivalent
 	### configuration value.
@@ -16,6 +16,9 @@ class Ant::Channel
 	# The default channel options
 	DEFAULT_EXTENDED_OPTIONS = 0x0
 
+	# The default number of bytes #stream_burst reads from its source at a time
+	DEFAULT_STREAM_CHUNK_SIZE = 512
+
 
 	#
 	# Autoloads
@@ -34,7 +37,8 @@ class Ant::Channel
 
 	##
 	# :singleton-method: registry
-	# Channel registry, keyed by channel number.
+	# Channel registry, keyed by channel number. Ant::Channel[] looks channels up
+	# without going through it.
 	singleton_class.attr_reader( :registry )
 
 
@@ -88,6 +92,96 @@ class Ant::Channel
 	end
 
 
+	### Send the given +data+ as a burst transfer in the fastest mode the device
+	### supports: an advanced burst if Ant.negotiate_advanced_burst enabled it, or a
+	### standard burst otherwise. Returns the rate the data was sent at, in bytes
+	### per second, timed until the device reports the whole transfer was sent, and
+	### raises a RuntimeError if it fails.
+	def send_burst( data )
+		start = Process.clock_gettime( Process::CLOCK_MONOTONIC )
+
+		future = if ( packets = Ant.advanced_burst_packets )
+			begin
+				self.send_advanced_transfer_async( data, packets )
+			rescue NotImplementedError
+				self.log.warn "No advanced burst support in the ANT library; using standard burst."
+				self.send_burst_transfer_async( data )
+			end
+		else
+			self.send_burst_transfer_async( data )
+		end
+
+		unless future.wait
+			reason = future.result == Ant::EVENT_CHANNEL_CLOSED ? "the channel closed" : "the transfer failed"
+			raise "burst on channel %d failed: %s" % [ self.channel_number, reason ]
+		end
+
+		elapsed = Process.clock_gettime( Process::CLOCK_MONOTONIC ) - start
+		rate = data.bytesize / elapsed
+		self.log.info "Sent a %d-byte burst at %0.1f bytes/s." % [ data.bytesize, rate ]
+
+		return rate
+	end
+
+
+	### Send the data read from +source+ as a single burst transfer, without
+	### reading all of it into memory first. The +source+ can be an IO (or anything
+	### else that responds to #read), which is read +chunk_size+ bytes at a time, or
+	### an Enumerable that yields Strings. Each chunk is sent as soon as it's read,
+	### and the next one isn't sent until the device is ready for it, so only about
+	### one chunk is held in memory no matter how big the transfer is. Returns the
+	### number of bytes sent once the device reports the transfer is complete, and
+	### raises a RuntimeError if it fails.
+	def stream_burst( source, chunk_size: DEFAULT_STREAM_CHUNK_SIZE )
+		chunk_size = Integer( chunk_size )
+		raise ArgumentError, "chunk size must be a positive multiple of 8" unless
+			chunk_size.positive? && ( chunk_size % 8 ).zero?
+
+		self.start_burst_stream
+		pending = String.new( encoding: Encoding::BINARY )
+		bytes = 0
+
+		self.each_burst_stream_chunk( source, chunk_size ) do |chunk|
+			pending << chunk
+
+			# Hold back the last packet's worth, as it has to be marked as the end of
+			# the transfer if there isn't any more
+			while pending.bytesize > 8
+				length = [ (pending.bytesize - 1) / 8 * 8, chunk_size ].min
+				self.send_burst_stream_chunk( pending.byteslice(0, length), false )
+				pending = pending.byteslice( length..-1 )
+				bytes += length
+			end
+		end
+
+		raise ArgumentError, "no burst data to send" if bytes.zero? && pending.empty?
+		self.send_burst_stream_chunk( pending, true )
+		bytes += pending.bytesize
+
+		self.finish_burst_stream or self.raise_burst_stream_error
+		return bytes
+	end
+
+
+	### Replace the payloads in the channel's broadcast ring with the given
+	### +payloads+ (Strings of up to 8 bytes each), growing the ring if it isn't
+	### big enough to hold all of them. See #push_broadcast_data.
+	def broadcast_ring=( payloads )
+		payloads = Array( payloads )
+
+		self.clear_broadcast_ring
+		self.broadcast_ring_size = payloads.length if payloads.length > self.broadcast_ring_size
+		payloads.each {|payload| self.push_broadcast_data(payload) }
+	end
+
+
+	### Returns +true+ if the channel's broadcasts are being sent from a broadcast
+	### ring.
+	def broadcast_ring?
+		return self.broadcast_ring_size.nonzero? ? true : false
+	end
+
+
 	### Returns +true+ if the channel is not closed.
 	def open?
 		return !self.closed?
@@ -108,6 +202,41 @@ class Ant::Channel
 		]
 	end
 
+	#########
+	protected
+	#########
+
+	### Yield the data from the given burst stream +source+ a chunk at a time.
+	def each_burst_stream_chunk( source, chunk_size )
+		if source.respond_to?( :read )
+			while ( chunk = source.read(chunk_size) )
+				yield chunk.b
+			end
+		else
+			source.each {|chunk| yield chunk.to_str.b }
+		end
+	end
+
+
+	### Send the +data+ for the next part of the burst stream, raising if the
+	### transfer has failed.
+	def send_burst_stream_chunk( data, last )
+		self.send_burst_stream_packets( data, last ) or self.raise_burst_stream_error
+	end
+
+
+	### Raise a RuntimeError describing why the burst stream failed.
+	def raise_burst_stream_error
+		reason = case self.burst_stream_result
+			when Ant::EVENT_TRANSFER_TX_FAILED then "the transfer failed"
+			when Ant::EVENT_CHANNEL_CLOSED then "the channel closed"
+			when nil then "timed out waiting for the device"
+			else "the transfer ended early"
+			end
+
+		raise "burst stream on channel %d failed: %s" % [ self.channel_number, reason ]
+	end
+
 end # class Ant::Channel
 
 
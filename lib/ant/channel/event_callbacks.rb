@@ -77,8 +77,10 @@ module Ant::Channel::EventCallbacks
 
 	### Handle an TX event.
 	def on_event_tx( channel_num, data )
-		channel = Ant::Channel.registry[ channel_num ]
+		channel = Ant::Channel[ channel_num ] or return
 		self.log.debug "%p ready for transmission." % [ channel ]
+		return if channel.broadcast_ring?
+
 		ident = [ 1, 33 ].pack( "CC" )
 		channel.send_broadcast_data( ident )
 	end
@@ -138,63 +140,60 @@ module Ant::Channel::EventCallbacks
 	end
 
 
+	### Handle an RX_FLAG_ACKNOWLEDGED event.
 	def on_event_rx_flag_acknowledged( channel_num, data )
-		flags = data.bytes[ 9 ]
-		if flags & Ant::ANT_EXT_MESG_BITFIELD_DEVICE_ID
-			usDeviceNumber     = data.bytes[10] | (data.bytes[11] << 8)
-			ucDeviceType       = data.bytes[12]
-			ucTransmissionType = data.bytes[13]
-			self.log.debug "Got an acknowledge on Chan ID(%d/%d/%d)" %
-				[usDeviceNumber, ucDeviceType, ucTransmissionType]
-		end
-
+		self.log_extended_data( "an acknowledge", channel_num, Ant::EVENT_RX_FLAG_ACKNOWLEDGED, data )
 		self.on_event_rx_acknowledged( channel_num, data )
 	end
 
 
+	### Handle an RX_FLAG_BURST_PACKET event.
 	def on_event_rx_flag_burst_packet( channel_num, data )
-		flags = data.bytes[ 9 ]
-		if flags & Ant::ANT_EXT_MESG_BITFIELD_DEVICE_ID
-			usDeviceNumber     = data.bytes[10] | (data.bytes[11] << 8)
-			ucDeviceType       = data.bytes[12]
-			ucTransmissionType = data.bytes[13]
-			self.log.debug "Got a burst on Chan ID(%d/%d/%d)" %
-				[usDeviceNumber, ucDeviceType, ucTransmissionType]
-		end
-
+		self.log_extended_data( "a burst", channel_num, Ant::EVENT_RX_FLAG_BURST_PACKET, data )
 		self.on_event_rx_burst_packet( channel_num, data )
 	end
 
 
+	### Handle an RX_FLAG_BROADCAST event.
 	def on_event_rx_flag_broadcast( channel_num, data )
-		flags = data.bytes[ 9 ]
-		if flags & Ant::ANT_EXT_MESG_BITFIELD_DEVICE_ID
-			usDeviceNumber     = data.bytes[10] | (data.bytes[11] << 8)
-			ucDeviceType       = data.bytes[12]
-			ucTransmissionType = data.bytes[13]
-			self.log.debug "Got a broadcast on Chan ID(%d/%d/%d)" %
-				[usDeviceNumber, ucDeviceType, ucTransmissionType]
-		end
-
+		self.log_extended_data( "a broadcast", channel_num, Ant::EVENT_RX_FLAG_BROADCAST, data )
 		self.on_event_rx_broadcast( channel_num, data )
 	end
 
 
+	### Log the channel ID, RSSI, and device timestamp that were included with the
+	### flagged extended +data+ of the event with the given +event_id+, if any were.
+	def log_extended_data( description, channel_num, event_id, data )
+		return unless self.log.debug?
+
+		event = Ant::Event.new( channel_num, event_id, data )
+		return unless event.flags&.nonzero?
+
+		details = []
+		details << "Chan ID(%d/%d/%d)" %
+			[ event.device_number, event.device_type, event.transmission_type ] if event.device_number
+		details << "RSSI %d dBm" % [ event.rssi ] if event.rssi
+		details << "timestamp %d" % [ event.timestamp ] if event.timestamp
+
+		self.log.debug "Got %s on %s" % [ description, details.join(', ') ]
+	end
+
+
 	def on_event_rx_acknowledged( channel_num, data )
-		self.log.debug "Acknowledged: Rx [%d]:\n%s" % [ data.bytes[0], Ant::DataUtilities.hexdump(data[1..9]) ]
+		self.log.debug "Acknowledged: Rx [%d]:\n%s" % [ data.getbyte( 0 ), Ant::DataUtilities.hexdump(data[1..9]) ]
 	end
 
 
 	def on_event_rx_burst_packet( channel_num, data )
-		channel = (data.bytes[0] & CHANNEL_NUMBER_MASK) >> 5
-		sequence_num = data.bytes[0] & SEQUENCE_NUMBER_MASK
+		channel = data.getbyte( 0 ) & CHANNEL_NUMBER_MASK
+		sequence_num = ( data.getbyte( 0 ) & SEQUENCE_NUMBER_MASK ) >> 5
 
 		self.log.debug "Burst (0x%02x): Rx: %d:\n%s" % [ channel, sequence_num, Ant::DataUtilities.hexdump(data[1..9]) ]
 	end
 
 
 	def on_event_rx_broadcast( channel_num, data )
-		self.log.debug "Broadcast: Rx [%d]:\n%s" % [ data.bytes[0], Ant::DataUtilities.hexdump(data[1..9]) ]
+		self.log.debug "Broadcast: Rx [%d]:\n%s" % [ data.getbyte( 0 ), Ant::DataUtilities.hexdump(data[1..9]) ]
 	end
 
 
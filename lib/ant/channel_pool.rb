@@ -0,0 +1,227 @@
+# -*- ruby -*-
+# frozen_string_literal: true
+
+require 'loggability'
+
+require 'ant' unless defined?( Ant )
+
+
+# A pool of the channel numbers of the current ANT device, which assigns
+# channels on whichever numbers are free so callers don't have to keep track of
+# them. The free numbers are kept in a bitmask, so finding one doesn't depend on
+# how many channels are in use.
+#
+#   pool = Ant.channel_pool
+#   pool.acquire( Ant::PARAMETER_RX_NOT_TX ) do |channel|
+#     channel.set_channel_id( 0, 0, 0 )
+#     channel.open
+#     ...
+#   end
+#
+# Channels acquired from the pool are returned to it when they're released, or
+# when the device closes them (e.g., a slave channel's search timing out).
+class Ant::ChannelPool
+	extend Loggability
+
+
+	# How long to wait for the device to close or unassign a channel before giving
+	# up, in milliseconds
+	RESPONSE_TIME = 500
+
+
+	# Loggability API -- log to the Ant logger
+	log_to :ant
+
+
+	### Create a pool of the channel numbers from 0 to +size+ - 1. If
+	### +recycle_idle+ is set, then when there aren't any free numbers left, the
+	### channel that's gone the longest without an event is closed to make room
+	### for the new one, as long as it's been idle for at least that many seconds.
+	def initialize( size, recycle_idle: nil )
+		size = Integer( size )
+		max = Ant::Channel::EventCallbacks::CHANNEL_NUMBER_MASK + 1
+		raise ArgumentError, "pool size must be between 1 and %d, got %p" % [ max, size ] unless
+			size.between?( 1, max )
+
+		@size         = size
+		@recycle_idle = recycle_idle
+		@free         = ( 1 << size ) - 1
+		@channels     = {}
+		@mutex        = Mutex.new
+	end
+
+
+	######
+	public
+	######
+
+	##
+	# The number of channels the pool hands out
+	attr_reader :size
+
+	##
+	# The number of seconds a channel has to be idle before it's recycled to make
+	# room for a new one, or +nil+ if channels aren't recycled
+	attr_accessor :recycle_idle
+
+
+	### Assign a channel of the given +channel_type+ on a free channel number and
+	### return it, raising a RuntimeError if there aren't any. If a block is given,
+	### the channel is yielded to it and released when it returns, and its value
+	### is returned instead.
+	def acquire( channel_type, network_number=Ant::Channel::DEFAULT_NETWORK_NUMBER,
+		extended_options=Ant::Channel::DEFAULT_EXTENDED_OPTIONS )
+
+		channel_num = self.take_channel_number
+
+		begin
+			channel = Ant.assign_channel( channel_num, channel_type, network_number, extended_options )
+		rescue
+			@mutex.synchronize { @free |= 1 << channel_num }
+			raise
+		end
+		@mutex.synchronize { @channels[channel_num] = channel }
+
+		return channel unless block_given?
+
+		begin
+			return yield( channel )
+		ensure
+			self.release( channel )
+		end
+	end
+
+
+	### Close the given +channel+ (if it isn't already) and return its number to
+	### the pool. Returns +false+ if the channel didn't come from the pool or was
+	### already returned to it.
+	def release( channel )
+		channel_num = channel.channel_number
+
+		@mutex.synchronize do
+			return false unless @channels[ channel_num ].equal?( channel )
+			@channels.delete( channel_num )
+		end
+
+		self.retire( channel, close: !channel.closed? && !channel.closed_by_device? )
+		@mutex.synchronize { @free |= 1 << channel_num }
+
+		return true
+	end
+
+
+	### Return the channels that have been acquired and not yet released, keyed by
+	### channel number.
+	def channels
+		return @mutex.synchronize { @channels.dup }
+	end
+
+
+	### Return the number of channels that can be acquired without recycling any.
+	def available
+		self.reclaim_closed_channels
+		return @mutex.synchronize { @free.to_s(2).count('1') }
+	end
+
+
+	### Return a human-readable version of the object suitable for debugging.
+	def inspect
+		return "#<%p:%#x %d of %d channels in use%s>" % [
+			self.class,
+			self.object_id,
+			self.channels.length,
+			@size,
+			@recycle_idle ? ", recycling after %0.1fs idle" % [ @recycle_idle ] : '',
+		]
+	end
+
+
+	#########
+	protected
+	#########
+
+	### Remove the lowest free channel number from the pool and return it,
+	### reclaiming the closed channels first and recycling an idle one if there
+	### aren't any. The channels are retired without holding the pool's mutex, so
+	### acquiring a free number never waits on the device.
+	def take_channel_number
+		self.reclaim_closed_channels
+
+		channel_num = @mutex.synchronize { self.take_free_number }
+		if !channel_num && @recycle_idle && self.recycle_idle_channel
+			channel_num = @mutex.synchronize { self.take_free_number }
+		end
+
+		raise "no free channels (all %d are in use)" % [ @size ] unless channel_num
+		return channel_num
+	end
+
+
+	### Remove the lowest free channel number from the pool and return it, or
+	### return +nil+ if there aren't any. Must be called with the mutex held.
+	def take_free_number
+		return nil if @free.zero?
+
+		channel_num = ( @free & -@free ).bit_length - 1
+		@free &= ~( 1 << channel_num )
+
+		return channel_num
+	end
+
+
+	### Put the numbers of the pool's channels that the device has closed back in
+	### the pool. Each channel keeps track of its own closing, so one that's
+	### already been released can't take a channel that's reusing its number
+	### with it.
+	def reclaim_closed_channels
+		closed = @mutex.synchronize do
+			@channels.values.select( &:closed_by_device? ).
+				each {|channel| @channels.delete(channel.channel_number) }
+		end
+
+		closed.each do |channel|
+			self.log.info "Reclaiming closed channel %d." % [ channel.channel_number ]
+			self.retire( channel, close: false )
+			@mutex.synchronize { @free |= 1 << channel.channel_number }
+		end
+	end
+
+
+	### Close the channel that's been idle the longest to make room for another,
+	### if it's been idle for long enough. Returns +true+ if one was closed.
+	def recycle_idle_channel
+		now = Process.clock_gettime( Process::CLOCK_MONOTONIC )
+		channel = @mutex.synchronize do
+			oldest = @channels.values.min_by( &:last_event_at )
+			next nil if !oldest || now - oldest.last_event_at < @recycle_idle
+			@channels.delete( oldest.channel_number )
+		end or return false
+
+		self.log.info "Recycling channel %d after %0.1fs idle." %
+			[ channel.channel_number, now - channel.last_event_at ]
+		self.retire( channel, close: !channel.closed? && !channel.closed_by_device? )
+		@mutex.synchronize { @free |= 1 << channel.channel_number }
+
+		return true
+	end
+
+
+	### Unassign the given +channel+ from the device so its number can be used
+	### again, closing it first if +close+ is true.
+	def retire( channel, close: true )
+		if close
+			begin
+				channel.close( RESPONSE_TIME )
+			rescue RuntimeError => err
+				# The device might have closed it already
+				self.log.debug "Couldn't close channel %d: %s" % [ channel.channel_number, err.message ]
+			end
+		end
+
+		channel.unassign( RESPONSE_TIME )
+	rescue => err
+		self.log.error "%p while retiring channel %d: %s" %
+			[ err.class, channel.channel_number, err.message ]
+	end
+
+end # class Ant::ChannelPool
@@ -0,0 +1,217 @@
+# -*- ruby -*-
+# frozen_string_literal: true
+
+require 'loggability'
+
+require 'ant' unless defined?( Ant )
+
+
+# A group of ANT devices (e.g., USB sticks) that are used together, so an
+# application can have as many channels as all of them put together.
+#
+# The ANT library can only drive one device per process, so the cluster forks a
+# worker process for each device, which initializes it and assigns its
+# channels. The events on those channels are added to a shared-memory
+# Ant::NativeSink::Ring straight from the worker's receive thread, and read
+# from it in the parent; commands are sent the other way over a socket.
+#
+#   cluster = Ant::Cluster.new( devices: [0, 1, 2, 3] )
+#   channel = cluster.assign_channel( Ant::PARAMETER_RX_NOT_TX )
+#   channel.set_channel_id( 0, 0, 0 )
+#   channel.on_event {|channel_num, event_id, data| ... }
+#   channel.open
+#
+# The parent must not initialize ANT itself.
+class Ant::Cluster
+	extend Loggability
+
+
+	# The number of channels each device is assumed to have if it isn't given
+	DEFAULT_CHANNELS_PER_DEVICE = 8
+
+	# The number of events each worker's ring holds
+	DEFAULT_RING_CAPACITY = 4096
+
+	# How long each dispatcher waits for events before checking if it should stop,
+	# in seconds
+	DISPATCH_INTERVAL = 0.25
+
+
+	#
+	# Autoloads
+	#
+
+	require 'ant/cluster/worker'
+	require 'ant/cluster/channel'
+
+
+	# Loggability API -- log to the Ant logger
+	log_to :ant
+
+
+	### Create a cluster of the ANT +devices+ with the given USB device numbers,
+	### and start a worker process for each of them. Each device is used for up to
+	### +channels_per_device+ channels. The +backend+ is what the workers use to
+	### talk to their device, which is normally the Ant module itself, but can be
+	### anything with the same API (e.g., a simulated device for testing).
+	def initialize( devices: [0], channels_per_device: DEFAULT_CHANNELS_PER_DEVICE,
+		ring_capacity: DEFAULT_RING_CAPACITY, backend: Ant )
+
+		raise ArgumentError, "no devices" if devices.empty?
+
+		@channels_per_device = Integer( channels_per_device )
+		@channels = {}
+		@callback = nil
+		@running = true
+		@mutex = Mutex.new
+
+		@workers = devices.map do |device|
+			Ant::Cluster::Worker.new( device, ring_capacity: ring_capacity, backend: backend )
+		end
+
+		begin
+			@workers.each( &:start )
+		rescue
+			self.close
+			raise
+		end
+
+		@dispatchers = @workers.map do |worker|
+			thread = Thread.new( worker, &self.method(:dispatch_events) )
+			thread.name = "ant-cluster-%d" % [ worker.device ]
+			thread
+		end
+	end
+
+
+	######
+	public
+	######
+
+	##
+	# The Ant::Cluster::Worker for each device
+	attr_reader :workers
+
+	##
+	# The number of channels assigned on each device
+	attr_reader :channels_per_device
+
+
+	### Assign a channel on one of the cluster's devices and return an
+	### Ant::Cluster::Channel for it. The channel goes on the device with the most
+	### free channels unless a +device+ number is given.
+	def assign_channel( channel_type, network_number=0, extended_options=0x0, device: nil )
+		worker, channel_num = @mutex.synchronize do
+			worker = self.worker_for_new_channel( device )
+			channel_num = ( 0...@channels_per_device ).find {|num| !@channels.key?([worker, num]) }
+			@channels[ [worker, channel_num] ] = nil
+			[ worker, channel_num ]
+		end
+
+		begin
+			worker.call( :assign_channel, channel_num, channel_type, network_number, extended_options )
+		rescue
+			@mutex.synchronize { @channels.delete([worker, channel_num]) }
+			raise
+		end
+
+		channel = Ant::Cluster::Channel.new( self, worker, channel_num, channel_type )
+		@mutex.synchronize { @channels[[worker, channel_num]] = channel }
+
+		return channel
+	end
+
+
+	### Return the open channels of all of the cluster's devices.
+	def channels
+		return @mutex.synchronize { @channels.values.compact }
+	end
+
+
+	### Set up a callback for events on any of the cluster's channels that don't
+	### have one of their own. It's called with the Ant::Cluster::Channel instead
+	### of its channel number, as the numbers are only unique per device.
+	def on_event( &callback ) # :yields: channel, event_id, data
+		raise LocalJumpError, "block required, but not given" unless callback
+		@callback = callback
+	end
+
+
+	### Forget the given +channel+ once it's been closed.
+	def remove_channel( channel )
+		@mutex.synchronize { @channels.delete([channel.worker, channel.channel_number]) }
+	end
+
+
+	### Return the number of events the workers had to drop because the parent
+	### wasn't keeping up.
+	def dropped_events
+		return @workers.sum {|worker| worker.ring.dropped }
+	end
+
+
+	### Stop the workers, which closes their devices.
+	def close
+		@running = false
+		@dispatchers&.each( &:join )
+		@workers.each( &:stop )
+		@mutex.synchronize { @channels.clear }
+	end
+
+
+	### Return a human-readable version of the object suitable for debugging.
+	def inspect
+		return "#<%p:%#x devices: %p, %d channels>" % [
+			self.class,
+			self.object_id,
+			@workers.map( &:device ),
+			self.channels.length,
+		]
+	end
+
+
+	#########
+	protected
+	#########
+
+	### Return the worker for the given +device+ number, or the one with the most
+	### free channels if it's +nil+.
+	def worker_for_new_channel( device )
+		if device
+			worker = @workers.find {|w| w.device == device } or
+				raise ArgumentError, "no device %p in the cluster" % [ device ]
+		else
+			worker = @workers.min_by {|w| @channels.count {|(cw, _), _| cw == w } }
+		end
+
+		used = @channels.count {|(cw, _), _| cw == worker }
+		raise "no free channels on device %p" % [ worker.device ] if used >= @channels_per_device
+
+		return worker
+	end
+
+
+	### Read the events the +worker+ forwards from its ring and pass them to the
+	### callbacks of the channels they're for, until the cluster is closed.
+	def dispatch_events( worker )
+		while @running
+			worker.ring.wait( DISPATCH_INTERVAL ) or next
+
+			while ( event = worker.ring.shift )
+				channel_num, event_id, data = *event
+				channel = @mutex.synchronize { @channels[[worker, channel_num]] } or next
+
+				begin
+					if channel.callback
+						channel.callback.call( channel_num, event_id, data )
+					elsif @callback
+						@callback.call( channel, event_id, data )
+					end
+				rescue => err
+					self.log.error "%p in event callback for %p: %s" % [ err.class, channel, err.message ]
+				end
+			end
+		end
+	end
+
+end # class Ant::Cluster
@@ -0,0 +1,133 @@
+# -*- ruby -*-
+# frozen_string_literal: true
+
+require 'loggability'
+
+require 'ant/cluster' unless defined?( Ant::Cluster )
+
+
+# A channel assigned on one of the devices of an Ant::Cluster. Its commands are
+# run by the Ant::Cluster::Worker for the device, and its events are passed to
+# the #on_event callback in this process.
+class Ant::Cluster::Channel
+	extend Loggability
+
+
+	# The Ant::Channel methods that are run in the worker process as-is
+	FORWARDED_METHODS = %i[
+		set_channel_id
+		set_channel_period
+		set_channel_search_timeout
+		set_channel_rf_freq
+		set_frequency_agility
+		open
+		send_broadcast_data
+		send_acknowledged_data
+		send_burst_transfer
+		send_advanced_transfer
+		push_broadcast_data
+		broadcast_ring_length
+		clear_broadcast_ring
+		tx_queue_length
+	].freeze
+
+
+	# Loggability API -- log to the Ant logger
+	log_to :ant
+
+
+	### Create a proxy for the channel +channel_num+ of the given +worker+ in the
+	### +cluster+.
+	def initialize( cluster, worker, channel_num, channel_type )
+		@cluster        = cluster
+		@worker         = worker
+		@channel_number = channel_num
+		@channel_type   = channel_type
+		@callback       = nil
+		@closed         = false
+	end
+
+
+	######
+	public
+	######
+
+	##
+	# The Ant::Cluster the channel belongs to
+	attr_reader :cluster
+
+	##
+	# The Ant::Cluster::Worker for the channel's device
+	attr_reader :worker
+
+	##
+	# The channel's number on its device
+	attr_reader :channel_number
+
+	##
+	# The channel type it was assigned with
+	attr_reader :channel_type
+
+	##
+	# The event callback set by #on_event
+	attr_reader :callback
+
+
+	FORWARDED_METHODS.each do |name|
+		define_method( name ) do |*args|
+			return @worker.call( @channel_number, name, *args )
+		end
+	end
+
+	alias_method :set_channel_rf_frequency, :set_channel_rf_freq
+
+
+	### Return the USB device number of the channel's device.
+	def device
+		return @worker.device
+	end
+
+
+	### Set up a callback for the channel's events. It's called with the same
+	### arguments as an Ant::Channel#on_event callback, from a thread that reads
+	### the events the channel's worker forwards.
+	def on_event( &callback ) # :yields: channel_num, event_id, data
+		raise LocalJumpError, "block required, but not given" unless callback
+		@callback = callback
+	end
+
+
+	### Close the channel.
+	def close( timeout=nil )
+		@worker.call( @channel_number, :close, *[timeout].compact )
+		@closed = true
+		@cluster.remove_channel( self )
+
+		return true
+	end
+
+
+	### Returns +true+ if the channel has been closed.
+	def closed?
+		return @closed
+	end
+
+
+	### Returns +true+ if the channel is not closed.
+	def open?
+		return !self.closed?
+	end
+
+
+	### Return a human-readable version of the object suitable for debugging.
+	def inspect
+		return "#<%p:%#x #%d on device %p%s>" % [
+			self.class,
+			self.object_id,
+			@channel_number,
+			self.device,
+			self.closed? ? " (closed)" : "",
+		]
+	end
+
+end # class Ant::Cluster::Channel
@@ -0,0 +1,234 @@
+# -*- ruby -*-
+# frozen_string_literal: true
+
+require 'socket'
+require 'loggability'
+
+require 'ant/cluster' unless defined?( Ant::Cluster )
+
+
+# The worker process for one of the devices of an Ant::Cluster. It initializes
+# its device, runs the commands the parent sends it, and forwards the events on
+# its channels to the parent through its #ring.
+class Ant::Cluster::Worker
+	extend Loggability
+
+
+	# Loggability API -- log to the Ant logger
+	log_to :ant
+
+
+	### Create a worker for the ANT device with the given USB +device+ number. See
+	### Ant::Cluster.new for the other options.
+	def initialize( device, ring_capacity: Ant::Cluster::DEFAULT_RING_CAPACITY, backend: Ant )
+		@device   = device
+		@backend  = backend
+		@ring     = Ant::NativeSink::Ring.new( ring_capacity )
+		@pid      = nil
+		@socket   = nil
+		@mutex    = Mutex.new
+		@channels = {}
+	end
+
+
+	######
+	public
+	######
+
+	##
+	# The USB device number of the worker's device
+	attr_reader :device
+
+	##
+	# The Ant::NativeSink::Ring the worker's channel events are forwarded through
+	attr_reader :ring
+
+	##
+	# The process ID of the worker, if it's running
+	attr_reader :pid
+
+
+	### Fork the worker process and wait for it to initialize its device, raising
+	### if it couldn't.
+	def start
+		raise "worker for device %p is already running" % [ @device ] if @pid
+
+		parent_socket, child_socket = UNIXSocket.pair
+		@pid = Process.fork do
+			parent_socket.close
+			self.run( child_socket )
+		end
+		child_socket.close
+		@socket = parent_socket
+
+		self.read_reply
+		self.log.info "Started worker %d for ANT device %p." % [ @pid, @device ]
+	rescue
+		self.stop
+		raise
+	end
+
+
+	### Returns +true+ if the worker process is running.
+	def running?
+		return @pid ? true : false
+	end
+
+
+	### Run a +command+ in the worker process and return its result, or raise the
+	### exception it raised. A command is the name of an Ant module function and
+	### its arguments (e.g., <tt>:set_network_key, 0, key</tt>), or the number of
+	### one of the worker's channels followed by the name of an Ant::Channel method
+	### and its arguments (e.g., <tt>3, :open</tt>).
+	def call( *command )
+		@mutex.synchronize do
+			raise "worker for device %p isn't running" % [ @device ] unless @socket
+			Marshal.dump( command, @socket )
+			return self.read_reply
+		end
+	end
+
+
+	### Stop the worker process, which closes its device. Workers forked later
+	### share the parent's end of its socket, so it's told to stop instead of just
+	### having its socket closed.
+	def stop
+		@mutex.synchronize do
+			begin
+				Marshal.dump( [:stop], @socket ) if @socket
+			rescue SystemCallError
+				# Already gone
+			end
+			@socket&.close
+			@socket = nil
+		end
+
+		if @pid
+			Process.wait( @pid )
+			self.log.info "Stopped worker %d for ANT device %p." % [ @pid, @device ]
+		end
+		@pid = nil
+	end
+
+
+	### Return a human-readable version of the object suitable for debugging.
+	def inspect
+		return "#<%p:%#x device %p %s>" % [
+			self.class,
+			self.object_id,
+			@device,
+			@pid ? "(pid #{@pid})" : "(stopped)",
+		]
+	end
+
+
+	#########
+	protected
+	#########
+
+	### Read the reply to a command from the worker process, and return its result
+	### or raise the exception it sent.
+	def read_reply
+		status, result = Marshal.load( @socket )
+		raise result if status == :error
+		return result
+	rescue EOFError, Errno::ECONNRESET
+		raise "worker for ANT device %p exited" % [ @device ]
+	end
+
+
+	### Initialize the device, then run the commands sent over the +socket+ until
+	### it's closed -- worker process side. Exits the process when it's done, so
+	### the parent's at_exit handlers don't run in it.
+	def run( socket )
+		@backend.after_fork if @backend.respond_to?( :after_fork )
+
+		begin
+			@backend.init( @device )
+		rescue => err
+			self.send_reply( socket, :error, err )
+			return
+		end
+		self.send_reply( socket, :ok, true )
+
+		loop do
+			command = begin
+				Marshal.load( socket )
+			rescue EOFError, Errno::ECONNRESET
+				break
+			end
+			break if command == [ :stop ]
+
+			self.run_command( socket, *command )
+		end
+	ensure
+		begin
+			@backend.close
+		rescue => err
+			self.log.error "%p while closing ANT device %p: %s" % [ err.class, @device, err.message ]
+		end
+		exit!( 0 )
+	end
+
+
+	### Run the command +name+ with the given +args+ and send its result (or the
+	### exception it raised) over the +socket+ -- worker process side.
+	def run_command( socket, name, *args )
+		result = case name
+			when :assign_channel
+				self.assign_channel( *args )
+			when Integer
+				self.run_channel_command( name, *args )
+			else
+				@backend.public_send( name, *args )
+			end
+
+		self.send_reply( socket, :ok, result )
+	rescue => err
+		self.send_reply( socket, :error, err )
+	end
+
+
+	### Assign the channel +channel_num+ with the given +args+ and start forwarding
+	### its events -- worker process side.
+	def assign_channel( channel_num, *args )
+		channel = @backend.assign_channel( channel_num, *args )
+		channel.add_native_sink( @ring )
+		@channels[ channel_num ] = channel
+
+		return true
+	end
+
+
+	### Call the method +name+ of the channel +channel_num+ with the given +args+
+	### -- worker process side.
+	def run_channel_command( channel_num, name, *args )
+		channel = @channels[ channel_num ] or
+			raise ArgumentError, "no channel %d on ANT device %p" % [ channel_num, @device ]
+
+		result = channel.public_send( name, *args )
+
+		# Unassign a closed channel so the device will take its number again
+		if name == :close
+			channel.unassign( *args )
+			@channels.delete( channel_num )
+		end
+
+		return result
+	end
+
+
+	### Send a reply with the given +status+ and +result+ over the +socket+ --
+	### worker process side. Results that can't be sent to the parent (e.g., an
+	### Ant::Future) are replaced with an error.
+	def send_reply( socket, status, result )
+		data = begin
+			Marshal.dump( [status, result] )
+		rescue TypeError
+			Marshal.dump( [:error, RuntimeError.new("can't send a %p back from a worker" % [result.class])] )
+		end
+
+		socket.write( data )
+	end
+
+end # class Ant::Cluster::Worker
@@ -104,7 +104,7 @@ module Ant::ResponseCallbacks
 	### Log a success or an error message for a response event message.
 	def log_response_event( channel_num, data, err_desc, log_desc )
 		status = data.bytes[ 2 ]
-		channel = Ant::Channel.registry[ channel_num ]
+		channel = Ant::Channel[ channel_num ]
 
 		if status.nonzero?
 			self.log.error "Error while %s on %p: %#02x" % [ err_desc, channel, status ]
@@ -244,11 +244,11 @@ module Ant::ResponseCallbacks
 
 		# Advanced burst capabilities
 		if type == 0
-			max_packet_length, features = data.unpack( 'CV' )
-			features = Ant::BitVector.new( features )
+			max_packet_length, features = data.unpack( 'xCa3' )
+			features = Ant::BitVector.new( (features + "\0").unpack1('V') )
 
 			caps = {
-				max_packet_length: max_packet_length,
+				max_packet_length: max_packet_length * 8,
 				frequency_hopping: features.on?( Ant::ADV_BURST_CONFIG_FREQ_HOP )
 			}
 
@@ -258,9 +258,9 @@ module Ant::ResponseCallbacks
 		# Advanced burst current configuration
 		elsif type == 1
 			enabled, max_packet_length, required, optional, stall_count, retry_count =
-				data.unpack( 'CCVVvC' )
-			required = Ant::BitVector.new( required )
-			optional = Ant::BitVector.new( optional )
+				data.unpack( 'xCCa3a3vC' )
+			required = Ant::BitVector.new( (required + "\0").unpack1('V') )
+			optional = Ant::BitVector.new( (optional + "\0").unpack1('V') )
 
 			required_features = []
 			required_features << :frequency_hopping if required.on?( Ant::ADV_BURST_CONFIG_FREQ_HOP )
@@ -270,7 +270,7 @@ module Ant::ResponseCallbacks
 
 			config = {
 				enabled: enabled == 1,
-				max_packet_length: max_packet_length,
+				max_packet_length: max_packet_length * 8,
 				required_features: required_features,
 				optional_features: optional_features,
 				stall_count: stall_count,
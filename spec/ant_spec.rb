@@ -93,5 +93,146 @@ RSpec.describe( Ant ) do
 		}.to raise_error( RangeError, /invalid rf frequency/i )
 	end
 
+
+	it "can validate a channel spec" do
+		spec = described_class.validate_channel_spec(
+			channel: 3, channel_type: Ant::PARAMETER_RX_NOT_TX, device_number: 49, period: 8070 )
+
+		expect( spec ).to eq(
+			channel: 3,
+			channel_type: Ant::PARAMETER_RX_NOT_TX,
+			network_number: 0,
+			extended_options: 0,
+			device_number: 49,
+			device_type: 0,
+			transmission_type: 0,
+			period: 8070,
+			open: true
+		)
+	end
+
+
+	it "rejects invalid channel specs" do
+		expect {
+			described_class.validate_channel_spec( channel: 3 )
+		}.to raise_error( ArgumentError, /doesn't have a channel number and type/i )
+		expect {
+			described_class.validate_channel_spec( channel: 32, channel_type: 0 )
+		}.to raise_error( RangeError, /invalid channel number/i )
+		expect {
+			described_class.validate_channel_spec( channel: 3, channel_type: 0, frequency: 57 )
+		}.to raise_error( ArgumentError, /unknown channel settings/i )
+	end
+
+
+	it "won't configure the same channel twice at once" do
+		specs = [ {channel: 1, channel_type: 0}, {channel: 1, channel_type: 0x10} ]
+		expect {
+			described_class.configure_channels( specs )
+		}.to raise_error( ArgumentError, /duplicate channel numbers/i )
+	end
+
+
+	describe "callback settings" do
+
+		around( :each ) do |example|
+			capacity = described_class.callback_queue_capacity
+			workers = described_class.callback_workers
+			async = described_class.async_callbacks?
+			batch_size = described_class.callback_batch_size
+			policy = described_class.callback_overflow_policy
+
+			example.run
+		ensure
+			described_class.close
+			described_class.callback_queue_capacity = capacity
+			described_class.callback_workers = workers
+			described_class.async_callbacks = async
+			described_class.callback_batch_size = batch_size
+			described_class.callback_overflow_policy = policy
+		end
+
+
+		it "rounds the callback queue capacity up to a power of two" do
+			described_class.callback_queue_capacity = 100
+			expect( described_class.callback_queue_capacity ).to eq( 128 )
+		end
+
+
+		it "rejects a callback queue capacity that's too large" do
+			expect {
+				described_class.callback_queue_capacity = 2 ** 63
+			}.to raise_error( ArgumentError, /capacity \d+ is too large/i )
+		end
+
+
+		it "can't be reconfigured while ANT is initialized", :hardware do
+			described_class.init
+
+			expect {
+				described_class.callback_queue_capacity = 64
+			}.to raise_error( RuntimeError, /while ANT is initialized/i )
+		end
+
+
+		it "accepts between 0 and 32 callback workers" do
+			described_class.callback_workers = 0
+			expect( described_class.callback_workers ).to eq( 0 )
+
+			expect {
+				described_class.callback_workers = 33
+			}.to raise_error( ArgumentError, /between 0 and 32 callback workers, got 33/i )
+		end
+
+
+		it "can deliver callbacks asynchronously" do
+			expect( described_class ).to_not be_async_callbacks
+
+			described_class.async_callbacks = true
+			expect( described_class ).to be_async_callbacks
+		end
+
+
+		it "rejects a callback batch size that's out of range" do
+			described_class.callback_batch_size = 8
+			expect( described_class.callback_batch_size ).to eq( 8 )
+
+			expect {
+				described_class.callback_batch_size = 0
+			}.to raise_error( ArgumentError, /batch size between 1 and \d+, got 0/i )
+			expect {
+				described_class.callback_batch_size = 1_000_000
+			}.to raise_error( ArgumentError, /batch size between 1 and \d+/i )
+		end
+
+
+		it "rejects channel dispatch weights that are out of range" do
+			channel = Ant::Channel.allocate
+
+			expect {
+				channel.dispatch_weight = 0
+			}.to raise_error( ArgumentError, /dispatch weight between 1 and \d+, got 0/i )
+			expect {
+				channel.dispatch_weight = 100_000
+			}.to raise_error( ArgumentError, /dispatch weight between 1 and \d+/i )
+		end
+
+
+		it "knows the callback overflow policies" do
+			%i[ block drop_oldest drop_newest keep_latest_per_channel ].each do |policy|
+				described_class.callback_overflow_policy = policy
+				expect( described_class.callback_overflow_policy ).to eq( policy )
+			end
+		end
+
+
+		it "rejects unknown callback overflow policies" do
+			expect {
+				described_class.callback_overflow_policy = :keep_latest
+			}.to raise_error( ArgumentError, /unknown callback overflow policy :keep_latest/i )
+		end
+
+	end
+
 end
 
@@ -0,0 +1,171 @@
+# -*- ruby -*-
+# frozen_string_literal: true
+
+require_relative 'spec_helper'
+
+require 'ant/channel_pool'
+
+
+RSpec.describe( Ant::ChannelPool ) do
+
+	before( :each ) do
+		allow( Ant ).to receive( :assign_channel ) do |channel_num, *|
+			make_channel( channel_num )
+		end
+	end
+
+
+	### Return a double for an assigned channel with the given +channel_num+.
+	def make_channel( channel_num, last_event_at: Process.clock_gettime(Process::CLOCK_MONOTONIC) )
+		channel = instance_double( Ant::Channel, channel_number: channel_num, last_event_at: last_event_at )
+		closed = false
+		allow( channel ).to receive( :closed? ) { closed }
+		allow( channel ).to receive( :closed_by_device? ) { closed }
+		allow( channel ).to receive( :close ) { closed = true }
+		allow( channel ).to receive( :unassign ) { closed = true }
+
+		return channel
+	end
+
+
+	it "assigns channels on the lowest free numbers" do
+		pool = described_class.new( 4 )
+
+		channels = 3.times.map { pool.acquire(Ant::PARAMETER_RX_NOT_TX) }
+
+		expect( channels.map(&:channel_number) ).to eq( [0, 1, 2] )
+		expect( pool.available ).to eq( 1 )
+		expect( pool.channels.keys ).to eq( [0, 1, 2] )
+	end
+
+
+	it "raises when all of its channels are in use" do
+		pool = described_class.new( 2 )
+		2.times { pool.acquire(Ant::PARAMETER_RX_NOT_TX) }
+
+		expect {
+			pool.acquire( Ant::PARAMETER_RX_NOT_TX )
+		}.to raise_error( RuntimeError, /no free channels/i )
+	end
+
+
+	it "reuses the numbers of released channels" do
+		pool = described_class.new( 4 )
+		channels = 3.times.map { pool.acquire(Ant::PARAMETER_RX_NOT_TX) }
+
+		expect( channels[1] ).to receive( :close ).with( described_class::RESPONSE_TIME )
+		expect( channels[1] ).to receive( :unassign ).with( described_class::RESPONSE_TIME )
+		expect( pool.release(channels[1]) ).to be( true )
+
+		expect( pool.acquire(Ant::PARAMETER_RX_NOT_TX).channel_number ).to eq( 1 )
+	end
+
+
+	it "ignores channels it didn't hand out" do
+		pool = described_class.new( 4 )
+		channel = pool.acquire( Ant::PARAMETER_RX_NOT_TX )
+
+		expect( pool.release(channel) ).to be( true )
+		expect( pool.release(channel) ).to be( false )
+		expect( pool.release(make_channel(3)) ).to be( false )
+	end
+
+
+	it "releases channels acquired with a block when the block returns" do
+		pool = described_class.new( 4 )
+
+		result = pool.acquire( Ant::PARAMETER_RX_NOT_TX ) do |channel|
+			expect( pool.available ).to eq( 3 )
+			channel.channel_number
+		end
+
+		expect( result ).to eq( 0 )
+		expect( pool.available ).to eq( 4 )
+	end
+
+
+	it "returns the number of a channel that couldn't be assigned" do
+		pool = described_class.new( 1 )
+		expect( Ant ).to receive( :assign_channel ).and_raise( RuntimeError, "Couldn't assign channel 0" )
+
+		expect {
+			pool.acquire( Ant::PARAMETER_RX_NOT_TX )
+		}.to raise_error( RuntimeError, /couldn't assign/i )
+		expect( pool.available ).to eq( 1 )
+	end
+
+
+	it "reclaims the numbers of channels the device closed" do
+		pool = described_class.new( 2 )
+		channels = 2.times.map { pool.acquire(Ant::PARAMETER_RX_NOT_TX) }
+
+		allow( channels[1] ).to receive( :closed_by_device? ).and_return( true )
+		expect( channels[1] ).to_not receive( :close )
+		expect( channels[1] ).to receive( :unassign )
+
+		expect( pool.acquire(Ant::PARAMETER_RX_NOT_TX).channel_number ).to eq( 1 )
+	end
+
+
+	it "doesn't reclaim a channel because the one before it on its number closed late" do
+		pool = described_class.new( 2 )
+		old_channel = pool.acquire( Ant::PARAMETER_RX_NOT_TX )
+		pool.release( old_channel )
+		channel = pool.acquire( Ant::PARAMETER_RX_NOT_TX )
+
+		allow( old_channel ).to receive( :closed_by_device? ).and_return( true )
+		expect( channel ).to_not receive( :unassign )
+
+		expect( pool.available ).to eq( 1 )
+		expect( pool.channels ).to eq( 0 => channel )
+	end
+
+
+	it "recycles the channel that's been idle the longest if it's allowed to" do
+		pool = described_class.new( 2, recycle_idle: 30 )
+		now = Process.clock_gettime( Process::CLOCK_MONOTONIC )
+		allow( Ant ).to receive( :assign_channel ).and_return(
+			make_channel(0, last_event_at: now - 40),
+			make_channel(1, last_event_at: now - 60),
+			make_channel(1) )
+		channels = 2.times.map { pool.acquire(Ant::PARAMETER_RX_NOT_TX) }
+
+		expect( channels[1] ).to receive( :close )
+		channel = pool.acquire( Ant::PARAMETER_RX_NOT_TX )
+
+		expect( channel.channel_number ).to eq( 1 )
+		expect( pool.channels ).to eq( 0 => channels[0], 1 => channel )
+	end
+
+
+	it "doesn't recycle channels that haven't been idle for long enough" do
+		pool = described_class.new( 1, recycle_idle: 30 )
+		pool.acquire( Ant::PARAMETER_RX_NOT_TX )
+
+		expect {
+			pool.acquire( Ant::PARAMETER_RX_NOT_TX )
+		}.to raise_error( RuntimeError, /no free channels/i )
+	end
+
+
+	it "applies the options passed to Ant.channel_pool to the existing pool" do
+		allow( Ant ).to receive( :capabilities ).and_return( max_channels: 8 )
+		pool = Ant.channel_pool
+
+		expect( Ant.channel_pool(recycle_idle: 10) ).to equal( pool )
+		expect( pool.recycle_idle ).to eq( 10 )
+		expect {
+			Ant.channel_pool( size: 4 )
+		}.to raise_error( ArgumentError, /unknown channel pool options/i )
+	ensure
+		Ant.instance_variable_set( :@channel_pool, nil )
+	end
+
+
+	it "can't be bigger than the number of channels a device can have" do
+		expect {
+			described_class.new( 33 )
+		}.to raise_error( ArgumentError, /pool size/i )
+	end
+
+end
@@ -0,0 +1,413 @@
+# -*- ruby -*-
+# frozen_string_literal: true
+
+require_relative 'spec_helper'
+
+require 'ant'
+
+
+RSpec.describe( Ant::Channel ) do
+
+	let( :channel_number ) { 5 }
+
+	let( :channel ) do
+		described_class.send( :new, channel_number, Ant::PARAMETER_RX_NOT_TX, 0, 0 )
+	end
+
+	let( :payload ) { [1, 2, 3, 4, 5, 6, 7, 8].pack('C*') }
+
+
+	after( :each ) do
+		Ant.close
+	end
+
+
+	### Return the data of each event the +channel+ gets while the block runs.
+	def collect_event_data( channel, **options )
+		received = []
+		channel.on_event( **options ) {|*, data| received << yield(data) }
+		return received
+	end
+
+
+	### Return the data of a transfer event on the channel.
+	def transfer_event( event_id )
+		return channel_number.chr + [ 1, event_id ].pack( 'C*' )
+	end
+
+
+	it "passes event data sized to the event's type" do
+		received = collect_event_data( channel ) {|data| data }
+		padding = "\xFF".b * 20
+
+		channel.receive_event( Ant::EVENT_RX_BROADCAST, channel_number.chr + payload + padding )
+		channel.receive_event( Ant::EVENT_RX_FLAG_BROADCAST,
+			channel_number.chr + payload + [ Ant::ANT_EXT_MESG_BITFIELD_DEVICE_ID, 0x1231, 120, 5 ].pack('CvCC') + padding )
+		channel.receive_event( Ant::EVENT_TX, channel_number.chr + "\x01\x03".b + padding )
+
+		expect( received.map(&:bytesize) ).to eq( [9, 14, 3] )
+		expect( received.first ).to eq( channel_number.chr + payload )
+	end
+
+
+	it "can reuse a buffer for the data of each event" do
+		received = collect_event_data( channel, reuse_buffer: true ) {|data| data }
+
+		channel.receive_event( Ant::EVENT_RX_BROADCAST, channel_number.chr + payload )
+		channel.receive_event( Ant::EVENT_RX_BROADCAST, channel_number.chr + payload.reverse )
+
+		expect( received.first ).to be( received.last )
+		expect( received.first ).to_not be_frozen
+		expect( received.last ).to eq( channel_number.chr + payload.reverse )
+	end
+
+
+	it "rescans a reused buffer's data for each event" do
+		received = collect_event_data( channel, reuse_buffer: true ) do |data|
+			[ data.ascii_only?, data.valid_encoding?, data.dup ]
+		end
+
+		channel.receive_event( Ant::EVENT_RX_BROADCAST, channel_number.chr + "\x00".b * 8 )
+		channel.receive_event( Ant::EVENT_RX_BROADCAST, channel_number.chr + "\xFF\xFE".b + "\x00".b * 6 )
+
+		expect( received.map(&:first) ).to eq( [true, false] )
+		expect( received.last.last ).to eq( channel_number.chr + "\xFF\xFE".b + "\x00".b * 6 )
+	end
+
+
+	it "restores a reused buffer that a callback changed" do
+		received = collect_event_data( channel, reuse_buffer: true ) do |data|
+			copy = data.dup
+			data << "extra"
+			data.force_encoding( Encoding::UTF_8 )
+			copy
+		end
+
+		channel.receive_event( Ant::EVENT_RX_BROADCAST, channel_number.chr + payload )
+		channel.receive_event( Ant::EVENT_RX_BROADCAST, channel_number.chr + payload )
+
+		expect( received.last ).to eq( channel_number.chr + payload )
+		expect( received.last.encoding ).to eq( Encoding::ASCII_8BIT )
+	end
+
+
+	it "has a transmit queue for acknowledged data" do
+		expect( channel.tx_queue_depth ).to eq( 32 )
+		expect( channel.tx_queue_retries ).to eq( 3 )
+		expect( channel.tx_queue_length ).to eq( 0 )
+	end
+
+
+	it "can't have a transmit queue with no room in it" do
+		expect {
+			channel.tx_queue_depth = 0
+		}.to raise_error( ArgumentError, /at least 1/i )
+	end
+
+
+	it "can't receive events unless it's assigned" do
+		expect {
+			described_class.allocate.receive_event( Ant::EVENT_RX_BROADCAST, "\x00".b + payload )
+		}.to raise_error( RuntimeError, /isn't assigned/i )
+	end
+
+
+	describe "burst reassembly" do
+
+		### Return the data of a burst packet with the given +sequence+ bits.
+		def burst_packet( sequence, data, last: false )
+			return ( channel_number | sequence | (last ? 0x80 : 0) ).chr + data
+		end
+
+
+		it "passes whole burst transfers to its burst callback" do
+			bursts = []
+			events = []
+			channel.on_event {|_, event_id, *| events << event_id }
+			channel.on_burst {|channel_num, data| bursts << [channel_num, data] }
+
+			channel.receive_event( Ant::EVENT_RX_BURST_PACKET, burst_packet(0x00, 'abcdefgh') )
+			channel.receive_event( Ant::EVENT_RX_BURST_PACKET, burst_packet(0x20, 'ijklmnop') )
+			channel.receive_event( Ant::EVENT_RX_BURST_PACKET, burst_packet(0x40, 'qrstuvwx', last: true) )
+
+			expect( bursts ).to eq( [[channel_number, 'abcdefghijklmnopqrstuvwx']] )
+			expect( events ).to_not include( Ant::EVENT_RX_BURST_PACKET )
+			expect( channel.failed_bursts ).to eq( 0 )
+		end
+
+
+		it "wraps the sequence numbers of long transfers" do
+			bursts = []
+			channel.on_burst {|_, data| bursts << data }
+
+			sequences = [ 0x00, 0x20, 0x40, 0x60, 0x20, 0x40 ]
+			sequences.each_with_index do |sequence, i|
+				channel.receive_event( Ant::EVENT_RX_BURST_PACKET,
+					burst_packet(sequence, i.to_s * 8, last: i == sequences.length - 1) )
+			end
+
+			expect( bursts ).to eq( ['012345'.chars.map {|c| c * 8 }.join] )
+		end
+
+
+		it "discards transfers with missing packets" do
+			bursts = []
+			channel.on_burst {|_, data| bursts << data }
+
+			channel.receive_event( Ant::EVENT_RX_BURST_PACKET, burst_packet(0x00, 'abcdefgh') )
+			channel.receive_event( Ant::EVENT_RX_BURST_PACKET, burst_packet(0x40, 'qrstuvwx', last: true) )
+
+			expect( bursts ).to be_empty
+			expect( channel.failed_bursts ).to eq( 1 )
+		end
+
+
+		it "discards transfers that fail" do
+			bursts = []
+			channel.on_burst {|_, data| bursts << data }
+
+			channel.receive_event( Ant::EVENT_RX_BURST_PACKET, burst_packet(0x00, 'abcdefgh') )
+			channel.receive_event( Ant::EVENT_TRANSFER_RX_FAILED, channel_number.chr + "\x01\x04".b )
+			channel.receive_event( Ant::EVENT_RX_BURST_PACKET, burst_packet(0x00, 'abcdefgh', last: true) )
+
+			expect( bursts ).to eq( ['abcdefgh'] )
+			expect( channel.failed_bursts ).to eq( 1 )
+		end
+
+	end
+
+
+	describe "async sends", :hardware do
+
+		before( :each ) do
+			Ant.init
+		end
+
+
+		it "finishes an acknowledged send's future when the device acknowledges it" do
+			future = channel.send_acknowledged_data_async( payload )
+
+			expect( future ).to be_pending
+			channel.receive_event( Ant::EVENT_TRANSFER_TX_COMPLETED,
+				transfer_event(Ant::EVENT_TRANSFER_TX_COMPLETED) )
+
+			expect( future.wait(1) ).to be( true )
+			expect( future ).to be_completed
+			expect( future.result ).to eq( Ant::EVENT_TRANSFER_TX_COMPLETED )
+			expect( future.attempts ).to eq( 1 )
+		end
+
+
+		it "fails an acknowledged send's future when the transfer fails" do
+			future = channel.send_acknowledged_data_async( payload )
+
+			channel.receive_event( Ant::EVENT_TRANSFER_TX_FAILED,
+				transfer_event(Ant::EVENT_TRANSFER_TX_FAILED) )
+
+			expect( future.wait(1) ).to be( false )
+			expect( future ).to be_failed
+			expect( future.result ).to eq( Ant::EVENT_TRANSFER_TX_FAILED )
+		end
+
+
+		it "fails a broadcast's future when newer data replaces it before it goes out" do
+			replaced = channel.send_broadcast_data_async( payload )
+			sent = channel.send_broadcast_data_async( payload.reverse )
+
+			channel.receive_event( Ant::EVENT_TX, transfer_event(Ant::EVENT_TX) )
+
+			expect( Ant::Future.wait_all([replaced, sent], 1) ).to be( false )
+			expect( replaced.result ).to eq( Ant::EVENT_TRANSFER_TX_FAILED )
+			expect( sent ).to be_completed
+		end
+
+
+		it "fails the pending futures when the channel closes" do
+			futures = [
+				channel.send_acknowledged_data_async( payload ),
+				channel.send_broadcast_data_async( payload ),
+			]
+
+			channel.receive_event( Ant::EVENT_CHANNEL_CLOSED, transfer_event(Ant::EVENT_CHANNEL_CLOSED) )
+
+			expect( Ant::Future.wait_all(futures, 1) ).to be( false )
+			expect( futures.map(&:result) ).to all( eq(Ant::EVENT_CHANNEL_CLOSED) )
+		end
+
+
+		it "returns nil from a wait that times out" do
+			future = channel.send_acknowledged_data_async( payload )
+
+			expect( future.wait(0.01) ).to be_nil
+			expect( Ant::Future.wait_all([future], 0.01) ).to be_nil
+			expect( future ).to be_pending
+		end
+
+	end
+
+
+	describe "transmit queue", :hardware do
+
+		before( :each ) do
+			Ant.init
+		end
+
+
+		### Acknowledge the transfer the channel's transmit queue is sending.
+		def acknowledge( event_id=Ant::EVENT_TRANSFER_TX_COMPLETED )
+			channel.receive_event( event_id, transfer_event(event_id) )
+		end
+
+
+		it "sends one item at a time, as the one before it is acknowledged" do
+			futures = 3.times.map {|i| channel.queue_acknowledged_data(i.chr) }
+
+			expect( channel.tx_queue_length ).to eq( 3 )
+			expect( futures.map(&:attempts) ).to eq( [1, 0, 0] )
+
+			acknowledge()
+			expect( futures.first ).to be_completed
+			expect( futures.map(&:attempts) ).to eq( [1, 1, 0] )
+
+			2.times { acknowledge() }
+			expect( Ant::Future.wait_all(futures, 1) ).to be( true )
+			expect( channel.tx_queue_length ).to eq( 0 )
+		end
+
+
+		it "retries items that fail until they run out of retries" do
+			channel.tx_queue_retries = 1
+			future = channel.queue_acknowledged_data( payload )
+
+			acknowledge( Ant::EVENT_TRANSFER_TX_FAILED )
+			expect( future ).to be_pending
+			expect( future.attempts ).to eq( 2 )
+			expect( channel.tx_queue_retried ).to eq( 1 )
+
+			acknowledge( Ant::EVENT_TRANSFER_TX_FAILED )
+			expect( future.wait(1) ).to be( false )
+			expect( future.result ).to eq( Ant::EVENT_TRANSFER_TX_FAILED )
+		end
+
+
+		it "waits for the oldest item to finish when it's full" do
+			channel.tx_queue_depth = 1
+			first = channel.queue_acknowledged_data( payload )
+			queuer = Thread.new { channel.queue_acknowledged_data(payload.reverse) }
+
+			expect( queuer.join(0.1) ).to be_nil
+			expect( channel.tx_queue_length ).to eq( 1 )
+
+			acknowledge()
+			second = queuer.value
+
+			expect( first ).to be_completed
+			expect( second.attempts ).to eq( 1 )
+			expect( channel.tx_queue_length ).to eq( 1 )
+		end
+
+
+		it "fails the items that are left when the channel closes" do
+			futures = 3.times.map {|i| channel.queue_acknowledged_data(i.chr) }
+
+			acknowledge( Ant::EVENT_CHANNEL_CLOSED )
+
+			expect( Ant::Future.wait_all(futures, 1) ).to be( false )
+			expect( futures.map(&:result) ).to all( eq(Ant::EVENT_CHANNEL_CLOSED) )
+			expect( channel.tx_queue_length ).to eq( 0 )
+		end
+
+	end
+
+
+	describe "broadcast ring" do
+
+		it "is set up the first time data is pushed to it" do
+			expect( channel.broadcast_ring_size ).to eq( 0 )
+
+			expect( channel.push_broadcast_data(payload) ).to be( true )
+
+			expect( channel.broadcast_ring_size ).to eq( 16 )
+			expect( channel.broadcast_ring_length ).to eq( 1 )
+		end
+
+
+		it "refuses data once it's full" do
+			channel.broadcast_ring_size = 2
+
+			results = 3.times.map { channel.push_broadcast_data(payload) }
+
+			expect( results ).to eq( [true, true, false] )
+			expect( channel.broadcast_ring_length ).to eq( 2 )
+		end
+
+
+		it "refuses payloads that are longer than 8 bytes" do
+			expect {
+				channel.push_broadcast_data( payload + "\x00" )
+			}.to raise_error( ArgumentError, /longer than 8 bytes/i )
+		end
+
+
+		it "keeps the payloads that are waiting in it when it's resized" do
+			channel.broadcast_ring_size = 2
+			2.times { channel.push_broadcast_data(payload) }
+
+			channel.broadcast_ring_size = 4
+
+			expect( channel.broadcast_ring_length ).to eq( 2 )
+			expect {
+				channel.broadcast_ring_size = 1
+			}.to raise_error( ArgumentError, /still has 2 payloads/i )
+		end
+
+
+		it "can be cleared" do
+			3.times { channel.push_broadcast_data(payload) }
+
+			channel.clear_broadcast_ring
+
+			expect( channel.broadcast_ring_length ).to eq( 0 )
+		end
+
+
+		it "counts the message periods it was empty for" do
+			channel.push_broadcast_data( payload )
+			channel.clear_broadcast_ring
+
+			2.times { channel.receive_event(Ant::EVENT_TX, transfer_event(Ant::EVENT_TX)) }
+
+			expect( channel.broadcast_ring_underruns ).to eq( 2 )
+			expect( channel.broadcast_ring_sent ).to eq( 0 )
+		end
+
+
+		it "asks for more payloads when it runs low" do
+			requests = []
+			channel.broadcast_ring_size = 4
+			channel.on_broadcast_ring_low( 1 ) do |channel_num, space|
+				requests << [ channel_num, space ]
+				[ payload, payload.reverse ]
+			end
+
+			channel.receive_event( Ant::EVENT_TX, transfer_event(Ant::EVENT_TX) )
+
+			expect( requests ).to eq( [[channel_number, 4]] )
+			expect( channel.broadcast_ring_length ).to eq( 2 )
+		end
+
+
+		it "sends the next payload on each EVENT_TX", :hardware do
+			Ant.init
+			2.times { channel.push_broadcast_data(payload) }
+
+			channel.receive_event( Ant::EVENT_TX, transfer_event(Ant::EVENT_TX) )
+
+			expect( channel.broadcast_ring_sent ).to eq( 1 )
+			expect( channel.broadcast_ring_length ).to eq( 1 )
+			expect( channel.broadcast_ring_underruns ).to eq( 0 )
+		end
+
+	end
+
+end
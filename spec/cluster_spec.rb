@@ -0,0 +1,195 @@
+# -*- ruby -*-
+# frozen_string_literal: true
+
+require_relative 'spec_helper'
+
+require 'ant/cluster'
+
+
+RSpec.describe( Ant::Cluster ) do
+
+	# A simulated ANT library for the workers, which sends its channels' events
+	# through their native sinks like the receive thread would.
+	let( :backend ) do
+		Module.new do
+			def self::init( device )
+				raise "no ANT device present" if device == 99
+				@device = device
+				@assigned = []
+			end
+
+			def self::close
+			end
+
+			def self::device
+				return @device
+			end
+
+			def self::pid
+				return Process.pid
+			end
+
+			def self::assign_channel( channel_num, * )
+				raise "channel %d is already assigned" % [ channel_num ] if
+					@assigned.include?( channel_num )
+				@assigned << channel_num
+
+				device = @device
+				assigned = @assigned
+				sinks = []
+
+				channel = Object.new
+				channel.define_singleton_method( :add_native_sink ) {|sink| sinks << sink }
+				channel.define_singleton_method( :close ) {|*| true }
+				channel.define_singleton_method( :unassign ) {|*| assigned.delete(channel_num) && true }
+				channel.define_singleton_method( :set_channel_period ) do |period|
+					raise ArgumentError, "invalid channel period %p" % [ period ]
+				end
+				channel.define_singleton_method( :open ) do
+					sinks.each {|sink| sink.push(channel_num, Ant::EVENT_TX, device.chr) }
+					true
+				end
+				channel.define_singleton_method( :send_broadcast_data ) do |data|
+					sinks.each {|sink| sink.push(channel_num, Ant::EVENT_RX_BROADCAST, data) }
+					true
+				end
+
+				return channel
+			end
+		end
+	end
+
+	let( :cluster ) do
+		described_class.new( devices: [0, 1], channels_per_device: 2, backend: backend )
+	end
+
+	after( :each ) do
+		@cluster&.close
+	end
+
+
+	### Collect the events from the given +channels+ into a Queue.
+	def collect_events( *channels )
+		queue = Queue.new
+		channels.each do |channel|
+			channel.on_event {|*event| queue << [channel.device, *event] }
+		end
+		return queue
+	end
+
+
+	it "starts a worker process for each device" do
+		@cluster = cluster
+
+		expect( cluster.workers.map(&:device) ).to eq( [0, 1] )
+		expect( cluster.workers ).to all( be_running )
+
+		pids = cluster.workers.map {|worker| worker.call(:pid) }
+		expect( pids.uniq.length ).to eq( 2 )
+		expect( pids ).to_not include( Process.pid )
+		expect( cluster.workers.map {|worker| worker.call(:device) } ).to eq( [0, 1] )
+	end
+
+
+	it "spreads channels across its devices" do
+		@cluster = cluster
+
+		channels = 4.times.map { cluster.assign_channel(Ant::PARAMETER_RX_NOT_TX) }
+
+		expect( channels.map {|ch| [ch.device, ch.channel_number]} ).
+			to eq( [[0, 0], [1, 0], [0, 1], [1, 1]] )
+		expect {
+			cluster.assign_channel( Ant::PARAMETER_RX_NOT_TX )
+		}.to raise_error( RuntimeError, /no free channels/i )
+	end
+
+
+	it "can assign a channel on a particular device" do
+		@cluster = cluster
+
+		channel = cluster.assign_channel( Ant::PARAMETER_RX_NOT_TX, device: 1 )
+
+		expect( channel.device ).to eq( 1 )
+		expect( channel.channel_number ).to eq( 0 )
+	end
+
+
+	it "forwards the events of each channel from its worker" do
+		@cluster = cluster
+		channels = 2.times.map { cluster.assign_channel(Ant::PARAMETER_RX_NOT_TX) }
+		events = collect_events( *channels )
+
+		channels.each( &:open )
+		received = 2.times.map { events.pop }.sort
+
+		expect( received ).to eq([
+			[ 0, 0, Ant::EVENT_TX, "\x00".b ],
+			[ 1, 0, Ant::EVENT_TX, "\x01".b ],
+		])
+	end
+
+
+	it "keeps the events of each channel in order" do
+		@cluster = cluster
+		channel = cluster.assign_channel( Ant::PARAMETER_TX_NOT_RX )
+		events = collect_events( channel )
+
+		200.times {|i| channel.send_broadcast_data([i].pack('n')) }
+		received = 200.times.map { events.pop.last.unpack1('n') }
+
+		expect( received ).to eq( (0...200).to_a )
+		expect( cluster.dropped_events ).to eq( 0 )
+	end
+
+
+	it "passes events for channels without a callback to its own" do
+		@cluster = cluster
+		channel = cluster.assign_channel( Ant::PARAMETER_TX_NOT_RX )
+		events = Queue.new
+		cluster.on_event {|*event| events << event }
+
+		channel.send_broadcast_data( "hi" )
+
+		expect( events.pop ).to eq( [channel, Ant::EVENT_RX_BROADCAST, "hi".b] )
+	end
+
+
+	it "raises the errors from commands that fail in a worker" do
+		@cluster = cluster
+		channel = cluster.assign_channel( Ant::PARAMETER_TX_NOT_RX )
+
+		expect {
+			channel.set_channel_period( -1 )
+		}.to raise_error( ArgumentError, /invalid channel period -1/i )
+	end
+
+
+	it "frees a closed channel's number for reuse" do
+		@cluster = cluster
+		channel = cluster.assign_channel( Ant::PARAMETER_TX_NOT_RX, device: 0 )
+
+		channel.close
+
+		expect( channel ).to be_closed
+		expect( cluster.channels ).to be_empty
+		expect( cluster.assign_channel(Ant::PARAMETER_TX_NOT_RX, device: 0).channel_number ).to eq( 0 )
+	end
+
+
+	it "stops its workers when it's closed" do
+		@cluster = cluster
+		workers = cluster.workers
+
+		cluster.close
+
+		expect( workers ).to all( satisfy {|worker| !worker.running? } )
+	end
+
+
+	it "raises if a worker can't initialize its device" do
+		expect {
+			described_class.new( devices: [0, 99], backend: backend )
+		}.to raise_error( RuntimeError, /no ANT device present/i )
+	end
+
+end
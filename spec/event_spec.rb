@@ -0,0 +1,151 @@
+# -*- ruby -*-
+# frozen_string_literal: true
+
+require_relative 'spec_helper'
+
+require 'ant'
+
+
+RSpec.describe( Ant::Event ) do
+
+	let( :payload ) { [1, 2, 3, 4, 5, 6, 7, 8].pack('C*') }
+
+	let( :all_flags ) do
+		Ant::ANT_EXT_MESG_BITFIELD_DEVICE_ID |
+			Ant::ANT_LIB_CONFIG_MESG_OUT_INC_RSSI |
+			Ant::ANT_LIB_CONFIG_MESG_OUT_INC_TIME_STAMP
+	end
+
+	# Flagged extended data with a channel ID of 4657/120/5, an RSSI of -60 dBm,
+	# and a timestamp of 4660
+	let( :flagged_data ) do
+		"\x01".b + payload + [ all_flags, 0x1231, 120, 5, 0x20, -60, 0, 0x1234 ].pack( 'CvCCCcCv' )
+	end
+
+
+	it "is frozen when it's created" do
+		event = described_class.new( 1, Ant::EVENT_RX_BROADCAST, "\x01".b + payload )
+
+		expect( event ).to be_frozen
+		expect( event.data ).to be_frozen
+		expect( event.payload ).to be_frozen
+	end
+
+
+	it "knows what channel and event it's for" do
+		event = described_class.new( 3, Ant::EVENT_RX_BROADCAST, "\x03".b + payload )
+
+		expect( event.channel ).to eq( 3 )
+		expect( event.event_id ).to eq( Ant::EVENT_RX_BROADCAST )
+		expect( event.data ).to eq( "\x03".b + payload )
+		expect( event.data.encoding ).to eq( Encoding::ASCII_8BIT )
+	end
+
+
+	it "decodes the payload of a plain receive event" do
+		event = described_class.new( 1, Ant::EVENT_RX_BROADCAST, "\x01".b + payload )
+
+		expect( event.payload ).to eq( payload )
+		expect( event.flags ).to be_nil
+		expect( event.device_number ).to be_nil
+		expect( event.rssi ).to be_nil
+		expect( event.timestamp ).to be_nil
+	end
+
+
+	it "only decodes its fields once" do
+		event = described_class.new( 1, Ant::EVENT_RX_BROADCAST, "\x01".b + payload )
+
+		expect( event.payload ).to be( event.payload )
+		expect( event.data ).to be( event.data )
+	end
+
+
+	it "decodes the fields of flagged extended data" do
+		event = described_class.new( 1, Ant::EVENT_RX_FLAG_BROADCAST, flagged_data )
+
+		expect( event.payload ).to eq( payload )
+		expect( event.flags ).to eq( all_flags )
+		expect( event.device_number ).to eq( 0x1231 )
+		expect( event.device_type ).to eq( 120 )
+		expect( event.transmission_type ).to eq( 5 )
+		expect( event.rssi ).to eq( -60 )
+		expect( event.timestamp ).to eq( 0x1234 )
+	end
+
+
+	it "only decodes the flagged fields that are present" do
+		flags = Ant::ANT_LIB_CONFIG_MESG_OUT_INC_TIME_STAMP
+		data = "\x01".b + payload + [ flags, 0x1234 ].pack( 'Cv' )
+		event = described_class.new( 1, Ant::EVENT_RX_FLAG_BROADCAST, data )
+
+		expect( event.flags ).to eq( flags )
+		expect( event.device_number ).to be_nil
+		expect( event.rssi ).to be_nil
+		expect( event.timestamp ).to eq( 0x1234 )
+	end
+
+
+	it "doesn't decode fields from truncated data" do
+		event = described_class.new( 1, Ant::EVENT_RX_FLAG_BROADCAST, flagged_data[0, 12] )
+
+		expect( event.flags ).to eq( all_flags )
+		expect( event.device_number ).to be_nil
+		expect( event.rssi ).to be_nil
+		expect( event.timestamp ).to be_nil
+	end
+
+
+	it "doesn't have a payload if it's a channel response" do
+		event = described_class.new( 1, Ant::EVENT_TX, "\x01\x01\x03".b )
+
+		expect( event.payload ).to be_nil
+		expect( event.flags ).to be_nil
+	end
+
+
+	it "can be converted to a Hash" do
+		event = described_class.new( 1, Ant::EVENT_RX_FLAG_BROADCAST, flagged_data )
+
+		expect( event.to_h ).to eq(
+			channel: 1,
+			event_id: Ant::EVENT_RX_FLAG_BROADCAST,
+			payload: payload,
+			flags: all_flags,
+			device_number: 0x1231,
+			device_type: 120,
+			transmission_type: 5,
+			rssi: -60,
+			timestamp: 0x1234
+		)
+	end
+
+
+	it "only deconstructs the keys it's asked for" do
+		event = described_class.new( 1, Ant::EVENT_RX_FLAG_BROADCAST, flagged_data )
+
+		expect( event.deconstruct_keys([:device_number, :rssi, :bogus]) ).
+			to eq( device_number: 0x1231, rssi: -60 )
+	end
+
+
+	it "can be pattern-matched" do
+		event = described_class.new( 1, Ant::EVENT_RX_FLAG_BROADCAST, flagged_data )
+
+		result = case event
+			in { event_id: Ant::EVENT_RX_FLAG_BROADCAST, device_number:, rssi: }
+				[ device_number, rssi ]
+			end
+
+		expect( result ).to eq( [0x1231, -60] )
+	end
+
+
+	it "can't be created with more data than a message can hold" do
+		expect {
+			described_class.new( 1, Ant::EVENT_RX_BROADCAST, "\x00".b * (Ant::Message::MESG_MAX_SIZE + 1) )
+		}.to raise_error( ArgumentError, /can't be longer/i )
+	end
+
+end
+
@@ -0,0 +1,46 @@
+# -*- ruby -*-
+# frozen_string_literal: true
+
+require_relative 'spec_helper'
+
+require 'ant'
+
+
+RSpec.describe( Ant::Message ) do
+
+	it "knows the payload size of fixed-size messages" do
+		expect( described_class.payload_size(described_class::MESG_CHANNEL_ID_ID) ).to eq( 5 )
+		expect( described_class.payload_size(described_class::MESG_RESPONSE_EVENT_ID) ).to eq( 3 )
+		expect( described_class.payload_size(described_class::MESG_CAPABILITIES_ID) ).to eq( 8 )
+	end
+
+
+	it "uses the maximum size for messages it doesn't know the size of" do
+		expect( described_class.payload_size(described_class::MESG_INVALID_ID) ).
+			to eq( described_class::MESG_MAX_SIZE_VALUE )
+	end
+
+
+	it "sizes receive events by their type" do
+		expect( described_class.event_size(Ant::EVENT_RX_BROADCAST, '') ).to eq( 9 )
+		expect( described_class.event_size(Ant::EVENT_RX_EXT_ACKNOWLEDGED, '') ).to eq( 13 )
+		expect( described_class.event_size(Ant::EVENT_RX_RSSI_BURST_PACKET, '') ).to eq( 17 )
+	end
+
+
+	it "sizes flagged extended data by its flag byte" do
+		data = "\x00".b * described_class::MESG_DATA_SIZE
+
+		expect( described_class.event_size(Ant::EVENT_RX_FLAG_BROADCAST, data + "\x00".b) ).to eq( 10 )
+		expect( described_class.event_size(Ant::EVENT_RX_FLAG_BROADCAST, data + "\x80".b) ).to eq( 14 )
+		expect( described_class.event_size(Ant::EVENT_RX_FLAG_BROADCAST, data + "\xE0".b) ).to eq( 19 )
+	end
+
+
+	it "sizes channel responses as response events" do
+		expect( described_class.event_size(Ant::EVENT_TX, '') ).to eq( 3 )
+		expect( described_class.event_size(Ant::EVENT_CHANNEL_CLOSED, '') ).to eq( 3 )
+	end
+
+end
+
@@ -0,0 +1,93 @@
+# -*- ruby -*-
+# frozen_string_literal: true
+
+require_relative 'spec_helper'
+
+require 'ant'
+
+
+RSpec.describe( Ant::NativeSink::Ring ) do
+
+	let( :data ) { "\x01".b + [1, 2, 3, 4, 5, 6, 7, 8].pack('C*') }
+
+
+	it "rounds its capacity up to a power of two" do
+		expect( described_class.new(100).capacity ).to eq( 128 )
+		expect( described_class.new.capacity ).to eq( 1024 )
+	end
+
+
+	it "rejects capacities that are out of range" do
+		expect {
+			described_class.new( 0 )
+		}.to raise_error( ArgumentError, /capacity must be between/i )
+	end
+
+
+	it "returns the events pushed onto it in order" do
+		ring = described_class.new( 4 )
+
+		ring.push( 1, Ant::EVENT_RX_BROADCAST, data )
+		ring.push( 2, Ant::EVENT_TX, "\x02\x01\x03".b )
+
+		expect( ring.length ).to eq( 2 )
+		expect( ring.shift ).to eq( [1, Ant::EVENT_RX_BROADCAST, data] )
+		expect( ring.shift ).to eq( [2, Ant::EVENT_TX, "\x02\x01\x03".b] )
+		expect( ring.shift ).to be_nil
+		expect( ring.length ).to eq( 0 )
+	end
+
+
+	it "drops events that arrive while it's full" do
+		ring = described_class.new( 2 )
+
+		expect( ring.push(1, Ant::EVENT_RX_BROADCAST, data) ).to be( true )
+		expect( ring.push(1, Ant::EVENT_RX_BROADCAST, data) ).to be( true )
+		expect( ring.push(1, Ant::EVENT_RX_BROADCAST, data) ).to be( false )
+
+		expect( ring.dropped ).to eq( 1 )
+		expect( ring.length ).to eq( 2 )
+	end
+
+
+	it "rejects events with more data than a message can hold" do
+		ring = described_class.new
+
+		expect {
+			ring.push( 1, Ant::EVENT_RX_BROADCAST, "\x00".b * (Ant::Message::MESG_MAX_SIZE + 1) )
+		}.to raise_error( ArgumentError, /can't be longer/i )
+	end
+
+
+	it "can wait for an event to arrive" do
+		ring = described_class.new
+
+		expect( ring.wait(0.01) ).to be( false )
+
+		pusher = Thread.new do
+			sleep 0.05
+			ring.push( 1, Ant::EVENT_RX_BROADCAST, data )
+		end
+
+		expect( ring.wait(5) ).to be( true )
+		expect( ring.shift ).to eq( [1, Ant::EVENT_RX_BROADCAST, data] )
+	ensure
+		pusher&.join
+	end
+
+
+	it "shares its events with a process forked after it's created" do
+		ring = described_class.new
+
+		pid = Process.fork do
+			ring.push( 3, Ant::EVENT_RX_BROADCAST, data )
+			exit!( 0 )
+		end
+		Process.wait( pid )
+
+		expect( ring.wait(5) ).to be( true )
+		expect( ring.shift ).to eq( [3, Ant::EVENT_RX_BROADCAST, data] )
+	end
+
+end
+